@@ -0,0 +1,360 @@
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+
+ThreadPool::ThreadPool(unsigned threads) : no_threads(threads > 0 ? threads : 1), stopping(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+    shutdown();
+}
+
+void
+ThreadPool::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    for (unsigned i = 0; i < threads.size(); i++)
+        threads[i].join();
+    threads.clear();
+}
+
+void
+ThreadPool::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (threads.empty()) {
+            for (unsigned i = 0; i < no_threads; i++)
+                threads.push_back(std::thread(&ThreadPool::run, this));
+        }
+        tasks.push_back(task);
+    }
+    cond.notify_one();
+}
+
+void
+ThreadPool::run()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (tasks.empty() && !stopping)
+                cond.wait(guard);
+            if (tasks.empty())
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void
+disk_request::complete(bool ok)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!ok)
+        failed = true;
+    // the waiter may destroy the request as soon as it sees pending at 0
+    if (--pending == 0)
+        cond.notify_all();
+}
+
+int
+disk_request::wait()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (pending > 0)
+        cond.wait(guard);
+    return failed ? -1 : 0;
+}
+
+bool
+disk_request::done()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return pending == 0;
+}
+
+AsyncIO::AsyncIO() : started(false), ring_fd(-1), sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr),
+    in_flight(0), sq_busy(false), broken(false), pool(AIO_THREADS)
+{
+}
+
+AsyncIO::~AsyncIO()
+{
+    if (ring_fd < 0)
+        return;
+    // a no-op without a part tells the reaper to stop, everything
+    // submitted before it has completed by then. A reaper that saw the
+    // ring fail has stopped already.
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while ((in_flight >= cq_entries || sq_busy) && !broken)
+            room.wait(guard);
+        if (!broken) {
+            unsigned tail = *sq_tail;
+            unsigned idx = tail & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+            sq_array[idx] = idx;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            in_flight++;
+            while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) < 0 && errno == EINTR)
+                ;
+        }
+    }
+    reaper.join();
+    munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+bool
+AsyncIO::uses_uring()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    start();
+    return ring_fd >= 0 && !broken;
+}
+
+// the ring is set up by the first transfer, a disk that never has one
+// costs nothing. Called with the lock held.
+void
+AsyncIO::start()
+{
+    if (started)
+        return;
+    started = true;
+    if (setup_ring())
+        reaper = std::thread(&AsyncIO::reap, this);
+}
+
+bool
+AsyncIO::setup_ring()
+{
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p);
+    if (fd < 0)
+        return false;
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels map both rings with one call
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    cq_ring = single ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *s = mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (cq_ring == MAP_FAILED || s == MAP_FAILED) {
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (s != MAP_FAILED)
+            munmap(s, p.sq_entries * sizeof(struct io_uring_sqe));
+        munmap(sq_ring, sq_ring_size);
+        close(fd);
+        return false;
+    }
+    sqes = (struct io_uring_sqe*)s;
+    uint8_t *sq = (uint8_t*)sq_ring;
+    uint8_t *cq = (uint8_t*)cq_ring;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    cq_entries = p.cq_entries;
+    ring_fd = fd;
+    return true;
+}
+
+// starts the parts of req, req->iov and req->parts are filled in
+void
+AsyncIO::submit(disk_request *req)
+{
+    {
+        std::lock_guard<std::mutex> guard(req->lock);
+        req->pending = req->parts.size();
+    }
+    // req may be gone once its last part has completed, only the parts
+    // not started yet are looked at after a submission
+    unsigned count = req->parts.size();
+    if (count == 0)
+        return;
+    aio_part *parts = &req->parts[0];
+    std::unique_lock<std::mutex> guard(lock);
+    start();
+    // the kernel takes all queued entries with each io_uring_enter(), the
+    // queue is empty between calls
+    unsigned i = 0;
+    while (i < count) {
+        while (ring_fd >= 0 && !broken && (in_flight >= cq_entries || sq_busy))
+            room.wait(guard);
+        if (ring_fd < 0 || broken)
+            break;
+        unsigned n = std::min<unsigned>(count - i, std::min(sq_entries, cq_entries - in_flight));
+        unsigned tail = *sq_tail;
+        for (unsigned k = 0; k < n; k++) {
+            aio_part *part = &parts[i + k];
+            unsigned idx = (tail + k) & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = part->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = part->fd;
+            sqe->off = part->offset;
+            sqe->addr = (uint64_t)(uintptr_t)&part->req->iov[part->iov_index];
+            sqe->len = part->iov_count;
+            sqe->user_data = (uint64_t)(uintptr_t)part;
+            sq_array[idx] = idx;
+            ring_parts.insert(part);
+        }
+        __atomic_store_n(sq_tail, tail + n, __ATOMIC_RELEASE);
+        in_flight += n;
+        unsigned submitted = 0;
+        while (submitted < n) {
+            int res = syscall(__NR_io_uring_enter, ring_fd, n - submitted, 0, 0, nullptr, 0);
+            if (res > 0) {
+                submitted += res;
+                continue;
+            }
+            if (res < 0 && errno == EINTR)
+                continue;
+            // the kernel has no room until a transfer in flight completes.
+            // The reaper takes the completions, so waiting for them in
+            // io_uring_enter() here could miss the last one; it signals
+            // room instead.
+            unsigned queued = n - submitted;
+            if (res < 0 && (errno == EAGAIN || errno == EBUSY) && in_flight > queued) {
+                unsigned seen = in_flight;
+                sq_busy = true;
+                while (in_flight == seen && !broken)
+                    room.wait(guard);
+                sq_busy = false;
+                room.notify_all();
+                if (!broken)
+                    continue;
+            }
+            break;
+        }
+        // entries the kernel refused fail, the ring is left empty.
+        // fail_ring() has failed them already if the ring broke meanwhile.
+        if (submitted < n) {
+            __atomic_store_n(sq_tail, tail + submitted, __ATOMIC_RELEASE);
+            if (!broken) {
+                in_flight -= n - submitted;
+                for (unsigned k = submitted; k < n; k++) {
+                    ring_parts.erase(&parts[i + k]);
+                    parts[i + k].req->complete(false);
+                }
+            }
+        }
+        i += n;
+    }
+    guard.unlock();
+    // without a ring the pool does the rest
+    for (; i < count; i++) {
+        aio_part *part = &parts[i];
+        pool.post([this, part] { transfer(part); });
+    }
+}
+
+// one part with the system calls, for the pool
+void
+AsyncIO::transfer(aio_part *part)
+{
+    struct iovec *iov = &part->req->iov[part->iov_index];
+    ssize_t n = part->write ? pwritev(part->fd, iov, part->iov_count, part->offset)
+                            : preadv(part->fd, iov, part->iov_count, part->offset);
+    part->req->complete(n == (ssize_t)part->length);
+}
+
+// waits for completions and passes them on until the no-op of the
+// destructor comes back
+void
+AsyncIO::reap()
+{
+    std::vector<std::pair<aio_part*, int32_t>> done;
+    bool stopping = false;
+    while (!stopping) {
+        int res = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (res < 0 && errno != EINTR) {
+            fail_ring();
+            return;
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        done.clear();
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            done.push_back(std::make_pair((aio_part*)(uintptr_t)cqe->user_data, cqe->res));
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (done.empty())
+            continue;
+        // taking the lock the submitter held also orders its writes of the
+        // parts before the reads below, where the ring does not show it
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            in_flight -= done.size();
+            for (unsigned i = 0; i < done.size(); i++)
+                ring_parts.erase(done[i].first);
+            room.notify_all();
+        }
+        for (unsigned i = 0; i < done.size(); i++) {
+            aio_part *part = done[i].first;
+            if (part == nullptr) {
+                stopping = true;
+                continue;
+            }
+            // a short transfer only happens past the end of the file
+            part->req->complete(done[i].second == (int32_t)part->length);
+        }
+    }
+}
+
+// the reaper can't wait for completions any more, the transfers in the
+// ring would never end. They fail, and later ones go to the pool.
+void
+AsyncIO::fail_ring()
+{
+    std::vector<aio_part*> parts;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        broken = true;
+        parts.assign(ring_parts.begin(), ring_parts.end());
+        ring_parts.clear();
+        in_flight = 0;
+        room.notify_all();
+    }
+    for (unsigned i = 0; i < parts.size(); i++)
+        parts[i]->req->complete(false);
+}
@@ -0,0 +1,127 @@
+#include <cstdint>
+#include <vector>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/uio.h>
+
+#ifndef __AIO_H__
+#define __AIO_H__
+
+// entries of the io_uring submission queue, more transfers wait for room
+#define AIO_QUEUE_DEPTH 64
+// threads doing the transfers when there is no io_uring
+#define AIO_THREADS 4
+
+// runs tasks on a fixed number of threads, started with the first task
+class ThreadPool {
+private:
+    unsigned no_threads;
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stopping;
+    void run();
+public:
+    ThreadPool(unsigned threads);
+    // waits for the tasks that have been posted
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    void post(std::function<void()> task);
+    // waits for the tasks that have been posted and stops the threads, no
+    // task may be posted after
+    void shutdown();
+};
+
+class disk_request;
+
+// a transfer of a run of blocks, one preadv/pwritev or io_uring request
+struct aio_part {
+    disk_request *req;
+    bool write;
+    int fd;
+    uint64_t offset;
+    unsigned iov_index;
+    unsigned iov_count;
+    uint32_t length;
+};
+
+// block transfers in flight, see Disk::start_readv(). The parts complete
+// in any order, wait() returns once all of them have. The request must not
+// be destroyed before that.
+class disk_request {
+private:
+    friend class AsyncIO;
+    friend class Disk;
+    std::mutex lock;
+    std::condition_variable cond;
+    unsigned pending;
+    bool failed;
+    // kept until the transfers are done, the kernel reads them
+    std::vector<struct iovec> iov;
+    std::vector<aio_part> parts;
+    void complete(bool ok);
+public:
+    disk_request() : pending(0), failed(false) {}
+    // returns 0 if every transfer succeeded, else -1
+    int wait();
+    // true once wait() would return at once
+    bool done();
+};
+
+// Transfers runs of blocks without waiting for them. The requests go to
+// an io_uring, a thread reaps the completions. Where the kernel has no
+// io_uring, or it is not allowed, a pool of threads does them with
+// preadv/pwritev instead. So does it after the ring failed, the transfers
+// in the ring then fail.
+class AsyncIO {
+private:
+    std::mutex lock;
+    bool started;
+    int ring_fd;
+    // the rings shared with the kernel
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // requests submitted and not reaped, at most cq_entries so no
+    // completion is lost
+    unsigned in_flight;
+    // the parts those requests are for
+    std::unordered_set<aio_part*> ring_parts;
+    // a submitter waits for room in the kernel with its entries queued,
+    // the others leave the queue alone until it is done
+    bool sq_busy;
+    // the ring failed, the pool does the transfers from then on
+    bool broken;
+    std::condition_variable room;
+    std::thread reaper;
+    ThreadPool pool;
+
+    void start();
+    bool setup_ring();
+    void reap();
+    void fail_ring();
+    void transfer(aio_part *part);
+public:
+    AsyncIO();
+    ~AsyncIO();
+    AsyncIO(const AsyncIO &) = delete;
+    AsyncIO &operator=(const AsyncIO &) = delete;
+    // starts the parts of req, req->iov and req->parts are filled in
+    void submit(disk_request *req);
+    bool uses_uring();
+};
+
+#endif // __AIO_H__
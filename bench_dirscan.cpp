@@ -0,0 +1,146 @@
+// Compares the per-entry strcmp loop that used to search a directory with
+// dir_scan, for every implementation the CPU supports. Checks that they
+// agree on the way.
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include "dirscan.h"
+
+#define SCAN_ROUNDS 200000
+#define DIR_SLOTS 64
+
+// the old loop of FS::find_file
+static int
+find_loop(const dir_entry *dir, const char *name)
+{
+    for (int i = 0; i < DIR_SLOTS; i++) {
+        if (std::strcmp(dir[i].file_name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+find_scan(const dir_entry *dir, const char *name)
+{
+    uint64_t match, empty;
+    dir_scan(dir, DIR_SLOTS, name, &match, &empty);
+    while (match != 0) {
+        int i = __builtin_ctzll(match);
+        if (std::strcmp(dir[i].file_name, name) == 0)
+            return i;
+        match &= match - 1;
+    }
+    return -1;
+}
+
+static double
+elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// a full directory but for the last slot, names from name(i)
+static void
+fill(dir_entry *dir, std::string (*name)(int))
+{
+    std::memset(dir, 0, sizeof(dir_entry) * DIR_SLOTS);
+    for (int i = 0; i < DIR_SLOTS - 1; i++)
+        std::strncpy(dir[i].file_name, name(i).c_str(), sizeof(dir[i].file_name) - 1);
+}
+
+static std::string
+distinct_name(int i)
+{
+    static const char *words[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel" };
+    return std::string(words[i % 8]) + std::to_string(i);
+}
+
+static std::string
+prefixed_name(int i)
+{
+    return "file" + std::to_string(i);
+}
+
+// ns per lookup of every name in the directory and one missing name
+static double
+time_lookups(const dir_entry *dir, int (*find)(const dir_entry*, const char*), long *sum)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < SCAN_ROUNDS / DIR_SLOTS; r++) {
+        for (int i = 0; i < DIR_SLOTS; i++)
+            *sum += find(dir, dir[i].file_name[0] ? dir[i].file_name : "missing");
+    }
+    return elapsed_ns(start) / (SCAN_ROUNDS / DIR_SLOTS * DIR_SLOTS);
+}
+
+int
+main(int argc, char **argv)
+{
+    dir_entry dir[DIR_SLOTS];
+    struct { const char *label; std::string (*name)(int); } sets[] = {
+        { "distinct names", distinct_name },
+        { "common prefix ", prefixed_name },
+    };
+    int failed = 0;
+
+    for (unsigned s = 0; s < 2; s++) {
+        fill(dir, sets[s].name);
+        long expect = 0;
+        double loop_ns = time_lookups(dir, find_loop, &expect);
+        std::cout << sets[s].label << "  strcmp loop: " << loop_ns << " ns per lookup\n";
+
+        for (int impl = DIR_SCAN_SCALAR; impl <= DIR_SCAN_AVX2; impl++) {
+            if (dir_scan_set_impl(impl) != impl)
+                continue;
+            for (int i = 0; i < DIR_SLOTS; i++) {
+                const char *name = dir[i].file_name[0] ? dir[i].file_name : "missing";
+                if (find_scan(dir, name) != find_loop(dir, name))
+                    failed++;
+            }
+            long sum = 0;
+            double ns = time_lookups(dir, find_scan, &sum);
+            if (sum != expect)
+                failed++;
+            std::cout << sets[s].label << "  dir_scan " << dir_scan_impl_name(impl) << ": ";
+            std::cout << ns << " ns per lookup\n";
+        }
+    }
+
+    // the free slot search, the last slot is the only free one
+    fill(dir, distinct_name);
+    for (int impl = DIR_SCAN_SCALAR; impl <= DIR_SCAN_AVX2; impl++) {
+        if (dir_scan_set_impl(impl) != impl)
+            continue;
+        long sum = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int r = 0; r < SCAN_ROUNDS; r++) {
+            uint64_t match, empty;
+            dir_scan(dir, DIR_SLOTS, "", &match, &empty);
+            sum += __builtin_ctzll(empty);
+        }
+        double ns = elapsed_ns(start) / SCAN_ROUNDS;
+        if (sum != (long)SCAN_ROUNDS * (DIR_SLOTS - 1))
+            failed++;
+        std::cout << "free slot       dir_scan " << dir_scan_impl_name(impl) << ": " << ns << " ns\n";
+    }
+    long sum = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < SCAN_ROUNDS; r++) {
+        int i;
+        for (i = 0; i < DIR_SLOTS; i++) {
+            if (dir[i].file_name[0] == '\0')
+                break;
+        }
+        sum += i;
+    }
+    if (sum != (long)SCAN_ROUNDS * (DIR_SLOTS - 1))
+        failed++;
+    std::cout << "free slot       loop: " << elapsed_ns(start) / SCAN_ROUNDS << " ns\n";
+
+    if (failed)
+        std::cout << failed << " results differ from the loop\n";
+    return failed ? 1 : 0;
+}
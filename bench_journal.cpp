@@ -0,0 +1,58 @@
+// Measures how many small files per second can be created when the
+// metadata journal is committed after every operation and when commits
+// are grouped. Every commit syncs the disk.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include "fs.h"
+
+#define JOURNAL_FILES 200
+
+// output of the file system is not interesting here
+struct quiet {
+    std::streambuf *old;
+    std::ostringstream sink;
+    quiet() { old = std::cout.rdbuf(sink.rdbuf()); }
+    ~quiet() { std::cout.rdbuf(old); }
+};
+
+static double
+elapsed_us(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned intervals[] = { 1, 8, 64 };
+    int failed = 0;
+    for (unsigned k = 0; k < 3; k++) {
+        journal_stats js;
+        double us;
+        {
+            quiet q;
+            FS fs(CACHE_DEFAULT_CAPACITY, DISK_PREAD);
+            fs.format();
+            fs.set_commit_interval(intervals[k]);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int f = 0; f < JOURNAL_FILES; f++) {
+                std::istringstream in("data\n\n");
+                std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+                if (fs.create("file" + std::to_string(f)) != 0)
+                    failed++;
+                std::cin.rdbuf(old);
+            }
+            fs.sync();
+            us = elapsed_us(start);
+            js = fs.get_journal_stats();
+        }
+        std::cout << "commit every " << intervals[k] << " ops: " << JOURNAL_FILES * 1e6 / us
+                  << " creates/s, " << js.commits << " commits, " << js.blocks << " journal blocks\n";
+    }
+    if (failed)
+        std::cout << failed << " creates failed\n";
+    return failed ? 1 : 0;
+}
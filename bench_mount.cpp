@@ -0,0 +1,73 @@
+// Measures how long it takes to mount a full 8 MiB image, compared with
+// reading every block of it.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include "fs.h"
+
+#define MOUNT_ROUNDS 1000
+
+// output of the file system is not interesting here
+struct quiet {
+    std::streambuf *old;
+    std::ostringstream sink;
+    quiet() { old = std::cout.rdbuf(sink.rdbuf()); }
+    ~quiet() { std::cout.rdbuf(old); }
+};
+
+static double
+elapsed_us(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+int
+main(int argc, char **argv)
+{
+    // fill the image: 63 files of 31 blocks each use up almost every block
+    {
+        quiet q;
+        FS fs;
+        fs.format();
+        std::string line(BLOCK_SIZE - 1, 'x');
+        std::string content;
+        for (int i = 0; i < 31; i++)
+            content += line + "\n";
+        for (int f = 0; f < 63; f++) {
+            std::istringstream in(content + "\n");
+            std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+            fs.create("file" + std::to_string(f));
+            std::cin.rdbuf(old);
+        }
+        fs.sync();
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int failed = 0;
+    for (int i = 0; i < MOUNT_ROUNDS; i++) {
+        quiet q;
+        FS fs;
+        if (fs.mount() < 0)
+            failed++;
+    }
+    double mount_us = elapsed_us(start) / MOUNT_ROUNDS;
+
+    start = std::chrono::steady_clock::now();
+    {
+        Disk disk;
+        uint8_t block[BLOCK_SIZE];
+        for (unsigned b = 0; b < disk.get_no_blocks(); b++)
+            disk.read(b, block);
+    }
+    double scan_us = elapsed_us(start);
+
+    std::cout << "mount (FS constructor + mount): " << mount_us << " us per mount";
+    std::cout << " over " << MOUNT_ROUNDS << " rounds";
+    if (failed)
+        std::cout << ", " << failed << " failed";
+    std::cout << "\n";
+    std::cout << "reading the whole image:        " << scan_us << " us\n";
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+// Load generator for fsserver. Each client connects on its own, works in
+// a directory of its own on one file and sends one request at a time: 60%
+// reads of a block, 20% writes of a block, 15% stat and 5% ls. Prints the
+// requests per second and the latency percentiles for 1 to CLIENT_MAX
+// clients. The data read is checked against what was written.
+//
+// usage: bench_server [<socket>]
+// Without a socket a server is started in this process on a freshly
+// formatted diskfile.bin.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs.h"
+#include "server.h"
+#include "protocol.h"
+
+#define CLIENT_MAX 8
+#define CLIENT_FILE_BLOCKS 64
+#define CLIENT_OPS 20000
+#define BENCH_SOCKET "bench.sock"
+
+// output of the file system is not interesting here
+struct quiet {
+    std::streambuf *old;
+    std::ostringstream sink;
+    quiet() { old = std::cout.rdbuf(sink.rdbuf()); }
+    ~quiet() { std::cout.rdbuf(old); }
+};
+
+static std::atomic<int> failed(0);
+
+// the content of block b of the file of client f
+static void
+fill(unsigned f, unsigned b, uint8_t *data)
+{
+    for (unsigned i = 0; i < BLOCK_SIZE; i++)
+        data[i] = (uint8_t)(f * 31 + b * 7 + i);
+}
+
+static int
+connect_to(const std::string &path)
+{
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+send_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool
+recv_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t*)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// sends a request and waits for its reply, returns the status or -2 if
+// the connection failed
+static int
+call(int fd, uint16_t op, const std::string &path, uint32_t offset, uint32_t count,
+     const void *arg, uint32_t arg_len, std::vector<uint8_t> *reply)
+{
+    request_header req;
+    req.length = path.size() + arg_len;
+    req.op = op;
+    req.path_len = path.size();
+    req.offset = offset;
+    req.count = count;
+    std::string msg((const char*)&req, sizeof(req));
+    msg += path;
+    msg.append((const char*)arg, arg_len);
+    reply_header rep;
+    if (!send_all(fd, msg.data(), msg.size()) || !recv_all(fd, &rep, sizeof(rep)))
+        return -2;
+    reply->resize(rep.length);
+    if (rep.length > 0 && !recv_all(fd, &(*reply)[0], rep.length))
+        return -2;
+    return rep.status;
+}
+
+enum request_kind { READ_BLOCK, WRITE_BLOCK, STAT, LIST, KINDS };
+
+// latencies in microseconds, by kind of request
+struct latencies {
+    std::vector<double> of[KINDS];
+};
+
+static void
+client(const std::string &sock, unsigned f, latencies *lat)
+{
+    int fd = connect_to(sock);
+    if (fd < 0) {
+        failed++;
+        return;
+    }
+    std::vector<uint8_t> reply;
+    std::vector<uint8_t> content(CLIENT_FILE_BLOCKS * BLOCK_SIZE);
+    for (unsigned b = 0; b < CLIENT_FILE_BLOCKS; b++)
+        fill(f, b, &content[b * BLOCK_SIZE]);
+    // the directory may be left from an earlier run
+    std::string dir = "/bench" + std::to_string(f);
+    call(fd, OP_MKDIR, dir, 0, 0, nullptr, 0, &reply);
+    call(fd, OP_CD, dir, 0, 0, nullptr, 0, &reply);
+    call(fd, OP_RM, "data", 0, 0, nullptr, 0, &reply);
+    if (call(fd, OP_CREATE, "data", 0, 0, &content[0], content.size(), &reply) != 0) {
+        failed++;
+        close(fd);
+        return;
+    }
+
+    uint8_t data[BLOCK_SIZE];
+    uint32_t seed = f * 2654435761u + 1;
+    for (unsigned op = 0; op < CLIENT_OPS; op++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned pick = (seed >> 8) % 100;
+        unsigned b = (seed >> 16) % CLIENT_FILE_BLOCKS;
+        request_kind kind = pick < 60 ? READ_BLOCK : pick < 80 ? WRITE_BLOCK : pick < 95 ? STAT : LIST;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int res;
+        bool ok;
+        switch (kind) {
+        case READ_BLOCK:
+            res = call(fd, OP_READ, "data", b * BLOCK_SIZE, BLOCK_SIZE, nullptr, 0, &reply);
+            fill(f, b, data);
+            ok = res == BLOCK_SIZE && std::memcmp(&reply[0], data, BLOCK_SIZE) == 0;
+            break;
+        case WRITE_BLOCK:
+            fill(f, b, data);
+            res = call(fd, OP_WRITE, "data", b * BLOCK_SIZE, 0, data, BLOCK_SIZE, &reply);
+            ok = res == BLOCK_SIZE;
+            break;
+        case STAT:
+            res = call(fd, OP_STAT, "data", 0, 0, nullptr, 0, &reply);
+            ok = res == 0 && reply.size() == sizeof(dir_entry);
+            break;
+        default:
+            res = call(fd, OP_LS, "", 0, 0, nullptr, 0, &reply);
+            ok = res == 0 && reply.size() == sizeof(dir_entry);
+            break;
+        }
+        lat->of[kind].push_back(
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        if (!ok)
+            failed++;
+        if (res == -2)
+            break;
+    }
+    close(fd);
+}
+
+// the p-th percentile of sorted latencies
+static double
+percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t)(p / 100 * (sorted.size() - 1));
+    return sorted[i];
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string sock = argc > 1 ? argv[1] : BENCH_SOCKET;
+    FS *fs = nullptr;
+    Server *server = nullptr;
+    std::thread loop;
+    if (argc <= 1) {
+        quiet q;
+        fs = new FS(CLIENT_MAX * CLIENT_FILE_BLOCKS + CACHE_DEFAULT_CAPACITY, DISK_PREAD);
+        fs->format();
+        fs->set_commit_interval(64);
+        server = new Server(*fs, CLIENT_MAX);
+        if (server->listen(sock) < 0) {
+            std::cout << "Can't listen on " << sock << "\n";
+            return 1;
+        }
+        loop = std::thread(&Server::run, server);
+    }
+
+    const char *names[] = { "read", "write", "stat", "ls" };
+    std::cout << "requests/s and latency in us with 1 to " << CLIENT_MAX << " clients, "
+              << std::thread::hardware_concurrency() << " cores\n";
+    for (unsigned clients = 1; clients <= CLIENT_MAX; clients *= 2) {
+        std::vector<latencies> lat(clients);
+        std::vector<std::thread> pool;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned c = 0; c < clients; c++)
+            pool.push_back(std::thread(client, sock, c, &lat[c]));
+        for (unsigned c = 0; c < clients; c++)
+            pool[c].join();
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        std::vector<double> all;
+        std::cout << clients << " clients: " << (uint64_t)(clients * CLIENT_OPS * 1e6 / us) << " requests/s\n";
+        for (int k = 0; k < KINDS; k++) {
+            std::vector<double> sorted;
+            for (unsigned c = 0; c < clients; c++)
+                sorted.insert(sorted.end(), lat[c].of[k].begin(), lat[c].of[k].end());
+            std::sort(sorted.begin(), sorted.end());
+            all.insert(all.end(), sorted.begin(), sorted.end());
+            std::cout << "  " << names[k] << ": p50 " << percentile(sorted, 50) << " p99 "
+                      << percentile(sorted, 99) << " p99.9 " << percentile(sorted, 99.9) << "\n";
+        }
+        std::sort(all.begin(), all.end());
+        std::cout << "  all: p50 " << percentile(all, 50) << " p99 " << percentile(all, 99)
+                  << " p99.9 " << percentile(all, 99.9) << " max " << all.back() << "\n";
+    }
+    if (failed)
+        std::cout << failed << " requests failed\n";
+
+    if (server != nullptr) {
+        server->stop();
+        loop.join();
+        unlink(sock.c_str());
+        quiet q;
+        delete server;
+        fs->sync();
+        delete fs;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,127 @@
+// Measures how reads and in-place writes of different files scale with the
+// number of threads sharing one file system. Every thread works on a file
+// of its own: pread through an open handle, pread by path (open, read,
+// close) and pwrite over blocks the file already has. The data read is
+// checked against what was written.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include "fs.h"
+
+#define THREAD_MAX 8
+#define THREAD_FILE_BLOCKS 64
+#define THREAD_OPS 20000
+
+// output of the file system is not interesting here
+struct quiet {
+    std::streambuf *old;
+    std::ostringstream sink;
+    quiet() { old = std::cout.rdbuf(sink.rdbuf()); }
+    ~quiet() { std::cout.rdbuf(old); }
+};
+
+static double
+elapsed_us(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the content of block b of file f
+static void
+fill(unsigned f, unsigned b, uint8_t *data)
+{
+    for (unsigned i = 0; i < BLOCK_SIZE; i++)
+        data[i] = (uint8_t)(f * 31 + b * 7 + i);
+}
+
+static std::string
+file_name(unsigned f)
+{
+    return "/data/file" + std::to_string(f);
+}
+
+enum workload { READ_HANDLE, READ_PATH, WRITE_HANDLE };
+
+static std::atomic<int> failed(0);
+
+static void
+worker(FS *fs, unsigned f, workload w)
+{
+    uint8_t data[BLOCK_SIZE], expected[BLOCK_SIZE];
+    uint32_t seed = f * 2654435761u + 1;
+    int fh = fs->open(file_name(f));
+    for (unsigned op = 0; op < THREAD_OPS; op++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned b = (seed >> 8) % THREAD_FILE_BLOCKS;
+        int n;
+        if (w == WRITE_HANDLE) {
+            fill(f, b, data);
+            n = fs->pwrite(fh, b * BLOCK_SIZE, BLOCK_SIZE, data);
+        } else {
+            if (w == READ_HANDLE)
+                n = fs->pread(fh, b * BLOCK_SIZE, BLOCK_SIZE, data);
+            else
+                n = fs->pread(file_name(f), b * BLOCK_SIZE, BLOCK_SIZE, data);
+            fill(f, b, expected);
+            if (std::memcmp(data, expected, BLOCK_SIZE) != 0)
+                n = -1;
+        }
+        if (n != BLOCK_SIZE)
+            failed++;
+    }
+    fs->close(fh);
+}
+
+int
+main(int argc, char **argv)
+{
+    quiet *q = new quiet;
+    FS fs(THREAD_MAX * THREAD_FILE_BLOCKS + CACHE_DEFAULT_CAPACITY, DISK_PREAD);
+    fs.format();
+    fs.set_commit_interval(64);
+    fs.mkdir("/data");
+    uint8_t data[BLOCK_SIZE];
+    for (unsigned f = 0; f < THREAD_MAX; f++) {
+        std::istringstream in("\n");
+        std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+        fs.create(file_name(f));
+        std::cin.rdbuf(old);
+        for (unsigned b = 0; b < THREAD_FILE_BLOCKS; b++) {
+            fill(f, b, data);
+            if (fs.pwrite(file_name(f), b * BLOCK_SIZE, BLOCK_SIZE, data) != BLOCK_SIZE)
+                failed++;
+        }
+    }
+    fs.sync();
+    delete q;
+
+    const char *names[] = { "pread", "pread by path", "pwrite" };
+    std::cout << "ops/s with 1 to " << THREAD_MAX << " threads, " << std::thread::hardware_concurrency()
+              << " cores\n";
+    for (int w = READ_HANDLE; w <= WRITE_HANDLE; w++) {
+        std::cout << names[w] << ":";
+        for (unsigned threads = 1; threads <= THREAD_MAX; threads *= 2) {
+            std::vector<std::thread> pool;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (unsigned t = 0; t < threads; t++)
+                pool.push_back(std::thread(worker, &fs, t, (workload)w));
+            for (unsigned t = 0; t < threads; t++)
+                pool[t].join();
+            double us = elapsed_us(start);
+            std::cout << " " << threads << ": " << (uint64_t)(threads * THREAD_OPS * 1e6 / us);
+        }
+        std::cout << "\n";
+    }
+    if (failed)
+        std::cout << failed << " operations failed\n";
+    q = new quiet;
+    fs.sync();
+    delete q;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,546 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk &disk, unsigned capacity) : disk(disk), capacity(0), held(0), write_seq(0)
+{
+    reset_stats();
+    resize(capacity);
+}
+
+BlockCache::~BlockCache()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!prefetches.empty())
+        finish_prefetch(prefetches.front(), guard);
+    guard.unlock();
+    flush();
+}
+
+void
+BlockCache::reset_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+int
+BlockCache::find_line(unsigned block_no)
+{
+    std::unordered_map<unsigned, unsigned>::iterator it = lookup.find(block_no);
+    if (it == lookup.end())
+        return -1;
+    // move to the front of the LRU list
+    cache_line &line = lines[it->second];
+    lru.splice(lru.begin(), lru, line.lru_pos);
+    return it->second;
+}
+
+// find_line(), the prefetch of a block is finished first
+int
+BlockCache::find_prefetched(unsigned block_no, std::unique_lock<std::mutex> &guard)
+{
+    for (;;) {
+        std::unordered_map<unsigned, prefetch_read*>::iterator it = prefetching.find(block_no);
+        if (it == prefetching.end())
+            return find_line(block_no);
+        finish_prefetch(it->second, guard);
+    }
+}
+
+// waits for the disk reads of p and caches its blocks, unless one may have
+// been written meanwhile. If another thread is at it, this waits for that
+// thread instead and p may be gone after.
+void
+BlockCache::finish_prefetch(prefetch_read *p, std::unique_lock<std::mutex> &guard)
+{
+    if (p->finishing) {
+        prefetch_done.wait(guard);
+        return;
+    }
+    p->finishing = true;
+    guard.unlock();
+    int res = p->reads.req.wait();
+    guard.lock();
+    cache_readv &r = p->reads;
+    for (unsigned i = 0; i < r.miss_nos.size(); i++)
+        prefetching.erase(r.miss_nos[i]);
+    prefetches.remove(p);
+    if (res == 0 && capacity > 0 && write_seq == r.seq) {
+        for (unsigned i = 0; i < r.miss_nos.size(); i++) {
+            if (lookup.count(r.miss_nos[i]) != 0)
+                continue;
+            int idx = get_line(r.miss_nos[i]);
+            if (idx < 0)
+                break;
+            std::memcpy(lines[idx].data, r.miss_blks[i], BLOCK_SIZE);
+            lines[idx].prefetched = true;
+            stats.prefetched++;
+        }
+    }
+    delete p;
+    prefetch_done.notify_all();
+}
+
+int
+BlockCache::get_line(unsigned block_no)
+{
+    if (capacity > 0 && lru.size() >= capacity && shrink(capacity - 1) < 0)
+        return -1;
+    unsigned idx;
+    if (!free_lines.empty()) {
+        idx = free_lines.back();
+        free_lines.pop_back();
+    } else {
+        // every line is held
+        idx = lines.size();
+        lines.push_back(cache_line());
+    }
+    cache_line &line = lines[idx];
+    line.block_no = block_no;
+    line.dirty = false;
+    line.held = false;
+    line.prefetched = false;
+    lru.push_front(idx);
+    line.lru_pos = lru.begin();
+    lookup[block_no] = idx;
+    return idx;
+}
+
+int
+BlockCache::shrink(unsigned limit)
+{
+    std::list<unsigned>::iterator it = lru.end();
+    while (lru.size() > limit && it != lru.begin()) {
+        --it;
+        cache_line &line = lines[*it];
+        if (line.held)
+            continue;
+        if (write_back(line) < 0)
+            return -1;
+        if (line.prefetched)
+            stats.prefetch_unused++;
+        lookup.erase(line.block_no);
+        free_lines.push_back(*it);
+        it = lru.erase(it);
+        stats.evictions++;
+    }
+    return 0;
+}
+
+int
+BlockCache::write_back(cache_line &line)
+{
+    if (!line.dirty)
+        return 0;
+    if (disk.write(line.block_no, line.data) < 0)
+        return -1;
+    line.dirty = false;
+    stats.writebacks++;
+    return 0;
+}
+
+// reads one block, from the cache if possible
+int
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    return read(block_no, blk, 0, BLOCK_SIZE);
+}
+
+// reads len bytes from offset in the block into buf. A miss reads the disk
+// without the lock, so misses of different threads overlap.
+int
+BlockCache::read(unsigned block_no, uint8_t *buf, unsigned offset, unsigned len)
+{
+    uint64_t seq;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        int idx = find_prefetched(block_no, guard);
+        if (idx >= 0) {
+            stats.hits++;
+            used(lines[idx], true);
+            std::memcpy(buf, lines[idx].data + offset, len);
+            return 0;
+        }
+        if (capacity > 0)
+            stats.misses++;
+        seq = write_seq;
+    }
+    uint8_t tmp[BLOCK_SIZE];
+    uint8_t *blk = offset == 0 && len == BLOCK_SIZE ? buf : tmp;
+    if (disk.read(block_no, blk) < 0)
+        return -1;
+    if (blk != buf)
+        std::memcpy(buf, blk + offset, len);
+    std::lock_guard<std::mutex> guard(lock);
+    // a block written meanwhile may be newer than what was read, it is
+    // not cached
+    if (capacity > 0 && write_seq == seq && find_line(block_no) < 0) {
+        int idx = get_line(block_no);
+        if (idx >= 0)
+            std::memcpy(lines[idx].data, blk, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// writes one block to the cache, it reaches the disk on eviction or flush
+int
+BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return put(block_no, blk);
+}
+
+// write() with the lock held
+int
+BlockCache::put(unsigned block_no, const uint8_t *blk)
+{
+    if (block_no >= disk.get_no_blocks()) {
+        std::cerr << "BlockCache::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    write_seq++;
+    int idx = find_line(block_no);
+    if (idx >= 0) {
+        stats.hits++;
+        used(lines[idx], false);
+    } else if (capacity == 0) {
+        return disk.write(block_no, (uint8_t*)blk);
+    } else {
+        idx = get_line(block_no);
+        if (idx < 0)
+            return disk.write(block_no, (uint8_t*)blk);
+    }
+    std::memcpy(lines[idx].data, blk, BLOCK_SIZE);
+    lines[idx].dirty = true;
+    return 0;
+}
+
+// a prefetched block counts as a hit of the prefetch when it is read, as
+// unused when it is written first
+void
+BlockCache::used(cache_line &line, bool read)
+{
+    if (!line.prefetched)
+        return;
+    line.prefetched = false;
+    if (read)
+        stats.prefetch_hits++;
+    else
+        stats.prefetch_unused++;
+}
+
+// writes len bytes at offset into the block. A block that is not cached is
+// read first, without the lock like in read(). The bytes are copied in
+// under the lock so writes to other parts of the block are not lost.
+int
+BlockCache::write(unsigned block_no, const uint8_t *buf, unsigned offset, unsigned len)
+{
+    uint8_t blk[BLOCK_SIZE];
+    for (;;) {
+        uint64_t seq;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (offset == 0 && len == BLOCK_SIZE)
+                return put(block_no, buf);
+            int idx = find_line(block_no);
+            if (idx >= 0) {
+                stats.hits++;
+                used(lines[idx], false);
+                write_seq++;
+                std::memcpy(lines[idx].data + offset, buf, len);
+                lines[idx].dirty = true;
+                return 0;
+            }
+            if (capacity == 0) {
+                if (disk.read(block_no, blk) < 0)
+                    return -1;
+                std::memcpy(blk + offset, buf, len);
+                return disk.write(block_no, blk);
+            }
+            stats.misses++;
+            seq = write_seq;
+        }
+        if (disk.read(block_no, blk) < 0)
+            return -1;
+        std::lock_guard<std::mutex> guard(lock);
+        // the block was written meanwhile, what was read may be old
+        if (write_seq != seq)
+            continue;
+        std::memcpy(blk + offset, buf, len);
+        return put(block_no, blk);
+    }
+}
+
+// writes one block to the cache and holds it there until release()
+int
+BlockCache::write_held(unsigned block_no, const uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (block_no >= disk.get_no_blocks()) {
+        std::cerr << "BlockCache::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    write_seq++;
+    int idx = find_line(block_no);
+    if (idx >= 0) {
+        stats.hits++;
+        used(lines[idx], false);
+    } else {
+        idx = get_line(block_no);
+        if (idx < 0)
+            return -1;
+    }
+    std::memcpy(lines[idx].data, blk, BLOCK_SIZE);
+    lines[idx].dirty = true;
+    if (!lines[idx].held)
+        held++;
+    lines[idx].held = true;
+    return 0;
+}
+
+// held blocks become ordinary dirty blocks, the lines past the capacity
+// are written back
+int
+BlockCache::release()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::list<unsigned>::iterator it = lru.begin(); it != lru.end(); ++it)
+        lines[*it].held = false;
+    held = 0;
+    return shrink(capacity);
+}
+
+// forgets held blocks, what was written to them is lost
+void
+BlockCache::drop_held()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    write_seq++;
+    std::list<unsigned>::iterator it = lru.begin();
+    while (it != lru.end()) {
+        cache_line &line = lines[*it];
+        if (!line.held) {
+            ++it;
+            continue;
+        }
+        line.held = false;
+        lookup.erase(line.block_no);
+        free_lines.push_back(*it);
+        it = lru.erase(it);
+    }
+    held = 0;
+}
+
+int
+BlockCache::readv(const unsigned *block_nos, unsigned count, uint8_t *buf, const uint8_t **data)
+{
+    cache_readv r;
+    find_blocks(block_nos, count, buf, data, &r);
+    if (r.miss_nos.empty())
+        return 0;
+    if (disk.readv_blocks(&r.miss_nos[0], &r.miss_blks[0], r.miss_nos.size()) < 0)
+        return -1;
+    fill(&r);
+    return 0;
+}
+
+// starts a readv, the blocks that are not cached are read from the disk
+// while the caller goes on
+int
+BlockCache::start_readv(const unsigned *block_nos, unsigned count, uint8_t *buf, const uint8_t **data,
+                        cache_readv *r)
+{
+    find_blocks(block_nos, count, buf, data, r);
+    if (r->miss_nos.empty())
+        return 0;
+    return disk.start_readv(&r->miss_nos[0], &r->miss_blks[0], r->miss_nos.size(), &r->req);
+}
+
+int
+BlockCache::finish_readv(cache_readv *r)
+{
+    if (r->miss_nos.empty())
+        return 0;
+    if (r->req.wait() < 0)
+        return -1;
+    fill(r);
+    return 0;
+}
+
+// sets data[i] to the cached or mapped copy of block_nos[i], the others
+// are left for the disk in r
+void
+BlockCache::find_blocks(const unsigned *block_nos, unsigned count, uint8_t *buf, const uint8_t **data,
+                        cache_readv *r)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (unsigned i = 0; i < count; i++) {
+        uint8_t *blk = buf + (size_t)i * BLOCK_SIZE;
+        int idx = find_prefetched(block_nos[i], guard);
+        if (idx >= 0) {
+            stats.hits++;
+            used(lines[idx], true);
+            std::memcpy(blk, lines[idx].data, BLOCK_SIZE);
+            data[i] = blk;
+            continue;
+        }
+        // mapped blocks are used where they are
+        data[i] = disk.block_ptr(block_nos[i]);
+        if (data[i] != nullptr)
+            continue;
+        stats.misses++;
+        r->miss_nos.push_back(block_nos[i]);
+        r->miss_blks.push_back(blk);
+        data[i] = blk;
+    }
+    r->seq = write_seq;
+}
+
+// caches the blocks read for r, unless one may have been written meanwhile
+void
+BlockCache::fill(cache_readv *r)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0 || write_seq != r->seq)
+        return;
+    for (unsigned i = 0; i < r->miss_nos.size(); i++) {
+        if (find_line(r->miss_nos[i]) >= 0)
+            continue;
+        int idx = get_line(r->miss_nos[i]);
+        if (idx >= 0)
+            std::memcpy(lines[idx].data, r->miss_blks[i], BLOCK_SIZE);
+    }
+}
+
+// starts reading the blocks that are neither cached nor memory mapped,
+// without waiting for the disk. One prefetch fills at most half of the
+// cache so it does not push out what is being read.
+int
+BlockCache::prefetch(const unsigned *block_nos, unsigned count)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    // prefetches that are done are cached now, the oldest is waited for if
+    // there are too many
+    while (!prefetches.empty() &&
+           (prefetches.size() >= CACHE_PREFETCH_READS ||
+            (!prefetches.front()->finishing && prefetches.front()->reads.req.done())))
+        finish_prefetch(prefetches.front(), guard);
+    prefetch_read *p = new prefetch_read;
+    cache_readv &r = p->reads;
+    for (unsigned i = 0; i < count && r.miss_nos.size() < capacity / 2; i++) {
+        if (block_nos[i] < disk.get_no_blocks() && lookup.count(block_nos[i]) == 0 &&
+            prefetching.count(block_nos[i]) == 0 && disk.block_ptr(block_nos[i]) == nullptr)
+            r.miss_nos.push_back(block_nos[i]);
+    }
+    if (r.miss_nos.empty()) {
+        delete p;
+        return 0;
+    }
+    p->buf.resize(r.miss_nos.size() * BLOCK_SIZE);
+    for (unsigned i = 0; i < r.miss_nos.size(); i++) {
+        r.miss_blks.push_back(&p->buf[(size_t)i * BLOCK_SIZE]);
+        prefetching[r.miss_nos[i]] = p;
+    }
+    r.seq = write_seq;
+    prefetches.push_back(p);
+
+    // reads of the blocks wait until the disk reads have been started
+    p->finishing = true;
+    guard.unlock();
+    int res = disk.start_readv(&r.miss_nos[0], &r.miss_blks[0], r.miss_nos.size(), &r.req);
+    guard.lock();
+    p->finishing = false;
+    if (res < 0) {
+        for (unsigned i = 0; i < r.miss_nos.size(); i++)
+            prefetching.erase(r.miss_nos[i]);
+        prefetches.remove(p);
+        delete p;
+    }
+    prefetch_done.notify_all();
+    return res;
+}
+
+// writes count blocks, blks[i] to block_nos[i]
+int
+BlockCache::writev(const unsigned *block_nos, uint8_t **blks, unsigned count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0 && held == 0)
+        return disk.writev_blocks(block_nos, blks, count);
+    for (unsigned i = 0; i < count; i++) {
+        if (put(block_nos[i], blks[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// returns a pointer to the current contents of the block without copying
+// it, or nullptr if it is neither cached nor memory mapped
+const uint8_t *
+BlockCache::block_ptr(unsigned block_no)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int idx = find_line(block_no);
+    if (idx >= 0) {
+        stats.hits++;
+        used(lines[idx], true);
+        return lines[idx].data;
+    }
+    return disk.block_ptr(block_no);
+}
+
+// writes all dirty blocks that are not held to the disk, sorted so that
+// neighbouring blocks go out in the same system call
+int
+BlockCache::flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return write_dirty();
+}
+
+// flush() with the lock held
+int
+BlockCache::write_dirty()
+{
+    std::vector<std::pair<unsigned, unsigned> > dirty;
+    for (std::list<unsigned>::iterator it = lru.begin(); it != lru.end(); ++it) {
+        if (lines[*it].dirty && !lines[*it].held)
+            dirty.push_back(std::make_pair(lines[*it].block_no, *it));
+    }
+    if (dirty.empty())
+        return 0;
+    std::sort(dirty.begin(), dirty.end());
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> blks;
+    for (unsigned i = 0; i < dirty.size(); i++) {
+        block_nos.push_back(dirty[i].first);
+        blks.push_back(lines[dirty[i].second].data);
+    }
+    if (disk.writev_blocks(&block_nos[0], &blks[0], block_nos.size()) < 0)
+        return -1;
+    for (unsigned i = 0; i < dirty.size(); i++)
+        lines[dirty[i].second].dirty = false;
+    stats.writebacks += dirty.size();
+    return 0;
+}
+
+// flushes and drops all cached blocks, then changes the capacity
+int
+BlockCache::resize(unsigned new_capacity)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (held > 0 || write_dirty() < 0)
+        return -1;
+    write_seq++;
+    lookup.clear();
+    lru.clear();
+    free_lines.clear();
+    lines.clear();
+    lines.resize(new_capacity);
+    for (unsigned i = new_capacity; i > 0; i--)
+        free_lines.push_back(i - 1);
+    capacity = new_capacity;
+    return 0;
+}
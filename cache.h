@@ -0,0 +1,141 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#define CACHE_DEFAULT_CAPACITY 64
+// prefetches in flight at most, another one first waits for the oldest
+#define CACHE_PREFETCH_READS 4
+
+struct cache_stats {
+    uint64_t hits;       // reads/writes served by a cached block
+    uint64_t misses;     // reads that had to go to the disk
+    uint64_t evictions;  // blocks dropped to make room for another block
+    uint64_t writebacks; // dirty blocks written to the disk
+    uint64_t prefetched; // blocks cached by prefetch()
+    uint64_t prefetch_hits;   // of those, read before they were evicted
+    uint64_t prefetch_unused; // evicted or overwritten without being read
+};
+
+// a readv whose disk reads are in flight, see BlockCache::start_readv()
+struct cache_readv {
+    std::vector<unsigned> miss_nos;
+    std::vector<uint8_t*> miss_blks;
+    uint64_t seq;
+    disk_request req;
+};
+
+// write-back LRU cache of disk blocks. Blocks of a journal transaction are
+// held: they are neither evicted nor flushed until they are released, the
+// cache grows past its capacity if it has to. The cache can be used from
+// several threads, a block is copied in or out whole under its lock.
+class BlockCache {
+private:
+    struct cache_line {
+        unsigned block_no;
+        bool dirty;
+        bool held;
+        bool prefetched; // by prefetch() and not read since
+        std::list<unsigned>::iterator lru_pos;
+        uint8_t data[BLOCK_SIZE];
+    };
+    Disk &disk;
+    unsigned capacity;
+    std::vector<cache_line> lines;
+    // block number -> index in lines
+    std::unordered_map<unsigned, unsigned> lookup;
+    // line indices, most recently used first
+    std::list<unsigned> lru;
+    // line indices not holding any block
+    std::vector<unsigned> free_lines;
+    unsigned held;
+    cache_stats stats;
+    std::mutex lock;
+    // counts writes, a block read from the disk while it changes is not
+    // cached
+    uint64_t write_seq;
+    // a prefetch() whose disk reads may be in flight
+    struct prefetch_read {
+        cache_readv reads;
+        std::vector<uint8_t> buf;
+        bool finishing; // a thread is starting or waiting for the reads
+    };
+    // oldest first
+    std::list<prefetch_read*> prefetches;
+    // the blocks of the prefetches, a read of one finishes its prefetch
+    // instead of reading the block again
+    std::unordered_map<unsigned, prefetch_read*> prefetching;
+    std::condition_variable prefetch_done;
+
+    // returns the line holding block_no, or -1 if it is not cached
+    int find_line(unsigned block_no);
+    int find_prefetched(unsigned block_no, std::unique_lock<std::mutex> &guard);
+    void finish_prefetch(prefetch_read *p, std::unique_lock<std::mutex> &guard);
+    // returns a line for block_no, evicting the least recently used if needed
+    int get_line(unsigned block_no);
+    int write_back(cache_line &line);
+    // evicts least recently used blocks that are not held until at most
+    // limit blocks are cached
+    int shrink(unsigned limit);
+    int put(unsigned block_no, const uint8_t *blk);
+    void used(cache_line &line, bool read);
+    void find_blocks(const unsigned *block_nos, unsigned count, uint8_t *buf, const uint8_t **data,
+                     cache_readv *r);
+    void fill(cache_readv *r);
+    int write_dirty();
+public:
+    BlockCache(Disk &disk, unsigned capacity = CACHE_DEFAULT_CAPACITY);
+    ~BlockCache();
+    // reads one block, from the cache if possible
+    int read(unsigned block_no, uint8_t *blk);
+    // reads len bytes from offset in the block
+    int read(unsigned block_no, uint8_t *buf, unsigned offset, unsigned len);
+    // writes one block to the cache, it reaches the disk on eviction or flush
+    int write(unsigned block_no, uint8_t *blk);
+    // writes len bytes at offset into the block, the rest of it is kept
+    int write(unsigned block_no, const uint8_t *buf, unsigned offset, unsigned len);
+    // writes one block to the cache and holds it there until release()
+    int write_held(unsigned block_no, const uint8_t *blk);
+    // held blocks become ordinary dirty blocks
+    int release();
+    // forgets held blocks, what was written to them is lost
+    void drop_held();
+    unsigned get_held() { std::lock_guard<std::mutex> guard(lock); return held; }
+    // reads count blocks. data[i] is set to point at block_nos[i], either in
+    // the disk mapping or in buf + i * BLOCK_SIZE. Blocks that are not cached
+    // are fetched from the disk in one batch.
+    int readv(const unsigned *block_nos, unsigned count, uint8_t *buf, const uint8_t **data);
+    // readv() in two steps, the disk reads run between them. buf and r must
+    // be kept until finish_readv() returns.
+    int start_readv(const unsigned *block_nos, unsigned count, uint8_t *buf, const uint8_t **data,
+                    cache_readv *r);
+    int finish_readv(cache_readv *r);
+    // starts reading the blocks that are neither cached nor memory mapped
+    // into the cache, for reads that are expected soon. The blocks are
+    // cached when the first of them is read or by a later prefetch. Hits on
+    // them are counted in the stats.
+    int prefetch(const unsigned *block_nos, unsigned count);
+    // writes count blocks, blks[i] to block_nos[i]
+    int writev(const unsigned *block_nos, uint8_t **blks, unsigned count);
+    // returns a pointer to the current contents of the block without copying
+    // it, or nullptr if it is neither cached nor memory mapped. The pointer is
+    // only valid until the next call to the cache, by any thread.
+    const uint8_t *block_ptr(unsigned block_no);
+    // writes all dirty blocks that are not held to the disk
+    int flush();
+    // flushes and drops all cached blocks, then changes the capacity. Fails
+    // while blocks are held.
+    int resize(unsigned new_capacity);
+    unsigned get_capacity() { std::lock_guard<std::mutex> guard(lock); return capacity; }
+    cache_stats get_stats() { std::lock_guard<std::mutex> guard(lock); return stats; }
+    void reset_stats();
+};
+
+#endif // __CACHE_H__
@@ -0,0 +1,60 @@
+#include <iostream>
+#include "chainindex.h"
+
+ChainIndex::ChainIndex(unsigned capacity) : capacity(capacity)
+{
+    stats.hits = 0;
+    stats.misses = 0;
+}
+
+// returns all blocks of the chain starting at first, walking fat to index
+// it if it is not indexed already
+const std::vector<int> &
+ChainIndex::get(int first, const geometry::fat_entry *fat, unsigned no_blocks)
+{
+    std::unordered_map<int, chain>::iterator it = chains.find(first);
+    if (it != chains.end()) {
+        stats.hits++;
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return it->second.blocks;
+    }
+    stats.misses++;
+    if (chains.size() >= capacity && !lru.empty()) {
+        chains.erase(lru.back());
+        lru.pop_back();
+    }
+    chain &c = chains[first];
+    // a cycle in a broken FAT must not loop forever
+    for (int block = first; block >= 0 && block < (int)no_blocks && c.blocks.size() < no_blocks; block = fat[block])
+        c.blocks.push_back(block);
+    lru.push_front(first);
+    c.lru_pos = lru.begin();
+    return c.blocks;
+}
+
+// block was linked to the end of the chain starting at first
+void
+ChainIndex::append(int first, int block)
+{
+    std::unordered_map<int, chain>::iterator it = chains.find(first);
+    if (it != chains.end())
+        it->second.blocks.push_back(block);
+}
+
+// the chain starting at first was freed or changed in some other way
+void
+ChainIndex::drop(int first)
+{
+    std::unordered_map<int, chain>::iterator it = chains.find(first);
+    if (it == chains.end())
+        return;
+    lru.erase(it->second.lru_pos);
+    chains.erase(it);
+}
+
+void
+ChainIndex::clear()
+{
+    chains.clear();
+    lru.clear();
+}
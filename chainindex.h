@@ -0,0 +1,45 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "geometry.h"
+
+#ifndef __CHAININDEX_H__
+#define __CHAININDEX_H__
+
+#define CHAIN_INDEX_CAPACITY 32
+
+struct chain_index_stats {
+    uint64_t hits;    // lookups of a chain that was already indexed
+    uint64_t misses;  // lookups that had to walk the FAT
+};
+
+// remembers every block of recently used FAT chains, keyed by the first
+// block, so the n:th block and the tail of a file are found without
+// following the chain
+class ChainIndex {
+private:
+    struct chain {
+        std::vector<int> blocks;
+        std::list<int>::iterator lru_pos;
+    };
+    unsigned capacity;
+    std::unordered_map<int, chain> chains;
+    // first blocks, most recently used first
+    std::list<int> lru;
+    chain_index_stats stats;
+public:
+    ChainIndex(unsigned capacity = CHAIN_INDEX_CAPACITY);
+    // returns all blocks of the chain starting at first, walking fat to
+    // index it if it is not indexed already
+    const std::vector<int> &get(int first, const geometry::fat_entry *fat, unsigned no_blocks);
+    // block was linked to the end of the chain starting at first
+    void append(int first, int block);
+    // the chain starting at first was freed or changed in some other way
+    void drop(int first);
+    void clear();
+    chain_index_stats get_stats() { return stats; }
+};
+
+#endif // __CHAININDEX_H__
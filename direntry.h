@@ -1,7 +1,20 @@
+#include <cstdint>
+
+#ifndef __DIRENTRY_H__
+#define __DIRENTRY_H__
+
+// first_blk of an entry without blocks, an empty file. Block numbers stay
+// below it.
+#define DIR_NO_BLOCK 0xffffff
+
 struct dir_entry {
     char file_name[56]; // name of the file / sub-directory
     uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
-    uint8_t type; // directory (1) or file (0)
-    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    uint32_t first_blk : 24; // index in the FAT for the first block of the file
+    uint32_t type : 4; // directory (1) or file (0)
+    uint32_t access_rights : 4; // read (0x04), write (0x02), execute (0x01)
 };
+
+static_assert(sizeof(dir_entry) == 64, "directory entries are 64 bytes");
+
+#endif // __DIRENTRY_H__
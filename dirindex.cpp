@@ -0,0 +1,90 @@
+#include <iostream>
+#include <cstring>
+#include "dirindex.h"
+
+DirIndex::DirIndex()
+{
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+// FNV-1a
+uint32_t
+DirIndex::hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name != '\0'; name++) {
+        h ^= (uint8_t)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// bucket of name in a table. The low bits of the hash pick the block of a
+// directory a name goes in, the names of a block share them.
+static inline uint32_t
+bucket(const char *name)
+{
+    return (DirIndex::hash(name) >> 16) % DIR_INDEX_BUCKETS;
+}
+
+void
+DirIndex::build(table &t, const dir_entry *dir)
+{
+    std::memset(t.buckets, -1, sizeof(t.buckets));
+    // inserted in slot order so a duplicated name finds the first slot
+    for (unsigned i = 0; i < geometry::dir_slots; i++) {
+        if (dir[i].file_name[0] == '\0')
+            continue;
+        uint32_t b = bucket(dir[i].file_name);
+        while (t.buckets[b] >= 0)
+            b = (b + 1) % DIR_INDEX_BUCKETS;
+        t.buckets[b] = i;
+    }
+    stats.builds++;
+}
+
+// returns the slot of name in dir, the contents of directory block block,
+// or -1 if it is not there
+int
+DirIndex::find(unsigned block, const dir_entry *dir, const char *name)
+{
+    std::unordered_map<unsigned, table>::iterator it = tables.find(block);
+    if (it == tables.end()) {
+        it = tables.insert(std::make_pair(block, table())).first;
+        build(it->second, dir);
+    }
+    stats.lookups++;
+    const table &t = it->second;
+    uint32_t b = bucket(name);
+    for (unsigned k = 0; k < DIR_INDEX_BUCKETS; k++) {
+        int slot = t.buckets[(b + k) % DIR_INDEX_BUCKETS];
+        stats.probes++;
+        if (slot < 0)
+            return -1;
+        if (std::strcmp(dir[slot].file_name, name) == 0)
+            return slot;
+    }
+    return -1;
+}
+
+// dir was written to block
+void
+DirIndex::update(unsigned block, const dir_entry *dir)
+{
+    std::unordered_map<unsigned, table>::iterator it = tables.find(block);
+    if (it != tables.end())
+        build(it->second, dir);
+}
+
+// block is no longer a directory
+void
+DirIndex::drop(unsigned block)
+{
+    tables.erase(block);
+}
+
+void
+DirIndex::clear()
+{
+    tables.clear();
+}
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <cstdint>
+#include <unordered_map>
+#include "direntry.h"
+#include "geometry.h"
+
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+// buckets per directory, twice the number of entries in a directory block
+// so probe sequences stay short
+#define DIR_INDEX_BUCKETS (2 * geometry::dir_slots)
+
+struct dir_index_stats {
+    uint64_t lookups;
+    uint64_t probes;   // buckets looked at, lookups when there are no collisions
+    uint64_t builds;   // tables built from a directory block
+};
+
+// hash index of the names in directory blocks, keyed by block number. A
+// table maps the hash of a name to the slot of the entry, open addressing
+// with linear probing. It is built when a directory is first searched and
+// rebuilt whenever the directory block is written.
+class DirIndex {
+private:
+    struct table {
+        int16_t buckets[DIR_INDEX_BUCKETS]; // slot in the directory, -1 = empty
+    };
+    std::unordered_map<unsigned, table> tables;
+    dir_index_stats stats;
+    void build(table &t, const dir_entry *dir);
+public:
+    // also picks the block of a directory a name is stored in, changing it
+    // changes the disk format
+    static uint32_t hash(const char *name);
+    DirIndex();
+    // returns the slot of name in dir, the contents of directory block
+    // block, or -1 if it is not there
+    int find(unsigned block, const dir_entry *dir, const char *name);
+    // dir was written to block
+    void update(unsigned block, const dir_entry *dir);
+    // block is no longer a directory
+    void drop(unsigned block);
+    void clear();
+    dir_index_stats get_stats() { return stats; }
+};
+
+#endif // __DIRINDEX_H__
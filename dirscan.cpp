@@ -0,0 +1,199 @@
+#include <cstring>
+#include "dirscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR_SCAN_X86
+#endif
+
+typedef void (*scan_func)(const dir_entry *dir, unsigned n, uint64_t key,
+                          uint64_t mask, uint64_t *match, uint64_t *empty);
+
+// the first DIR_SCAN_KEY bytes of the name of entry i
+static inline uint64_t
+name_word(const dir_entry *dir, unsigned i)
+{
+    uint64_t w;
+    std::memcpy(&w, dir[i].file_name, sizeof(w));
+    return w;
+}
+
+// the first byte of a word as it is laid out in memory
+static uint64_t
+first_byte()
+{
+    uint8_t b[DIR_SCAN_KEY] = { 0xff };
+    uint64_t w;
+    std::memcpy(&w, b, sizeof(w));
+    return w;
+}
+
+// key holds the leading bytes of name, mask covers them up to and
+// including the terminator. Bytes after a terminator on disk are not
+// always zero so they must not be compared.
+static void
+make_key(const char *name, uint64_t *key, uint64_t *mask)
+{
+    uint8_t k[DIR_SCAN_KEY] = { 0 };
+    uint8_t m[DIR_SCAN_KEY] = { 0 };
+    for (unsigned i = 0; i < DIR_SCAN_KEY; i++) {
+        k[i] = name[i];
+        m[i] = 0xff;
+        if (name[i] == '\0')
+            break;
+    }
+    std::memcpy(key, k, sizeof(*key));
+    std::memcpy(mask, m, sizeof(*mask));
+}
+
+static void
+scan_scalar_from(const dir_entry *dir, unsigned from, unsigned n, uint64_t key,
+                 uint64_t mask, uint64_t *match, uint64_t *empty)
+{
+    uint64_t first = first_byte();
+    for (unsigned i = from; i < n; i++) {
+        uint64_t w = name_word(dir, i);
+        if ((w & mask) == key)
+            *match |= (uint64_t)1 << i;
+        if ((w & first) == 0)
+            *empty |= (uint64_t)1 << i;
+    }
+}
+
+static void
+scan_scalar(const dir_entry *dir, unsigned n, uint64_t key, uint64_t mask,
+            uint64_t *match, uint64_t *empty)
+{
+    scan_scalar_from(dir, 0, n, key, mask, match, empty);
+}
+
+#ifdef DIR_SCAN_X86
+// two entries per vector and four per step. SSE2 has no gather and no
+// 64-bit compare, so the leading words are loaded one at a time and a
+// word matches when both of its halves do.
+__attribute__((target("sse2"))) static inline int
+sse2_cmp(__m128i w, __m128i m, __m128i k)
+{
+    __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(w, m), k);
+    eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_movemask_pd(_mm_castsi128_pd(eq));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+sse2_words(const dir_entry *dir, unsigned i)
+{
+    return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)dir[i].file_name),
+                              _mm_loadl_epi64((const __m128i*)dir[i + 1].file_name));
+}
+
+__attribute__((target("sse2"))) static void
+scan_sse2(const dir_entry *dir, unsigned n, uint64_t key, uint64_t mask,
+          uint64_t *match, uint64_t *empty)
+{
+    const __m128i k = _mm_set1_epi64x((long long)key);
+    const __m128i m = _mm_set1_epi64x((long long)mask);
+    const __m128i f = _mm_set1_epi64x((long long)first_byte());
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t mt = 0, em = 0;
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i lo = sse2_words(dir, i);
+        __m128i hi = sse2_words(dir, i + 2);
+        mt |= (uint64_t)(sse2_cmp(lo, m, k) | sse2_cmp(hi, m, k) << 2) << i;
+        em |= (uint64_t)(sse2_cmp(lo, f, zero) | sse2_cmp(hi, f, zero) << 2) << i;
+    }
+    *match |= mt;
+    *empty |= em;
+    scan_scalar_from(dir, i, n, key, mask, match, empty);
+}
+
+// eight entries per step, the leading words are gathered straight from
+// the directory with a stride of one entry
+__attribute__((target("avx2"))) static void
+scan_avx2(const dir_entry *dir, unsigned n, uint64_t key, uint64_t mask,
+          uint64_t *match, uint64_t *empty)
+{
+    const int s = sizeof(dir_entry);
+    const __m128i stride = _mm_set_epi32(3 * s, 2 * s, s, 0);
+    const __m256i k = _mm256_set1_epi64x((long long)key);
+    const __m256i m = _mm256_set1_epi64x((long long)mask);
+    const __m256i f = _mm256_set1_epi64x((long long)first_byte());
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t mt = 0, em = 0;
+    unsigned i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i lo = _mm256_i32gather_epi64((const long long*)dir[i].file_name, stride, 1);
+        __m256i hi = _mm256_i32gather_epi64((const long long*)dir[i + 4].file_name, stride, 1);
+        int eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(lo, m), k)))
+               | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(hi, m), k))) << 4;
+        int ez = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(lo, f), zero)))
+               | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(hi, f), zero))) << 4;
+        mt |= (uint64_t)eq << i;
+        em |= (uint64_t)ez << i;
+    }
+    *match |= mt;
+    *empty |= em;
+    scan_scalar_from(dir, i, n, key, mask, match, empty);
+}
+#endif
+
+static int current_impl = -1;
+static scan_func current_scan = scan_scalar;
+
+// selects an implementation, one the CPU lacks falls back to the next best.
+// Returns the implementation in use.
+int
+dir_scan_set_impl(int impl)
+{
+    current_impl = DIR_SCAN_SCALAR;
+    current_scan = scan_scalar;
+#ifdef DIR_SCAN_X86
+    __builtin_cpu_init();
+    if (impl >= DIR_SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        current_impl = DIR_SCAN_AVX2;
+        current_scan = scan_avx2;
+    } else if (impl >= DIR_SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+        current_impl = DIR_SCAN_SSE2;
+        current_scan = scan_sse2;
+    }
+#endif
+    return current_impl;
+}
+
+// returns the implementation in use
+int
+dir_scan_impl()
+{
+    if (current_impl < 0)
+        dir_scan_set_impl(DIR_SCAN_AVX2);
+    return current_impl;
+}
+
+const char *
+dir_scan_impl_name(int impl)
+{
+    switch (impl) {
+    case DIR_SCAN_AVX2:
+        return "avx2";
+    case DIR_SCAN_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+// one pass over the first n entries of dir, see dirscan.h
+void
+dir_scan(const dir_entry *dir, unsigned n, const char *name,
+         uint64_t *match, uint64_t *empty)
+{
+    if (current_impl < 0)
+        dir_scan_set_impl(DIR_SCAN_AVX2);
+    if (n > DIR_SCAN_SLOTS)
+        n = DIR_SCAN_SLOTS;
+    uint64_t key, mask;
+    make_key(name, &key, &mask);
+    *match = 0;
+    *empty = 0;
+    current_scan(dir, n, key, mask, match, empty);
+}
@@ -0,0 +1,33 @@
+#include <cstdint>
+#include "direntry.h"
+
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+// implementations of dir_scan, the best one the CPU supports is picked the
+// first time it is called
+#define DIR_SCAN_SCALAR 0
+#define DIR_SCAN_SSE2 1
+#define DIR_SCAN_AVX2 2
+
+// leading bytes of a name compared by dir_scan
+#define DIR_SCAN_KEY 8
+// entries covered by one call, a bit each in the result masks
+#define DIR_SCAN_SLOTS 64
+
+// one pass over the first n (at most DIR_SCAN_SLOTS) entries of dir. Bit i
+// of *match is set when entry i may be name: the first DIR_SCAN_KEY bytes,
+// or the name and its terminator if it is shorter, are equal. Names longer
+// than that still need a strcmp. Bit i of *empty is set when entry i is
+// unused.
+void dir_scan(const dir_entry *dir, unsigned n, const char *name,
+              uint64_t *match, uint64_t *empty);
+
+// returns the implementation in use
+int dir_scan_impl();
+// selects an implementation, one the CPU lacks falls back to the next best.
+// Returns the implementation in use.
+int dir_scan_set_impl(int impl);
+const char *dir_scan_impl_name(int impl);
+
+#endif // __DIRSCAN_H__
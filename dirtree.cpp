@@ -0,0 +1,103 @@
+#include <cstring>
+#include "dirtree.h"
+
+// the header is kept in slot 0, it is copied in and out so the node needs
+// no particular alignment
+dir_tree_header
+dir_tree_get(const dir_entry *node)
+{
+    dir_tree_header h;
+    std::memcpy(&h, &node[0], sizeof(h));
+    return h;
+}
+
+void
+dir_tree_set(dir_entry *node, const dir_tree_header &h)
+{
+    std::memset(&node[0], 0, sizeof(dir_entry));
+    std::memcpy(&node[0], &h, sizeof(h));
+}
+
+bool
+dir_tree_is_node(const dir_entry *node)
+{
+    dir_tree_header h = dir_tree_get(node);
+    return h.zero == '\0' && h.magic == DIR_TREE_MAGIC;
+}
+
+void
+dir_tree_init(dir_entry *node, bool leaf)
+{
+    std::memset(node, 0, sizeof(dir_entry) * (DIR_TREE_SLOTS + 1));
+    dir_tree_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.leaf = leaf;
+    h.magic = DIR_TREE_MAGIC;
+    h.next = DIR_TREE_NONE;
+    dir_tree_set(node, h);
+}
+
+unsigned
+dir_tree_lower_bound(const dir_entry *node, const char *name, bool *found)
+{
+    unsigned lo = 1, hi = dir_tree_get(node).count + 1;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (std::strcmp(node[mid].file_name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = lo <= dir_tree_get(node).count && std::strcmp(node[lo].file_name, name) == 0;
+    return lo;
+}
+
+// the last slot whose name is not greater than name. The leftmost key is
+// "", so there always is one.
+unsigned
+dir_tree_child(const dir_entry *node, const char *name)
+{
+    bool found;
+    unsigned pos = dir_tree_lower_bound(node, name, &found);
+    return found || pos == 1 ? pos : pos - 1;
+}
+
+void
+dir_tree_insert(dir_entry *node, unsigned pos, const dir_entry &entry)
+{
+    dir_tree_header h = dir_tree_get(node);
+    std::memmove(&node[pos + 1], &node[pos], sizeof(dir_entry) * (h.count + 1 - pos));
+    node[pos] = entry;
+    h.count++;
+    dir_tree_set(node, h);
+}
+
+// unused slots are kept zeroed
+void
+dir_tree_remove(dir_entry *node, unsigned pos)
+{
+    dir_tree_header h = dir_tree_get(node);
+    std::memmove(&node[pos], &node[pos + 1], sizeof(dir_entry) * (h.count - pos));
+    std::memset(&node[h.count], 0, sizeof(dir_entry));
+    h.count--;
+    dir_tree_set(node, h);
+}
+
+void
+dir_tree_split(dir_entry *left, dir_entry *right, int right_block)
+{
+    dir_tree_header lh = dir_tree_get(left);
+    dir_tree_init(right, lh.leaf);
+    dir_tree_header rh = dir_tree_get(right);
+    unsigned keep = lh.count / 2;
+    rh.count = lh.count - keep;
+    std::memcpy(&right[1], &left[keep + 1], sizeof(dir_entry) * rh.count);
+    std::memset(&left[keep + 1], 0, sizeof(dir_entry) * rh.count);
+    lh.count = keep;
+    if (lh.leaf) {
+        rh.next = lh.next;
+        lh.next = right_block;
+    }
+    dir_tree_set(left, lh);
+    dir_tree_set(right, rh);
+}
@@ -0,0 +1,45 @@
+#include <cstdint>
+#include "direntry.h"
+#include "geometry.h"
+
+#ifndef __DIRTREE_H__
+#define __DIRTREE_H__
+
+// A B+-tree directory keeps its nodes in the blocks of its FAT chain, the
+// root in the first one. A node is a block of dir_entry slots. Slot 0 holds
+// the header and slots 1..count are sorted by name. In a leaf they are the
+// entries of the directory, the leaves are linked in name order. In an
+// inner node file_name is the smallest name under the child in first_blk,
+// "" for the leftmost child.
+
+#define DIR_TREE_MAGIC 0x45455254 // "TREE"
+// slots of a node after the header
+#define DIR_TREE_SLOTS (geometry::dir_slots - 1)
+// next of the last leaf
+#define DIR_TREE_NONE -1
+
+struct dir_tree_header {
+    char zero;          // '\0', so the slot looks unused to other code
+    uint8_t leaf;
+    uint16_t count;
+    uint32_t magic;     // never set in a hashed directory block
+    int32_t next;       // next leaf in name order
+};
+
+// true if the block holds a node, a hashed directory block never does
+bool dir_tree_is_node(const dir_entry *node);
+// an empty node
+void dir_tree_init(dir_entry *node, bool leaf);
+dir_tree_header dir_tree_get(const dir_entry *node);
+void dir_tree_set(dir_entry *node, const dir_tree_header &h);
+// first slot whose name is not less than name, *found is set if it is name
+unsigned dir_tree_lower_bound(const dir_entry *node, const char *name, bool *found);
+// slot of the child of an inner node that name is under
+unsigned dir_tree_child(const dir_entry *node, const char *name);
+void dir_tree_insert(dir_entry *node, unsigned pos, const dir_entry &entry);
+void dir_tree_remove(dir_entry *node, unsigned pos);
+// moves the upper half of the full node left to right, which goes in block
+// right_block. The first name of right separates the two.
+void dir_tree_split(dir_entry *left, dir_entry *right, int right_block);
+
+#endif // __DIRTREE_H__
@@ -1,19 +1,31 @@
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cstring>
 #include "disk.h"
 
-Disk::Disk()
+Disk::Disk(int backend) : backend(backend), fd(-1), sync_fd(-1), map(nullptr)
 {
     // first check if the disk file exists, otherwise create it.
     if (!disk_file_exists(DISKNAME)) {
         std::cout << "No disk file found...\n";
         std::cout << "Creating disk file: " << DISKNAME << std::endl;
         std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        f.seekp((uint64_t)DISK_BLOCKS * BLOCK_SIZE - 1);
         f.write("", 1);
     }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
+    struct stat st;
+    if (stat(DISKNAME, &st) < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    no_blocks = st.st_size / BLOCK_SIZE;
+    disk_size = (uint64_t)no_blocks * BLOCK_SIZE;
+    if (!open_disk_file()) {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
         exit(-1);
     }
@@ -21,7 +33,60 @@ Disk::Disk()
 
 Disk::~Disk()
 {
-    diskfile.close();
+    close_disk_file();
+}
+
+bool
+Disk::open_disk_file()
+{
+    if (backend == DISK_MMAP)
+        return map_disk_file();
+    if (backend == DISK_PREAD) {
+        fd = open(DISKNAME, O_RDWR);
+        return fd >= 0;
+    }
+    // the disk is simulated as a binary file, the stream can't be synced
+    // so sync() flushes it and syncs the file through a descriptor
+    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
+    sync_fd = open(DISKNAME, O_RDWR);
+    return diskfile.is_open() && sync_fd >= 0;
+}
+
+void
+Disk::close_disk_file()
+{
+    if (map != nullptr) {
+        msync(map, disk_size, MS_SYNC);
+        munmap(map, disk_size);
+        map = nullptr;
+    }
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    if (sync_fd >= 0)
+        close(sync_fd);
+    sync_fd = -1;
+    if (diskfile.is_open())
+        diskfile.close();
+}
+
+// makes the disk no_blocks blocks large. The file is closed while its
+// size changes, a mapping has to be made again anyway.
+int
+Disk::resize(unsigned no_blocks)
+{
+    close_disk_file();
+    uint64_t size = (uint64_t)no_blocks * BLOCK_SIZE;
+    bool ok = truncate(DISKNAME, size) == 0;
+    if (ok) {
+        this->no_blocks = no_blocks;
+        disk_size = size;
+    }
+    if (!open_disk_file()) {
+        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    return ok ? 0 : -1;
 }
 
 bool
@@ -30,6 +95,25 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
+bool
+Disk::map_disk_file()
+{
+    fd = open(DISKNAME, O_RDWR);
+    if (fd < 0)
+        return false;
+    // the whole disk must be backed by the file before it can be mapped
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return false;
+    if (st.st_size < (off_t)disk_size && ftruncate(fd, disk_size) < 0)
+        return false;
+    void *p = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    map = (uint8_t*)p;
+    return true;
+}
+
 // writes one block to the disk
 int
 Disk::write(unsigned block_no, uint8_t *blk)
@@ -41,7 +125,15 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (map != nullptr) {
+        // reaches the file on sync() or when the kernel writes it back
+        std::memcpy(map + offset, blk, BLOCK_SIZE);
+        return 0;
+    }
+    if (fd >= 0)
+        return pwrite(fd, blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+    std::lock_guard<std::mutex> guard(stream_lock);
     diskfile.seekp(offset, std::ios_base::beg);
     diskfile.write((char*)blk, BLOCK_SIZE);
     diskfile.flush();
@@ -59,8 +151,206 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (map != nullptr) {
+        std::memcpy(blk, map + offset, BLOCK_SIZE);
+        return 0;
+    }
+    if (fd >= 0)
+        return pread(fd, blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+    std::lock_guard<std::mutex> guard(stream_lock);
     diskfile.seekg(offset, std::ios_base::beg);
     diskfile.read((char*)blk, BLOCK_SIZE);
     return 0;
 }
+
+// length of the run of consecutive block numbers starting at block_nos[0]
+unsigned
+Disk::run_length(const unsigned *block_nos, unsigned count)
+{
+    unsigned n = 1;
+    while (n < count && n < IOV_MAX && block_nos[n] == block_nos[0] + n)
+        n++;
+    return n;
+}
+
+// fills req with one transfer per run of the blocks
+void
+Disk::plan_transfer(bool write, const unsigned *block_nos, uint8_t **blks, unsigned count,
+                    disk_request *req)
+{
+    req->iov.resize(count);
+    unsigned i = 0;
+    while (i < count) {
+        unsigned n = run_length(block_nos + i, count - i);
+        aio_part part;
+        part.req = req;
+        part.write = write;
+        part.fd = fd;
+        part.offset = (uint64_t)block_nos[i] * BLOCK_SIZE;
+        part.iov_index = i;
+        part.iov_count = n;
+        part.length = n * BLOCK_SIZE;
+        req->parts.push_back(part);
+        for (unsigned k = 0; k < n; k++) {
+            req->iov[i + k].iov_base = blks[i + k];
+            req->iov[i + k].iov_len = BLOCK_SIZE;
+        }
+        i += n;
+    }
+}
+
+// starts the runs of the blocks at the same time through io_uring.
+// Returns false and does nothing if there is a single run, one system call
+// does it, or if there is no io_uring; the caller transfers them itself.
+bool
+Disk::start_transfer(bool write, const unsigned *block_nos, uint8_t **blks, unsigned count,
+                     disk_request *req)
+{
+    if (fd < 0 || run_length(block_nos, count) == count || !aio.uses_uring())
+        return false;
+    plan_transfer(write, block_nos, blks, count, req);
+    aio.submit(req);
+    return true;
+}
+
+// starts reading count blocks, req->wait() waits for them
+int
+Disk::start_readv(const unsigned *block_nos, uint8_t **blks, unsigned count, disk_request *req)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (block_nos[i] >= no_blocks) {
+            std::cout << "Disk::start_readv - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+    }
+    if (map == nullptr && fd >= 0) {
+        plan_transfer(false, block_nos, blks, count, req);
+        aio.submit(req);
+        return 0;
+    }
+    // copying from the mapping or through the fstream is done at once
+    req->pending = 0;
+    req->failed = readv_blocks(block_nos, blks, count) < 0;
+    return 0;
+}
+
+// reads count blocks, block_nos[i] into blks[i]
+int
+Disk::readv_blocks(const unsigned *block_nos, uint8_t **blks, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (block_nos[i] >= no_blocks) {
+            std::cout << "Disk::readv_blocks - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+    }
+    if (map != nullptr) {
+        for (unsigned i = 0; i < count; i++)
+            std::memcpy(blks[i], map + (off_t)block_nos[i] * BLOCK_SIZE, BLOCK_SIZE);
+        return 0;
+    }
+    if (fd < 0) {
+        // one seek per run, the blocks of a run are then read in sequence
+        std::lock_guard<std::mutex> guard(stream_lock);
+        unsigned i = 0;
+        while (i < count) {
+            unsigned n = run_length(block_nos + i, count - i);
+            diskfile.seekg((off_t)block_nos[i] * BLOCK_SIZE, std::ios_base::beg);
+            for (unsigned k = 0; k < n; k++)
+                diskfile.read((char*)blks[i + k], BLOCK_SIZE);
+            i += n;
+        }
+        return diskfile.good() ? 0 : -1;
+    }
+    // several runs are read at the same time
+    disk_request req;
+    if (start_transfer(false, block_nos, blks, count, &req))
+        return req.wait();
+    struct iovec iov[IOV_MAX];
+    unsigned i = 0;
+    while (i < count) {
+        unsigned n = run_length(block_nos + i, count - i);
+        for (unsigned k = 0; k < n; k++) {
+            iov[k].iov_base = blks[i + k];
+            iov[k].iov_len = BLOCK_SIZE;
+        }
+        off_t offset = (off_t)block_nos[i] * BLOCK_SIZE;
+        if (preadv(fd, iov, n, offset) != (ssize_t)n * BLOCK_SIZE)
+            return -1;
+        i += n;
+    }
+    return 0;
+}
+
+// writes count blocks, blks[i] to block_nos[i]
+int
+Disk::writev_blocks(const unsigned *block_nos, uint8_t **blks, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (block_nos[i] >= no_blocks) {
+            std::cout << "Disk::writev_blocks - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+    }
+    if (map != nullptr) {
+        for (unsigned i = 0; i < count; i++)
+            std::memcpy(map + (off_t)block_nos[i] * BLOCK_SIZE, blks[i], BLOCK_SIZE);
+        return 0;
+    }
+    if (fd < 0) {
+        std::lock_guard<std::mutex> guard(stream_lock);
+        unsigned i = 0;
+        while (i < count) {
+            unsigned n = run_length(block_nos + i, count - i);
+            diskfile.seekp((off_t)block_nos[i] * BLOCK_SIZE, std::ios_base::beg);
+            for (unsigned k = 0; k < n; k++)
+                diskfile.write((char*)blks[i + k], BLOCK_SIZE);
+            i += n;
+        }
+        diskfile.flush();
+        return diskfile.good() ? 0 : -1;
+    }
+    disk_request req;
+    if (start_transfer(true, block_nos, blks, count, &req))
+        return req.wait();
+    struct iovec iov[IOV_MAX];
+    unsigned i = 0;
+    while (i < count) {
+        unsigned n = run_length(block_nos + i, count - i);
+        for (unsigned k = 0; k < n; k++) {
+            iov[k].iov_base = blks[i + k];
+            iov[k].iov_len = BLOCK_SIZE;
+        }
+        off_t offset = (off_t)block_nos[i] * BLOCK_SIZE;
+        if (pwritev(fd, iov, n, offset) != (ssize_t)n * BLOCK_SIZE)
+            return -1;
+        i += n;
+    }
+    return 0;
+}
+
+// returns a pointer to the block inside the mapping, or nullptr if the
+// disk is not memory mapped
+const uint8_t *
+Disk::block_ptr(unsigned block_no)
+{
+    if (map == nullptr || block_no >= no_blocks)
+        return nullptr;
+    return map + (off_t)block_no * BLOCK_SIZE;
+}
+
+// makes all written blocks durable
+int
+Disk::sync()
+{
+    if (map != nullptr)
+        return msync(map, disk_size, MS_SYNC) == 0 ? 0 : -1;
+    if (fd >= 0)
+        return fsync(fd) == 0 ? 0 : -1;
+    std::lock_guard<std::mutex> guard(stream_lock);
+    diskfile.flush();
+    if (!diskfile.good())
+        return -1;
+    return fsync(sync_fd) == 0 ? 0 : -1;
+}
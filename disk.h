@@ -1,28 +1,83 @@
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <mutex>
+#include "geometry.h"
+#include "aio.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
+// size of a new disk file, format can change it
+#define DISK_BLOCKS 2048
 #define DEBUG false
 
+// how the disk file is accessed
+#define DISK_FSTREAM 0  // seek + copy through an fstream, flushed on every write and
+                        // synced with fsync() on a second descriptor
+#define DISK_MMAP 1     // the whole file is mapped, synced with msync()
+#define DISK_PREAD 2    // pread/pwrite on a file descriptor, synced with fsync()
+
+// backend used when none is given, override with -DDISK_BACKEND=...
+#ifndef DISK_BACKEND
+#define DISK_BACKEND DISK_FSTREAM
+#endif
+
 class Disk {
 private:
+    int backend;
     std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    // the fstream has one position, a seek and the transfer after it go
+    // together. The other backends take an offset with every call.
+    std::mutex stream_lock;
+    // file descriptor used by DISK_MMAP and DISK_PREAD
+    int fd;
+    // DISK_FSTREAM: the same file opened again, only for fsync()
+    int sync_fd;
+    uint8_t *map;
+    // taken from the size of the disk file
+    unsigned no_blocks;
+    uint64_t disk_size;
     bool disk_file_exists (const std::string& name);
+    bool open_disk_file();
+    bool map_disk_file();
+    void close_disk_file();
+    // length of the run of consecutive block numbers starting at block_nos[0]
+    unsigned run_length(const unsigned *block_nos, unsigned count);
+    // DISK_PREAD transfers more than one run at a time through it
+    AsyncIO aio;
+    void plan_transfer(bool write, const unsigned *block_nos, uint8_t **blks, unsigned count,
+                       disk_request *req);
+    bool start_transfer(bool write, const unsigned *block_nos, uint8_t **blks, unsigned count,
+                        disk_request *req);
 public:
-    Disk();
+    Disk(int backend = DISK_BACKEND);
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
+    // makes the disk no_blocks blocks large, blocks past the old end read
+    // as zeros
+    int resize(unsigned no_blocks);
+    int get_backend() { return backend; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads count blocks, block_nos[i] into blks[i]. Runs of consecutive
+    // block numbers are read with a single system call.
+    int readv_blocks(const unsigned *block_nos, uint8_t **blks, unsigned count);
+    // writes count blocks, blks[i] to block_nos[i]. Runs of consecutive
+    // block numbers are written with a single system call.
+    int writev_blocks(const unsigned *block_nos, uint8_t **blks, unsigned count);
+    // starts reading count blocks like readv_blocks() and returns, req->wait()
+    // waits for them. The other backends read them before returning.
+    int start_readv(const unsigned *block_nos, uint8_t **blks, unsigned count, disk_request *req);
+    // returns a pointer to the block inside the mapping, or nullptr if the
+    // disk is not memory mapped
+    const uint8_t *block_ptr(unsigned block_no);
+    // makes all written blocks durable
+    int sync();
 };
 
 #endif // __DISK_H__
@@ -0,0 +1,114 @@
+#include <iostream>
+#include "freemap.h"
+
+FreeMap::FreeMap() : no_blocks(0), free_count(0), hint(0)
+{
+}
+
+// rebuilds the map, block i is free when fat[i] == free_value
+void
+FreeMap::build(const geometry::fat_entry *fat, unsigned no_blocks, geometry::fat_entry free_value)
+{
+    this->no_blocks = no_blocks;
+    words.assign((no_blocks + 63) / 64, 0);
+    free_count = 0;
+    hint = 0;
+    for (unsigned i = 0; i < no_blocks; i++) {
+        if (fat[i] == free_value) {
+            words[i / 64] |= (uint64_t)1 << (i % 64);
+            free_count++;
+        }
+    }
+}
+
+// takes the next free block at or after the hint, -1 if the disk is full.
+// Full words are skipped 64 blocks at a time.
+int
+FreeMap::alloc()
+{
+    if (free_count == 0)
+        return -1;
+    unsigned n = words.size();
+    for (unsigned k = 0; k < n; k++) {
+        unsigned w = (hint + k) % n;
+        if (words[w] != 0) {
+            unsigned block_no = w * 64 + __builtin_ctzll(words[w]);
+            words[w] &= words[w] - 1;
+            free_count--;
+            hint = w;
+            return block_no;
+        }
+    }
+    return -1;
+}
+
+// takes a run of count consecutive free blocks and returns the first one,
+// -1 if there is no such run
+int
+FreeMap::alloc_run(unsigned count, bool best_fit)
+{
+    if (count == 0 || count > free_count)
+        return -1;
+    int best = -1;
+    unsigned best_len = 0;
+    unsigned b = 0;
+    while (b < no_blocks) {
+        // skip used blocks, a whole word at a time when none are free
+        if (b % 64 == 0 && words[b / 64] == 0) {
+            b += 64;
+            continue;
+        }
+        if (!is_free(b)) {
+            b++;
+            continue;
+        }
+        // measure the free extent starting at b
+        unsigned start = b;
+        while (b < no_blocks && is_free(b)) {
+            if (b % 64 == 0 && words[b / 64] == ~(uint64_t)0 && b + 64 <= no_blocks)
+                b += 64;
+            else
+                b++;
+        }
+        unsigned len = b - start;
+        if (len < count)
+            continue;
+        if (best < 0 || len < best_len) {
+            best = start;
+            best_len = len;
+        }
+        if (!best_fit || len == count)
+            break;
+    }
+    if (best < 0)
+        return -1;
+    for (unsigned i = 0; i < count; i++)
+        take(best + i);
+    return best;
+}
+
+void
+FreeMap::take(unsigned block_no)
+{
+    if (block_no >= no_blocks || !is_free(block_no))
+        return;
+    words[block_no / 64] &= ~((uint64_t)1 << (block_no % 64));
+    free_count--;
+}
+
+void
+FreeMap::release(unsigned block_no)
+{
+    if (block_no >= no_blocks || is_free(block_no))
+        return;
+    words[block_no / 64] |= (uint64_t)1 << (block_no % 64);
+    free_count++;
+}
+
+bool
+FreeMap::is_free(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return false;
+    return (words[block_no / 64] >> (block_no % 64)) & 1;
+}
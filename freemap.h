@@ -0,0 +1,35 @@
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+// in-memory index of the free blocks, one bit per block (1 = free). It is
+// rebuilt from the FAT on mount and kept in sync by the FS operations.
+class FreeMap {
+private:
+    std::vector<uint64_t> words;
+    unsigned no_blocks;
+    unsigned free_count;
+    // word where the next search starts (next-fit)
+    unsigned hint;
+public:
+    FreeMap();
+    // rebuilds the map, block i is free when fat[i] == free_value
+    void build(const geometry::fat_entry *fat, unsigned no_blocks, geometry::fat_entry free_value);
+    // takes the next free block at or after the hint, -1 if the disk is full
+    int alloc();
+    // takes a run of count consecutive free blocks and returns the first
+    // one, -1 if there is no such run. First-fit takes the lowest run that is
+    // long enough, best-fit the shortest one.
+    int alloc_run(unsigned count, bool best_fit);
+    // marks a block as used / free
+    void take(unsigned block_no);
+    void release(unsigned block_no);
+    bool is_free(unsigned block_no);
+    unsigned get_free_count() { return free_count; }
+};
+
+#endif // __FREEMAP_H__
@@ -1,963 +1,2463 @@
 #include <iostream>
 #include <cstring>
 #include <iomanip>
+#include <sstream>
 #include <unistd.h>
+#include <cerrno>
+#include <sys/uio.h>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
 #include "fs.h"
 
-FS::FS()
+// the input and output of the operations of each thread, see redirect()
+static thread_local std::istream *thread_input = nullptr;
+static thread_local std::ostream *thread_output = nullptr;
+
+// splits path into its components, empty ones are skipped. Returns true
+// if one of them is "..", such paths are not cached.
+static bool
+split_path(const std::string &path, std::vector<std::string> *parts)
 {
-    std::cout << "FS::FS()... Creating file system\n";
+    bool up = false;
+    std::string part;
+    for (unsigned i = 0; i <= path.size(); i++) {
+        if (i < path.size() && path[i] != '/') {
+            part += path[i];
+        } else if (!part.empty()) {
+            up = up || part == "..";
+            parts->push_back(part);
+            part.clear();
+        }
+    }
+    return up;
 }
 
-FS::~FS()
+// splits path into the directory part and the last component, trailing
+// slashes are ignored. "f" gives "" and "f", "/f" gives "/" and "f".
+static void
+split_last(const std::string &path, std::string *dirpath, std::string *name)
+{
+    std::string p = path;
+    while (p.size() > 1 && p[p.size() - 1] == '/')
+        p.erase(p.size() - 1);
+    size_t i = p.find_last_of('/');
+    if (i == std::string::npos) {
+        *dirpath = "";
+        *name = p;
+        return;
+    }
+    *dirpath = p.substr(0, i + 1);
+    *name = p.substr(i + 1);
+}
+
+// the first block of the entry, FAT_EOF if it has none
+static inline int
+first_block(const dir_entry &entry)
+{
+    return entry.first_blk == DIR_NO_BLOCK ? FAT_EOF : (int)entry.first_blk;
+}
+
+// number of blocks the FAT of a disk of no_blocks blocks takes
+static unsigned
+fat_size(unsigned no_blocks)
+{
+    return (no_blocks + FAT_PER_BLOCK - 1) / FAT_PER_BLOCK;
+}
+
+static void
+set_name(dir_entry *entry, const std::string &name)
 {
+    std::strncpy(entry->file_name, name.c_str(), sizeof(entry->file_name) - 1);
+    entry->file_name[sizeof(entry->file_name) - 1] = '\0';
+}
 
+FS::FS(unsigned cache_blocks, int disk_backend) : disk(disk_backend), cache(disk, cache_blocks),
+    fat_blocks(0), journal(disk), checkpoint_needed(false), commit_interval(1), ops_since_commit(0),
+    fat_updates(0), fat_commits(0), fat_block_writes(0),
+    alloc_mode(ALLOC_FIRST_FIT), use_chain_index(true), use_read_ahead(true), executor(FS_ASYNC_THREADS)
+{
+    std::memset(handles, 0, sizeof(handles));
+    attach(&cwd);
+    output() << "FS::FS()... Creating file system\n";
+    mount();
 }
 
-// formats the disk, i.e., creates an empty file system
+// mount loads the FAT and the root directory from the disk. The superblock
+// is checked first so an unformatted disk costs a single block read.
 int
-FS::format()
+FS::mount()
 {
-    std::cout << "FS::format()\n";
+    RWGuard guard(fat_lock, true);
+    reset_sessions();
+    mounted = false;
+    discard_txn();
+    // everything is read from the disk again, another process may have
+    // written it since the blocks were cached
+    cache.resize(cache.get_capacity());
+    clear_indexes();
+
+    super_block sb;
+    uint8_t block[BLOCK_SIZE];
+    cache.read(SUPER_BLOCK, block);
+    std::memcpy(&sb, block, sizeof(sb));
+    if (sb.magic != FS_MAGIC || sb.version != FS_VERSION) {
+        output() << "No file system found on disk, use format\n";
+        reset_fat(disk.get_no_blocks());
+        rebuild_freemap();
+        return -1;
+    }
+    if (sb.block_size != BLOCK_SIZE || sb.no_blocks != disk.get_no_blocks() ||
+        sb.fat_start != FAT_BLOCK || sb.fat_blocks != fat_size(sb.no_blocks) ||
+        sb.fat_entry_size != geometry::fat_entry_size ||
+        sb.journal_start != FAT_BLOCK + sb.fat_blocks || sb.journal_blocks != Journal::size(sb.fat_blocks)) {
+        output() << "File system geometry does not match the disk (" << sb.no_blocks
+                  << " blocks of " << sb.block_size << " bytes), use format\n";
+        reset_fat(disk.get_no_blocks());
+        rebuild_freemap();
+        return -1;
+    }
 
-    std::memset(fat, FAT_FREE, sizeof(fat));
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+    // committed transactions that may not have reached their home blocks
+    journal.setup(sb.journal_start, sb.journal_blocks);
+    int replayed = journal.replay(cache);
+    if (replayed < 0) {
+        output() << "Corrupt journal on disk, use format\n";
+        reset_fat(disk.get_no_blocks());
+        rebuild_freemap();
+        return -1;
+    }
+    if (replayed > 0)
+        output() << "Replayed " << replayed << " transactions from the journal\n";
+
+    if (load_fat() < 0 || !fat_is_valid()) {
+        output() << "Corrupt FAT on disk, use format\n";
+        reset_fat(disk.get_no_blocks());
+        rebuild_freemap();
+        return -1;
+    }
+    rebuild_freemap();
+    mounted = true;
+    return 0;
+}
 
-    std::memset(current_direct, 0, sizeof(current_direct));
-    disk.write(ROOT_BLOCK, (uint8_t*)current_direct);
+// an empty FAT for no_blocks blocks, only the reserved blocks are taken
+void
+FS::reset_fat(unsigned no_blocks)
+{
+    fat_blocks = fat_size(no_blocks);
+    fat.assign((size_t)fat_blocks * FAT_PER_BLOCK, FAT_FREE);
+    for (unsigned i = ROOT_BLOCK; i < reserved_blocks() && i < fat.size(); i++)
+        fat[i] = FAT_EOF;
+    fat_dirty.clear();
+}
 
-    current_index = 0;
-    parent_index[current_index] = 0;
+// the root directory, the superblock, the FAT and the journal
+unsigned
+FS::reserved_blocks()
+{
+    return FAT_BLOCK + fat_blocks + Journal::size(fat_blocks);
+}
 
+// reads the FAT blocks of the disk, CHAIN_BATCH at a time
+int
+FS::load_fat()
+{
+    fat_blocks = fat_size(disk.get_no_blocks());
+    fat.assign((size_t)fat_blocks * FAT_PER_BLOCK, FAT_FREE);
+    fat_dirty.clear();
+    std::vector<uint8_t> buf(CHAIN_BATCH * BLOCK_SIZE);
+    unsigned block_nos[CHAIN_BATCH];
+    const uint8_t *data[CHAIN_BATCH];
+    for (unsigned i = 0; i < fat_blocks; i += CHAIN_BATCH) {
+        unsigned count = std::min<unsigned>(CHAIN_BATCH, fat_blocks - i);
+        for (unsigned k = 0; k < count; k++)
+            block_nos[k] = FAT_BLOCK + i + k;
+        if (cache.readv(block_nos, count, &buf[0], data) < 0)
+            return -1;
+        for (unsigned k = 0; k < count; k++)
+            std::memcpy(&fat[(size_t)(i + k) * FAT_PER_BLOCK], data[k], BLOCK_SIZE);
+    }
     return 0;
 }
 
-// create <filepath> creates a new file on the disk, the data content is
-// written on the following rows (ended with an empty row)
+// forgets everything cached about chains, directories and paths
+void
+FS::clear_indexes()
+{
+    {
+        std::lock_guard<std::mutex> guard(chains_lock);
+        chains.clear();
+    }
+    {
+        std::lock_guard<std::mutex> guard(readahead_lock);
+        readahead.clear();
+    }
+    {
+        std::lock_guard<std::mutex> guard(dirs_lock);
+        dirs.clear();
+    }
+    std::lock_guard<std::mutex> guard(paths_lock);
+    paths.clear();
+}
+
+// builds the free map from the FAT, the reserved blocks are never free
+void
+FS::rebuild_freemap()
+{
+    freemap.build(&fat[0], disk.get_no_blocks(), FAT_FREE);
+    for (unsigned i = ROOT_BLOCK; i < reserved_blocks() && i < disk.get_no_blocks(); i++)
+        freemap.take(i);
+}
+
+// checks that the reserved blocks are taken and every entry is in range.
+// The root directory may have grown into a chain. Entries past the last
+// block fill up the last FAT block and must be free.
+bool
+FS::fat_is_valid()
+{
+    if (fat[ROOT_BLOCK] == FAT_FREE)
+        return false;
+    for (unsigned i = SUPER_BLOCK; i < reserved_blocks(); i++) {
+        if (fat[i] != FAT_EOF)
+            return false;
+    }
+    int no_blocks = disk.get_no_blocks();
+    for (int i = 0; i < no_blocks; i++) {
+        if (fat[i] < FAT_EOF || fat[i] >= no_blocks)
+            return false;
+    }
+    for (size_t i = no_blocks; i < fat.size(); i++) {
+        if (fat[i] != FAT_FREE)
+            return false;
+    }
+    return true;
+}
+
+// a clean unmount leaves nothing to replay. The async calls still queued
+// run first, nothing changes the FS after the last commit.
+FS::~FS()
+{
+    executor.shutdown();
+    RWGuard guard(fat_lock, true);
+    if (mounted) {
+        commit();
+        checkpoint();
+    }
+    cache.flush();
+}
+
+// open <filepath> returns a handle for pread/pwrite, or -1
 int
-FS::create(std::string filepath)
+FS::open(work_dir &from, std::string filepath)
 {
-    dir_entry parentt[64];
-    disk.read(parent_index[current_index], (uint8_t*)parentt);
-    int8_t right = static_cast<int>(parentt[current_index].access_rights);
-    if (right == 0 || right == 1 || right == 4, right == 5) {
-        std::cout << "Permission denied\n";
+    RWGuard guard(fat_lock, false);
+    int dir;
+    dir_slot slot;
+    dir_entry entry;
+    int res = find_entry(current_dir(from), filepath, &dir, &slot, &entry);
+    if (res < 0) {
+        output() << filepath << (res == -2 ? " is not a directory\n" : " not found\n");
+        return -1;
+    }
+    if (entry.type != TYPE_FILE) {
+        output() << filepath << " is not a file\n";
+        return -1;
+    }
+    std::lock_guard<std::mutex> handles_guard(handles_lock);
+    for (int fh = 0; fh < MAX_OPEN_FILES; fh++) {
+        if (handles[fh].in_use)
+            continue;
+        open_file *h = &handles[fh];
+        h->in_use = true;
+        h->dir = dir;
+        h->dir_block = slot.block;
+        h->entry_index = slot.index;
+        std::memcpy(h->file_name, entry.file_name, sizeof(h->file_name));
+        h->first_blk = first_block(entry);
+        h->pos_block = h->first_blk;
+        h->pos_offset = 0;
+        return fh;
+    }
+    output() << "Too many open files\n";
+    return -1;
+}
+
+int
+FS::close(int fh)
+{
+    open_file *h = get_handle(fh);
+    if (h == nullptr)
+        return -1;
+    std::lock_guard<std::mutex> guard(handles_lock);
+    h->in_use = false;
+    return 0;
+}
+
+// reads up to len bytes from offset into buf, returns the number of bytes
+// read or -1
+int
+FS::pread(int fh, uint32_t offset, uint32_t len, uint8_t *buf)
+{
+    RWGuard guard(fat_lock, false);
+    open_file *h = get_handle(fh);
+    dir_entry entry;
+    if (h == nullptr || load_entry(h, &entry) < 0)
+        return -1;
+    if (!(entry.access_rights & READ)) {
+        output() << "Permission denied\n";
+        return -1;
+    }
+    if (offset >= entry.size)
         return 0;
+    len = std::min(len, entry.size - offset);
+
+    // the bytes are copied from the cache straight into buf. Runs of whole
+    // blocks are read up to CHAIN_BATCH at a time, the disk reads of a
+    // batch are in flight together.
+    uint32_t done = 0;
+    int block = seek_block(h, h->first_blk, offset);
+    while (done < len && block != FAT_EOF) {
+        unsigned in_block = (offset + done) % BLOCK_SIZE;
+        if (in_block == 0 && len - done >= 2 * BLOCK_SIZE) {
+            unsigned block_nos[CHAIN_BATCH];
+            const uint8_t *data[CHAIN_BATCH];
+            unsigned count = 0;
+            while (block != FAT_EOF && count < CHAIN_BATCH && len - done >= (count + 1) * BLOCK_SIZE) {
+                block_nos[count++] = block;
+                block = fat[block];
+            }
+            uint8_t *dest = buf + done;
+            if (cache.readv(block_nos, count, dest, data) < 0)
+                return -1;
+            for (unsigned k = 0; k < count; k++) {
+                if (data[k] != dest + k * BLOCK_SIZE)
+                    std::memcpy(dest + k * BLOCK_SIZE, data[k], BLOCK_SIZE);
+            }
+            done += count * BLOCK_SIZE;
+        } else {
+            unsigned n = std::min<uint32_t>(len - done, BLOCK_SIZE - in_block);
+            if (cache.read(block, buf + done, in_block, n) < 0)
+                return -1;
+            done += n;
+        }
+        if (done < len)
+            block = seek_block(h, h->first_blk, offset + done);
     }
-    int8_t i;
-    for (i = 0; i < N_DIRECTORIES; i++) {
-        if (current_direct[i].file_name[0] == '\0') {
-            break;
+    if (use_read_ahead && done > 0)
+        read_ahead(h, offset, done, entry.size);
+    return done;
+}
+
+// tells the read-ahead about a read of the file of h and starts reading the
+// blocks it wants. The caller holds fat_lock.
+void
+FS::read_ahead(open_file *h, uint32_t offset, uint32_t len, uint32_t size)
+{
+    unsigned from;
+    unsigned count;
+    {
+        std::lock_guard<std::mutex> guard(readahead_lock);
+        count = readahead.access(h->first_blk, offset, len, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, &from);
+    }
+    if (count == 0)
+        return;
+    // h keeps its position for the next read
+    open_file pos = *h;
+    std::vector<unsigned> block_nos;
+    int block = seek_block(&pos, h->first_blk, from * BLOCK_SIZE);
+    while (block != FAT_EOF && block < (int)disk.get_no_blocks() && block_nos.size() < count) {
+        block_nos.push_back(block);
+        block = fat[block];
+    }
+    if (block_nos.empty())
+        return;
+    cache.prefetch(&block_nos[0], block_nos.size());
+}
+
+int
+FS::pread(work_dir &from, std::string filepath, uint32_t offset, uint32_t len, uint8_t *buf)
+{
+    int fh = open(from, filepath);
+    if (fh < 0)
+        return -1;
+    int ret = pread(fh, offset, len, buf);
+    close(fh);
+    return ret;
+}
+
+// writes len bytes from buf at offset, growing the file if needed. Returns
+// the number of bytes written or -1.
+int
+FS::pwrite(int fh, uint32_t offset, uint32_t len, const uint8_t *buf)
+{
+    open_file *h = get_handle(fh);
+    if (h == nullptr)
+        return -1;
+    // a write into the blocks the file has runs under the shared lock, one
+    // that needs more blocks starts over with the exclusive lock
+    for (bool exclusive = false; ; exclusive = true) {
+        op_scope scope(this, exclusive);
+        dir_entry entry;
+        if (load_entry(h, &entry) < 0)
+            return -1;
+        if (!(entry.access_rights & WRITE)) {
+            output() << "Permission denied\n";
+            return -1;
         }
+        if (len == 0)
+            return 0;
+        // sizes are 32 bits, see dir_entry
+        if ((uint64_t)offset + len > UINT32_MAX) {
+            output() << "File too large\n";
+            return -1;
+        }
+        uint64_t room = ((uint64_t)entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if ((uint64_t)offset + len > room) {
+            if (!exclusive)
+                continue;
+            if (extend_chain(h, &entry, offset + len) < 0)
+                return -1;
+        }
+        return write_blocks(h, entry.size, offset, len, buf);
+    }
+}
+
+// writes len bytes at offset into the blocks of the file and grows its
+// size from size if they end past it. Whole blocks are overwritten, the
+// cache changes parts of blocks in place.
+int
+FS::write_blocks(open_file *h, uint32_t size, uint32_t offset, uint32_t len, const uint8_t *buf)
+{
+    uint32_t done = 0;
+    int block = seek_block(h, h->first_blk, offset);
+    while (done < len && block != FAT_EOF) {
+        unsigned in_block = (offset + done) % BLOCK_SIZE;
+        unsigned n = std::min<uint32_t>(len - done, BLOCK_SIZE - in_block);
+        if (cache.write(block, buf + done, in_block, n) < 0)
+            return -1;
+        done += n;
+        if (done < len)
+            block = seek_block(h, h->first_blk, offset + done);
+    }
+    if (offset + done <= size)
+        return done;
+    // writers of other files of the directory change entries in the same
+    // blocks, and another writer of this file may have grown it already
+    std::lock_guard<std::mutex> guard(dir_lock(h->dir));
+    dir_entry entry;
+    if (load_entry(h, &entry) < 0)
+        return -1;
+    if (offset + done > entry.size) {
+        entry.size = offset + done;
+        store_entry(h, &entry);
     }
+    return done;
+}
+
+int
+FS::pwrite(work_dir &from, std::string filepath, uint32_t offset, uint32_t len, const uint8_t *buf)
+{
+    int fh = open(from, filepath);
+    if (fh < 0)
+        return -1;
+    int ret = pwrite(fh, offset, len, buf);
+    close(fh);
+    return ret;
+}
 
-    if (static_cast<int>(i) == 64) {
-        std::cout << "No space available\n";
+open_file *
+FS::get_handle(int fh)
+{
+    if (fh < 0 || fh >= MAX_OPEN_FILES)
+        return nullptr;
+    std::lock_guard<std::mutex> guard(handles_lock);
+    if (!handles[fh].in_use)
+        return nullptr;
+    return &handles[fh];
+}
+
+// reads the directory entry of an open file. Fails if the file has been
+// removed or renamed since it was opened. The entry is looked up again
+// when a growing directory moved it to another block.
+int
+FS::load_entry(open_file *h, dir_entry *entry)
+{
+    dir_entry buf[N_DIRECTORIES];
+    const dir_entry *dir = peek_dir(h->dir_block, buf);
+    if (std::strcmp(dir[h->entry_index].file_name, h->file_name) == 0) {
+        *entry = dir[h->entry_index];
+    } else {
+        dir_slot slot;
+        if (dir_find(h->dir, h->file_name, &slot, entry) < 0) {
+            output() << h->file_name << " not found\n";
+            return -1;
+        }
+        h->dir_block = slot.block;
+        h->entry_index = slot.index;
+    }
+    if (entry->type != TYPE_FILE) {
+        output() << h->file_name << " not found\n";
+        return -1;
+    }
+    // the chain was replaced, the cached position is useless
+    if (first_block(*entry) != h->first_blk) {
+        h->first_blk = first_block(*entry);
+        h->pos_block = h->first_blk;
+        h->pos_offset = 0;
+    }
+    return 0;
+}
+
+// writes the directory entry of an open file back
+int
+FS::store_entry(open_file *h, const dir_entry *entry)
+{
+    dir_slot slot = { h->dir_block, h->entry_index };
+    return dir_set(slot, *entry);
+}
+
+// returns the block holding offset. With the chain index it is a single
+// lookup, otherwise the walk starts at the cached position when it is not
+// past offset, so sequential accesses don't re-walk the FAT.
+int
+FS::seek_block(open_file *h, int first_blk, uint32_t offset)
+{
+    uint32_t target = offset - offset % BLOCK_SIZE;
+    if (use_chain_index && first_blk != FAT_EOF) {
+        h->pos_block = chain_block(first_blk, offset / BLOCK_SIZE);
+        h->pos_offset = target;
+        return h->pos_block;
+    }
+    if (h->pos_block == FAT_EOF || h->pos_offset > target) {
+        h->pos_block = first_blk;
+        h->pos_offset = 0;
+    }
+    while (h->pos_offset < target && h->pos_block != FAT_EOF) {
+        h->pos_block = fat[h->pos_block];
+        h->pos_offset += BLOCK_SIZE;
+    }
+    return h->pos_block;
+}
+
+// block k of the chain starting at first from the chain index, FAT_EOF if
+// the chain is shorter
+int
+FS::chain_block(int first, unsigned k)
+{
+    std::lock_guard<std::mutex> guard(chains_lock);
+    const std::vector<int> &blocks = chains.get(first, &fat[0], disk.get_no_blocks());
+    return k < blocks.size() ? blocks[k] : FAT_EOF;
+}
+
+// adds zeroed blocks to the end of the file until it can hold new_size bytes
+int
+FS::extend_chain(open_file *h, dir_entry *entry, uint32_t new_size)
+{
+    unsigned have = ((uint64_t)entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned need = ((uint64_t)new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (need <= have)
         return 0;
+    std::vector<unsigned> blocks(need - have);
+    if (alloc_blocks(blocks.size(), &blocks[0]) < 0)
+        return -1;
+    uint8_t zero[BLOCK_SIZE] = {0};
+    for (unsigned i = 0; i < blocks.size(); i++) {
+        cache.write(blocks[i], zero);
+        set_fat(blocks[i], i + 1 < blocks.size() ? blocks[i + 1] : FAT_EOF);
+    }
+    if (have == 0) {
+        entry->first_blk = blocks[0];
+        h->first_blk = blocks[0];
+        h->pos_block = blocks[0];
+        h->pos_offset = 0;
+    } else {
+        int tail = seek_block(h, h->first_blk, (have - 1) * BLOCK_SIZE);
+        set_fat(tail, blocks[0]);
+        std::lock_guard<std::mutex> guard(chains_lock);
+        for (unsigned i = 0; i < blocks.size(); i++)
+            chains.append(h->first_blk, blocks[i]);
+    }
+    mark_fat_dirty();
+    return store_entry(h, entry);
+}
+
+// sync writes all cached blocks back to the disk and makes them durable
+int
+FS::sync()
+{
+    RWGuard guard(fat_lock, true);
+    if (commit() < 0 || cache.flush() < 0 || disk.sync() < 0) {
+        output() << "sync failed\n";
+        return -1;
+    }
+    return 0;
+}
+
+// stats prints counters for the block cache, the FAT and the indexes
+int
+FS::stats()
+{
+    RWGuard guard(fat_lock, true);
+    cache_stats cs = cache.get_stats();
+    uint64_t lookups = cs.hits + cs.misses;
+    output() << "cache capacity:   " << cache.get_capacity() << " blocks\n";
+    output() << "cache hits:       " << cs.hits << "\n";
+    output() << "cache misses:     " << cs.misses << "\n";
+    output() << "cache evictions:  " << cs.evictions << "\n";
+    output() << "cache writebacks: " << cs.writebacks << "\n";
+    if (lookups > 0)
+        output() << "cache hit rate:   " << (100 * cs.hits / lookups) << "%\n";
+    readahead_stats rs;
+    {
+        std::lock_guard<std::mutex> ra_guard(readahead_lock);
+        rs = readahead.get_stats();
+    }
+    output() << "sequential reads: " << rs.sequential << " (" << rs.random << " other)\n";
+    output() << "read-ahead:       " << rs.windows << " windows, " << rs.blocks << " blocks\n";
+    output() << "prefetched:       " << cs.prefetched << " blocks, " << cs.prefetch_hits << " read, "
+              << cs.prefetch_unused << " unused\n";
+    if (cs.prefetched > 0)
+        output() << "prefetch hit rate: " << (100 * cs.prefetch_hits / cs.prefetched) << "%\n";
+    output() << "FAT updates:      " << fat_updates << "\n";
+    output() << "FAT writes:       " << fat_commits << " (" << fat_block_writes << " of "
+              << fat_blocks << " blocks)\n";
+    output() << "FAT writes saved: " << (fat_updates > fat_commits ? fat_updates - fat_commits : 0) << "\n";
+    journal_stats js = journal.get_stats();
+    output() << "journal commits:  " << js.commits << " (" << js.blocks << " blocks)\n";
+    output() << "journal checkpoints: " << js.checkpoints << "\n";
+    output() << "journal replayed: " << js.replayed << "\n";
+    dir_index_stats di = dirs.get_stats();
+    output() << "dir lookups:      " << di.lookups << "\n";
+    output() << "dir probes:       " << di.probes << "\n";
+    output() << "dir index builds: " << di.builds << "\n";
+    path_cache_stats ps = paths.get_stats();
+    output() << "path cache hits:  " << ps.hits << " (" << ps.negative_hits << " negative)\n";
+    output() << "path cache misses: " << ps.misses << "\n";
+    output() << "path invalidations: " << ps.invalidations << "\n";
+    chain_index_stats ci = chains.get_stats();
+    output() << "chain index hits: " << ci.hits << "\n";
+    output() << "chain index walks: " << ci.misses << "\n";
+    return 0;
+}
+
+// the FAT is only changed in memory by the operations, it is written to the
+// disk when they are committed
+void
+FS::mark_fat_dirty()
+{
+    fat_updates++;
+}
+
+// writes the FAT blocks that changed since the last commit
+int
+FS::commit_fat()
+{
+    if (fat_dirty.empty())
+        return 0;
+    for (std::set<unsigned>::iterator it = fat_dirty.begin(); it != fat_dirty.end(); ++it) {
+        if (write_meta(FAT_BLOCK + *it, (uint8_t*)&fat[(size_t)*it * FAT_PER_BLOCK]) < 0)
+            return -1;
+    }
+    fat_block_writes += fat_dirty.size();
+    fat_dirty.clear();
+    fat_commits++;
+    return 0;
+}
+
+// metadata is held in the cache until it is committed
+int
+FS::write_meta(unsigned block, const uint8_t *data)
+{
+    if (cache.write_held(block, data) < 0)
+        return -1;
+    std::lock_guard<std::mutex> guard(txn_lock);
+    txn_blocks.insert(block);
+    return 0;
+}
+
+// writes the open transaction to the journal, after that its blocks may go
+// home and the blocks it freed may be reused. The data blocks of the
+// operations are written first so committed metadata never points at
+// blocks that are not on the disk.
+int
+FS::commit()
+{
+    if (commit_fat() < 0)
+        return -1;
+    ops_since_commit = 0;
+    if (mounted && !txn_blocks.empty()) {
+        std::vector<unsigned> block_nos(txn_blocks.begin(), txn_blocks.end());
+        std::vector<uint8_t*> blks(block_nos.size());
+        if (cache.flush() < 0)
+            return -1;
+        for (unsigned i = 0; i < block_nos.size(); i++)
+            blks[i] = (uint8_t*)cache.block_ptr(block_nos[i]);
+        if (journal.write(&block_nos[0], &blks[0], block_nos.size()) < 0) {
+            // too large for the journal, it goes home directly
+            output() << "Transaction of " << block_nos.size() << " blocks not journaled\n";
+            if (cache.release() < 0 || checkpoint() < 0)
+                return -1;
+        }
+    }
+    txn_blocks.clear();
+    if (cache.release() < 0)
+        return -1;
+    for (unsigned i = 0; i < txn_freed.size(); i++)
+        freemap.release(txn_freed[i]);
+    txn_freed.clear();
+    if (checkpoint_needed)
+        return checkpoint();
+    return 0;
+}
+
+// writes every block home and empties the journal
+int
+FS::checkpoint()
+{
+    if (cache.flush() < 0 || disk.sync() < 0 || journal.reset() < 0)
+        return -1;
+    checkpoint_needed = false;
+    return 0;
+}
+
+// forgets the open transaction, its metadata never reaches the disk
+void
+FS::discard_txn()
+{
+    cache.drop_held();
+    txn_blocks.clear();
+    txn_freed.clear();
+    fat_dirty.clear();
+    checkpoint_needed = false;
+}
+
+// ends an operation and releases fat_lock. The transaction is committed
+// every commit_interval operations, or earlier once it takes up half of
+// the slack of the journal.
+void
+FS::end_op(bool exclusive)
+{
+    bool due;
+    {
+        std::lock_guard<std::mutex> guard(txn_lock);
+        ops_since_commit++;
+        due = (!fat_dirty.empty() || !txn_blocks.empty()) &&
+              (ops_since_commit >= commit_interval ||
+               fat_dirty.size() + txn_blocks.size() >= JOURNAL_MIN_BLOCKS / 2);
+    }
+    if (!exclusive) {
+        fat_lock.unlock();
+        if (!due)
+            return;
+        // a commit takes the exclusive lock, another thread may have
+        // committed before it is free
+        fat_lock.lock();
+    }
+    if (due)
+        commit();
+    fat_lock.unlock();
+}
+
+// commit the metadata of every <ops> operations together, 1 commits after
+// each one
+void
+FS::set_commit_interval(unsigned ops)
+{
+    RWGuard guard(fat_lock, true);
+    commit_interval = ops > 0 ? ops : 1;
+    if (ops_since_commit >= commit_interval)
+        commit();
+}
+
+// formats the disk, i.e., creates an empty file system of no_blocks
+// blocks, 0 keeps the size of the disk
+int
+FS::format(unsigned no_blocks)
+{
+    output() << "FS::format()\n";
+    RWGuard guard(fat_lock, true);
+
+    if (no_blocks != 0 && (no_blocks < MIN_BLOCKS || no_blocks > MAX_BLOCKS)) {
+        output() << "A disk has " << MIN_BLOCKS << " to " << MAX_BLOCKS << " blocks\n";
+        return -1;
+    }
+    // format writes in place, nothing of the old file system is kept. No
+    // cached block may land in the new journal or past the new end.
+    discard_txn();
+    mounted = false;
+    cache.resize(cache.get_capacity());
+    if (no_blocks != 0 && no_blocks != disk.get_no_blocks() && disk.resize(no_blocks) < 0) {
+        output() << "Can't resize the disk to " << no_blocks << " blocks\n";
+        return -1;
+    }
+    // the old superblock must not outlive a failed format
+    uint8_t block[BLOCK_SIZE] = {0};
+    cache.write(SUPER_BLOCK, block);
+
+    reset_fat(disk.get_no_blocks());
+    for (unsigned i = 0; i < fat_blocks; i++)
+        fat_dirty.insert(i);
+    commit_fat();
+    rebuild_freemap();
+    clear_indexes();
+
+    dir_entry root[N_DIRECTORIES];
+    std::memset(root, 0, sizeof(root));
+    write_dir(ROOT_BLOCK, root);
+    txn_blocks.clear();
+    cache.release();
+    journal.setup(FAT_BLOCK + fat_blocks, Journal::size(fat_blocks));
+    if (cache.flush() < 0 || journal.reset() < 0) {
+        output() << "Can't write the file system\n";
+        return -1;
+    }
+
+    // the superblock goes last, it marks the disk as formatted
+    super_block sb;
+    sb.magic = FS_MAGIC;
+    sb.version = FS_VERSION;
+    sb.block_size = BLOCK_SIZE;
+    sb.no_blocks = disk.get_no_blocks();
+    sb.fat_start = FAT_BLOCK;
+    sb.fat_blocks = fat_blocks;
+    sb.fat_entry_size = geometry::fat_entry_size;
+    sb.journal_start = FAT_BLOCK + fat_blocks;
+    sb.journal_blocks = Journal::size(fat_blocks);
+    std::memcpy(block, &sb, sizeof(sb));
+    cache.write(SUPER_BLOCK, block);
+    if (cache.flush() < 0 || disk.sync() < 0) {
+        output() << "Can't write the file system\n";
+        return -1;
     }
 
-    int8_t j = filepath.find_last_of('/');
-    std::string source_file = filepath.substr(j + 1, filepath.size() - j);
+    reset_sessions();
+    mounted = true;
 
+    return 0;
+}
 
-    // get user input for the file content
-    std::string content;
+// create <filepath> creates a new file on the disk, the data content is
+// written on the following rows (ended with an empty row)
+int
+FS::create(work_dir &from, std::string filepath)
+{
+    op_scope scope(this, true);
+    int dir;
+    std::string name;
+    // the content still has to be read when the file can't be created
+    if (find_new(current_dir(from), filepath, &dir, &name) < 0) {
+        skip_input();
+        return 0;
+    }
+
+    // the content is written one block at a time as the rows arrive, a
+    // block is allocated and linked into the chain when it is full
+    uint8_t block[BLOCK_SIZE];
+    unsigned used = 0;
+    uint32_t size = 0;
+    int first = FAT_EOF;
+    int last = FAT_EOF;
     std::string line;
-    while (std::getline(std::cin, line) && !line.empty()) {
-        content += line + "\n";
+    bool full = false;
+    while (!full && std::getline(input(), line) && !line.empty()) {
+        line += '\n';
+        for (unsigned pos = 0; pos < line.size(); ) {
+            unsigned n = std::min<unsigned>(line.size() - pos, BLOCK_SIZE - used);
+            std::memcpy(block + used, line.data() + pos, n);
+            used += n;
+            pos += n;
+            size += n;
+            if (used == BLOCK_SIZE) {
+                if (write_next_block(block, used, &first, &last) < 0) {
+                    full = true;
+                    break;
+                }
+                used = 0;
+            }
+        }
     }
-    
-    if(source_file.size() > 55){
-        std::cout << "File name longer then 56\n";
+    if (!full && used > 0 && write_next_block(block, used, &first, &last) < 0)
+        full = true;
+    if (full) {
+        skip_input();
+        free_chain(first);
         return 0;
     }
+    add_file(dir, name, size, first);
+    return 0;
+}
 
-    int count_block_needed = content.size() / BLOCK_SIZE;
-    int remainder = content.size() % BLOCK_SIZE;
-    if (remainder > 0) {
-        count_block_needed++;
+// creates a file holding the len bytes of data. Unlike create and a
+// pwrite after it, no one sees the file before it has its content.
+int
+FS::create(work_dir &from, std::string filepath, const uint8_t *data, uint32_t len)
+{
+    op_scope scope(this, true);
+    int dir;
+    std::string name;
+    if (find_new(current_dir(from), filepath, &dir, &name) < 0)
+        return -1;
+    uint8_t block[BLOCK_SIZE];
+    int first = FAT_EOF;
+    int last = FAT_EOF;
+    for (uint32_t pos = 0; pos < len; pos += BLOCK_SIZE) {
+        unsigned n = std::min<uint32_t>(len - pos, BLOCK_SIZE);
+        std::memcpy(block, data + pos, n);
+        if (write_next_block(block, n, &first, &last) < 0) {
+            free_chain(first);
+            return -1;
+        }
     }
-    int8_t first_blks[count_block_needed + 1] = {FAT_EOF};
-    int free_block;
-    for (int i = 0; i < count_block_needed; i++) {
-        free_block = find_free_block();
-        if (free_block < 0)
-            return 0;
-        first_blks[i] = free_block;
-        fat[free_block] = FAT_EOF;
-        disk.write(FAT_BLOCK, (uint8_t*)fat);
-        disk.write(free_block, (uint8_t*)content.substr(i * BLOCK_SIZE, BLOCK_SIZE).c_str());
+    return add_file(dir, name, len, first);
+}
+
+// checks that a file can be created at filepath. *dir is set to the first
+// block of the directory it goes in and *name to its name. Prints why and
+// returns -1 when it can't.
+int
+FS::find_new(const work_dir &wd, const std::string &filepath, int *dir, std::string *name)
+{
+    std::string dirpath;
+    split_last(filepath, &dirpath, name);
+    std::vector<int> path;
+    std::vector<std::string> names;
+    int res = find_dir(wd, dirpath, &path, &names);
+    if (res < 0) {
+        output() << dirpath << (res == -2 ? " is not a directory\n" : " not found\n");
+        return -1;
+    }
+    if (!(dir_rights(path, names) & WRITE)) {
+        output() << "Permission denied\n";
+        return -1;
+    }
+    if (name->empty() || *name == "..") {
+        output() << filepath << " is a directory\n";
+        return -1;
+    }
+    if (name->size() > 55) {
+        output() << "File name longer then 56\n";
+        return -1;
     }
-    
-    for (int i = 0; i < count_block_needed; i++) {
-        fat[first_blks[i]] = first_blks[i + 1];
+    if (dir_find(path.back(), *name, nullptr, nullptr) == 0) {
+        output() << *name << " already exists\n";
+        return -1;
     }
-    fat[first_blks[count_block_needed-1]] = FAT_EOF;
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+    *dir = path.back();
+    return 0;
+}
 
+// adds the entry of a new file of size bytes starting at block first to
+// dir. The chain is freed if it can't be added.
+int
+FS::add_file(int dir, const std::string &name, uint32_t size, int first)
+{
     dir_entry new_file;
-    std::strncpy(new_file.file_name, filepath.c_str(), sizeof(new_file.file_name) - 1);
-    new_file.file_name[sizeof(new_file.file_name) - 1] = '\0'; // Ensure null-termination
-    new_file.size = content.size();
-    new_file.first_blk = first_blks[0];
+    std::memset(&new_file, 0, sizeof(new_file));
+    set_name(&new_file, name);
+    new_file.size = size;
+    new_file.first_blk = first;
     new_file.type = TYPE_FILE;
     new_file.access_rights = READ | WRITE;
+    if (dir_add(dir, new_file, nullptr) < 0) {
+        free_chain(first);
+        return -1;
+    }
+    return 0;
+}
+
+// allocates a block after *last in the chain starting at *first and writes
+// the first used bytes of data to it, the rest of the block is zeroed
+int
+FS::write_next_block(uint8_t *data, unsigned used, int *first, int *last)
+{
+    int block;
+    // continue the run of the previous block when possible
+    if (alloc_mode != ALLOC_SCATTERED && *last != FAT_EOF && freemap.is_free(*last + 1)) {
+        block = *last + 1;
+        freemap.take(block);
+    } else {
+        block = find_free_block();
+        if (block < 0)
+            return -1;
+    }
+    std::memset(data + used, 0, BLOCK_SIZE - used);
+    cache.write(block, data);
+    set_fat(block, FAT_EOF);
+    if (*last == FAT_EOF) {
+        *first = block;
+    } else {
+        set_fat(*last, block);
+        std::lock_guard<std::mutex> guard(chains_lock);
+        chains.append(*first, block);
+    }
+    *last = block;
+    mark_fat_dirty();
+    return 0;
+}
+
+void
+FS::redirect(std::istream *in, std::ostream *out)
+{
+    thread_input = in;
+    thread_output = out;
+}
+
+std::istream &
+FS::input()
+{
+    return thread_input ? *thread_input : std::cin;
+}
+
+std::ostream &
+FS::output()
+{
+    return thread_output ? *thread_output : std::cout;
+}
+
+// reads and drops the rows of a create that failed
+void
+FS::skip_input()
+{
+    std::string line;
+    while (std::getline(input(), line) && !line.empty())
+        ;
+}
+
+
+// cat <filepath> reads the content of a file and prints it on the screen
+int
+FS::cat(work_dir &from, std::string filepath)
+{
+    // exactly size bytes are written so binary data is kept as it is
+    std::ostream &out = output();
+    out.flush();
+    return stream(from, filepath, [this, &out](struct iovec *iov, int count) {
+        if (&out == &std::cout)
+            return write_all(STDOUT_FILENO, iov, count);
+        for (int k = 0; k < count; k++)
+            out.write((const char*)iov[k].iov_base, iov[k].iov_len);
+        return 0;
+    });
+}
 
-    for (int i = 0; i < N_DIRECTORIES; i++) {
-        if (current_direct[i].file_name[0] == '\0') {
-            current_direct[i] = new_file;
+// passes the content of a file to out, one batch of CHAIN_BATCH blocks at
+// a time. The disk reads of the next batch are in flight while out
+// handles one. out runs without fat_lock so a slow reader holds up no
+// writer: a batch is copied out of the disk mapping first, and the file is
+// looked up again before the next one.
+int
+FS::stream(work_dir &from, std::string filepath, const std::function<int(struct iovec*, int)> &out)
+{
+    chain_batch batches[2];
+    work_dir wd;
+    int first, block;
+    uint32_t unread, remaining;
+    int cur = 0;
+    {
+        RWGuard guard(fat_lock, false);
+        wd = current_dir(from);
+        dir_entry entry;
+        if (find_entry(wd, filepath, nullptr, nullptr, &entry) < 0) {
+            output() << filepath << " not found\n";
+            return 0;
+        }
+        if (entry.type != TYPE_FILE) {
+            output() << filepath << " is not a file" << std::endl;
+            return 0;
+        }
+        if (!(entry.access_rights & READ)) {
+            output() << "Permission denied\n";
+            return 0;
+        }
+        first = block = first_block(entry);
+        unread = remaining = entry.size;
+        if (start_batch(&batches[cur], &block, &unread) < 0)
+            return -1;
+    }
+
+    int res = 0;
+    while (batches[cur].count > 0) {
+        chain_batch *b = &batches[cur];
+        {
+            RWGuard guard(fat_lock, false);
+            dir_entry entry;
+            if (find_entry(wd, filepath, nullptr, nullptr, &entry) < 0 || first_block(entry) != first) {
+                output() << filepath << " was removed while it was read\n";
+                res = -1;
+                break;
+            }
+            b->in_flight = false;
+            if (cache.finish_readv(b->reads.get()) < 0 ||
+                start_batch(&batches[1 - cur], &block, &unread) < 0) {
+                res = -1;
+                break;
+            }
+            for (unsigned k = 0; k < b->count; k++) {
+                uint8_t *copy = &b->buffer[(size_t)k * BLOCK_SIZE];
+                if (b->data[k] != copy)
+                    std::memcpy(copy, b->data[k], BLOCK_SIZE);
+                b->data[k] = copy;
+            }
+        }
+        struct iovec iov[CHAIN_BATCH];
+        uint32_t len = 0;
+        for (unsigned k = 0; k < b->count; k++) {
+            iov[k].iov_base = (void*)b->data[k];
+            iov[k].iov_len = std::min<uint32_t>(remaining - len, BLOCK_SIZE);
+            len += iov[k].iov_len;
+        }
+        if (out(iov, b->count) < 0) {
+            res = -1;
             break;
-        }else if (std::strcmp(current_direct[i].file_name, source_file.c_str()) == 0) {
-            std::cout << source_file << " already exists\n";
+        }
+        remaining -= len;
+        cur = 1 - cur;
+    }
+    // reads still in flight land in the buffers of the batches
+    for (int k = 0; k < 2; k++) {
+        if (batches[k].in_flight)
+            cache.finish_readv(batches[k].reads.get());
+    }
+    return res;
+}
+
+// starts reading the next blocks of a chain, up to CHAIN_BATCH of them or
+// as many as hold unread bytes. *block and *unread move past them.
+int
+FS::start_batch(chain_batch *b, int *block, uint32_t *unread)
+{
+    b->count = 0;
+    while (*unread > 0 && *block != FAT_EOF && *block < (int)disk.get_no_blocks() && b->count < CHAIN_BATCH) {
+        b->block_nos[b->count++] = *block;
+        *block = fat[*block];
+        *unread -= std::min<uint32_t>(*unread, BLOCK_SIZE);
+    }
+    if (b->count == 0)
+        return 0;
+    if (b->buffer.empty())
+        b->buffer.resize(CHAIN_BATCH * BLOCK_SIZE);
+    b->reads.reset(new cache_readv);
+    if (cache.start_readv(b->block_nos, b->count, &b->buffer[0], b->data, b->reads.get()) < 0)
+        return -1;
+    b->in_flight = true;
+    return 0;
+}
+
+// runs call on the pool of the async calls
+std::future<int>
+FS::run_async(std::function<int()> call)
+{
+    std::shared_ptr<std::packaged_task<int()>> task = std::make_shared<std::packaged_task<int()>>(call);
+    executor.post([task] { (*task)(); });
+    return task->get_future();
+}
+
+std::future<int>
+FS::pread_async(int fh, uint32_t offset, uint32_t len, uint8_t *buf)
+{
+    return run_async([this, fh, offset, len, buf] { return pread(fh, offset, len, buf); });
+}
+
+std::future<int>
+FS::pwrite_async(int fh, uint32_t offset, uint32_t len, const uint8_t *buf)
+{
+    return run_async([this, fh, offset, len, buf] { return pwrite(fh, offset, len, buf); });
+}
+
+std::future<int>
+FS::stream_async(work_dir &from, std::string filepath, std::function<int(struct iovec*, int)> out)
+{
+    work_dir *wd = &from;
+    return run_async([this, wd, filepath, out] { return stream(*wd, filepath, out); });
+}
+
+// writes all of iov to fd, continuing after short writes
+int
+FS::write_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// prints entries to os the way ls does, in one piece so listings of
+// threads don't mix
+static void
+print_entries(const std::vector<dir_entry> &entries, std::ostream &os)
+{
+    std::ostringstream out;
+    out << "name        type       accessrights     size\n";
+    out << "______________________________________________\n";
+    for (unsigned i = 0; i < entries.size(); ++i) {
+        const dir_entry &e = entries[i];
+        int name_len = std::strlen(e.file_name);
+        out << e.file_name << std::setw(16-name_len);
+        out << (e.type == TYPE_DIR ? "dir" : "file") << "\t";
+        out << "  "
+          << ((e.access_rights & READ) ? "r" : "-")
+          << ((e.access_rights & WRITE) ? "w" : "-")
+          << ((e.access_rights & EXECUTE) ? "x" : "-") << "\t";
+
+        if (e.type == TYPE_DIR)
+            out << "         " << "-\n";
+        else
+            out << "         " << e.size << "\n";
+    }
+    os << out.str();
+}
+
+// ls lists the content in the currect directory (files and sub-directories)
+int
+FS::ls(work_dir &from)
+{
+    RWGuard guard(fat_lock, false);
+    std::vector<dir_entry> entries;
+    dir_list(current_dir(from).dirs.back(), &entries);
+    print_entries(entries, output());
+    return 0;
+}
+
+// list <dirpath> lists the entries of a directory whose names start with
+// <prefix> in name order, at most <count> of those after the name <after>
+int
+FS::list(work_dir &from, std::string dirpath, std::string prefix, std::string after, unsigned count)
+{
+    RWGuard guard(fat_lock, false);
+    std::vector<int> path;
+    std::vector<std::string> names;
+    int res = find_dir(current_dir(from), dirpath, &path, &names);
+    if (res < 0) {
+        output() << dirpath << (res == -2 ? " is not a directory\n" : " not found\n");
+        return 0;
+    }
+    std::vector<dir_entry> entries;
+    bool more = dir_range(path.back(), prefix, after, count, &entries) > 0;
+    print_entries(entries, output());
+    if (more)
+        output() << "more after " << entries.back().file_name << "\n";
+    return 0;
+}
+
+// copies the entry of a file or directory, returns -1 if there is none
+int
+FS::stat(work_dir &from, std::string path, dir_entry *entry)
+{
+    RWGuard guard(fat_lock, false);
+    int res = find_entry(current_dir(from), path, nullptr, nullptr, entry);
+    if (res < 0) {
+        output() << path << (res == -2 ? " is not a directory\n" : " not found\n");
+        return -1;
+    }
+    return 0;
+}
+
+// the entries of a directory in the order ls lists them, or -1
+int
+FS::readdir(work_dir &from, std::string dirpath, std::vector<dir_entry> *entries)
+{
+    RWGuard guard(fat_lock, false);
+    std::vector<int> path;
+    std::vector<std::string> names;
+    int res = find_dir(current_dir(from), dirpath, &path, &names);
+    if (res < 0) {
+        output() << dirpath << (res == -2 ? " is not a directory\n" : " not found\n");
+        return -1;
+    }
+    dir_list(path.back(), entries);
+    return 0;
+}
+
+// cp <sourcepath> <destpath> makes an exact copy of the file
+// <sourcepath> to a new file <destpath>
+int
+FS::cp(work_dir &from, std::string sourcepath, std::string destpath)
+{
+    op_scope scope(this, true);
+    work_dir wd = current_dir(from);
+    dir_entry entry;
+    if (find_entry(wd, sourcepath, nullptr, nullptr, &entry) < 0) {
+        output() << sourcepath << " not found\n";
+        return 0;
+    }
+    if (entry.type != TYPE_FILE) {
+        output() << sourcepath << " is not a file\n";
+        return 0;
+    }
+    if (!(entry.access_rights & READ)) {
+        output() << "Permission denied\n";
+        return 0;
+    }
+    std::vector<int> path;
+    std::string name;
+    if (find_target(wd, destpath, entry.file_name, &path, &name) < 0)
+        return 0;
+
+    // the copy gets its own blocks
+    if (copy_file_blocks(&entry) < 0)
+        return 0;
+    set_name(&entry, name);
+    if (dir_add(path.back(), entry, nullptr) < 0)
+        free_chain(first_block(entry));
+    return 0;
+}
+
+// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
+// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+int
+FS::mv(work_dir &from, std::string sourcepath, std::string destpath)
+{
+    op_scope scope(this, true);
+    work_dir wd = current_dir(from);
+    int dir;
+    dir_slot slot;
+    dir_entry entry;
+    if (find_entry(wd, sourcepath, &dir, &slot, &entry) < 0) {
+        output() << sourcepath << " not found\n";
+        return 0;
+    }
+    std::vector<int> path;
+    std::string name;
+    if (find_target(wd, destpath, entry.file_name, &path, &name) < 0)
+        return 0;
+    if (entry.type == TYPE_DIR) {
+        if (std::find(path.begin(), path.end(), (int)entry.first_blk) != path.end()) {
+            output() << "Cannot move " << sourcepath << " into itself\n";
+            return 0;
+        }
+        if (dir_in_use(entry.first_blk)) {
+            output() << sourcepath << " is in use\n";
             return 0;
         }
     }
 
-    if (CWD == "/") {
-        disk.write(ROOT_BLOCK, (uint8_t*)current_direct);
-    }else{
-        disk.write(parent_index[current_index], (uint8_t*)current_direct);
+    // the new entry is added first, a failure leaves the old one as it
+    // was. Adding may move the entries of dir, the old one is found again.
+    dir_entry moved = entry;
+    set_name(&moved, name);
+    if (dir_add(path.back(), moved, nullptr) < 0)
+        return 0;
+    if (dir_find(dir, entry.file_name, &slot, nullptr) == 0)
+        dir_remove(slot);
+    return 0;
+}
+
+// rm <filepath> removes / deletes the file <filepath>, a directory only
+// when it is empty
+int
+FS::rm(work_dir &from, std::string filepath)
+{
+    op_scope scope(this, true);
+    work_dir wd = current_dir(from);
+    dir_slot slot;
+    dir_entry entry;
+    if (find_entry(wd, filepath, nullptr, &slot, &entry) < 0) {
+        output() << filepath << " not found\n";
+        return 0;
+    }
+    if (entry.type == TYPE_DIR) {
+        if (dir_in_use(entry.first_blk)) {
+            output() << filepath << " is in use\n";
+            return 0;
+        }
+        std::vector<dir_entry> entries;
+        dir_list(entry.first_blk, &entries);
+        if (!entries.empty()) {
+            output() << filepath << " is not empty\n";
+            return 0;
+        }
+    }
+
+    free_chain(first_block(entry));
+    dir_remove(slot);
+    return 0;
+}
+
+// append <filepath1> <filepath2> appends the contents of file <filepath1> to
+// the end of file <filepath2>. The file <filepath1> is unchanged.
+int
+FS::append(work_dir &from, std::string filepath1, std::string filepath2)
+{
+    op_scope scope(this, true);
+    work_dir wd = current_dir(from);
+    dir_slot src_slot, dest_slot;
+    dir_entry src, dest;
+    if (find_entry(wd, filepath1, nullptr, &src_slot, &src) < 0) {
+        output() << filepath1 << " not found\n";
+        return 0;
+    }
+    if (find_entry(wd, filepath2, nullptr, &dest_slot, &dest) < 0) {
+        output() << filepath2 << " not found\n";
+        return 0;
+    }
+    if (src.type != TYPE_FILE) {
+        output() << filepath1 << " is not a file\n";
+        return 0;
+    }
+    if (dest.type != TYPE_FILE) {
+        output() << filepath2 << " is not a file\n";
+        return 0;
+    }
+    if (!(src.access_rights & READ) || !(dest.access_rights & WRITE)) {
+        output() << "Permission denied\n";
+        return 0;
+    }
+    // a file is not appended to itself
+    if (src_slot.block == dest_slot.block && src_slot.index == dest_slot.index)
+        return 0;
+
+    if (append_data(&dest, &src) < 0)
+        return 0;
+    dir_set(dest_slot, dest);
+    return 0;
+}
+
+// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
+// in the current directory
+int
+FS::mkdir(work_dir &from, std::string dirpath, int format)
+{
+    op_scope scope(this, true);
+    std::string parent, name;
+    split_last(dirpath, &parent, &name);
+    std::vector<int> path;
+    std::vector<std::string> names;
+    int res = find_dir(current_dir(from), parent, &path, &names);
+    if (res < 0) {
+        output() << parent << (res == -2 ? " is not a directory\n" : " not found\n");
+        return 0;
+    }
+    if (name.size() > 55) {
+        output() << "Directory name longer then 55 char\n";
+        return 0;
+    }
+    if (name.empty() || name == ".." || dir_find(path.back(), name, nullptr, nullptr) == 0) {
+        output() << (name.empty() ? dirpath : name) << " already exists\n";
+        return 0;
+    }
+    if (!(dir_rights(path, names) & WRITE)) {
+        output() << "Permission denied\n";
+        return 0;
     }
 
+    int block = find_free_block();
+    if (block < 0)
+        return 0;
+    set_fat(block, FAT_EOF);
+    mark_fat_dirty();
+
+    // create a new directory with no files
+    dir_entry new_direct[N_DIRECTORIES];
+    if (format == DIR_BTREE)
+        dir_tree_init(new_direct, true);
+    else
+        std::memset(new_direct, 0, sizeof(new_direct));
+    write_dir(block, new_direct);
+
+    dir_entry folder;
+    std::memset(&folder, 0, sizeof(folder));
+    set_name(&folder, name);
+    folder.size = 0;
+    folder.first_blk = block;
+    folder.type = TYPE_DIR;
+    folder.access_rights = READ | WRITE | EXECUTE;
+    if (dir_add(path.back(), folder, nullptr) < 0)
+        free_chain(block);
     return 0;
 }
 
-
-// cat <filepath> reads the content of a file and prints it on the screen
+// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+int
+FS::cd(work_dir &from, std::string dirpath)
+{
+    RWGuard guard(fat_lock, false);
+    std::vector<int> path;
+    std::vector<std::string> names;
+    int res = find_dir(current_dir(from), dirpath, &path, &names);
+    if (res < 0) {
+        if (res == -2)
+            output() << dirpath << " is not a directory\n";
+        else
+            output() << dirpath << " not found\n";
+        return 0;
+    }
+    std::lock_guard<std::mutex> sessions_guard(sessions_lock);
+    from.dirs = path;
+    from.path = "";
+    for (unsigned k = 0; k < names.size(); k++)
+        from.path += '/' + names[k];
+    if (from.path.empty())
+        from.path = "/";
+    return 0;
+}
+
+// pwd prints the full path, i.e., from the root directory, to the current
+// directory, including the currect directory name
+int
+FS::pwd(work_dir &from)
+{
+    std::string path = current_dir(from).path;
+    if (path == "") {
+        output() << '/' << "\n";
+        return 0;
+    }
+    output() << path << "\n";
+    return 0;
+}
+
+// a copy of the current directory of a session, an operation resolves its
+// paths from it
+work_dir
+FS::current_dir(const work_dir &from)
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    return from;
+}
+
+// sessions start in the root directory
+void
+FS::attach(work_dir *wd)
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    wd->path = "/";
+    wd->dirs.assign(1, ROOT_BLOCK);
+    sessions.insert(wd);
+}
+
+void
+FS::detach(work_dir *wd)
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    sessions.erase(wd);
+}
+
+// a new file system has nothing but the root directory to be in
+void
+FS::reset_sessions()
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    for (std::set<work_dir*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        (*it)->path = "/";
+        (*it)->dirs.assign(1, ROOT_BLOCK);
+    }
+}
+
+// true if a session is in the directory or in one below it
+bool
+FS::dir_in_use(int dir)
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    for (std::set<work_dir*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        const std::vector<int> &dirs = (*it)->dirs;
+        if (std::find(dirs.begin(), dirs.end(), dir) != dirs.end())
+            return true;
+    }
+    return false;
+}
+
+// chmod <accessrights> <filepath> changes the access rights for the
+// file <filepath> to <accessrights>.
 int
-FS::cat(std::string filepath)
+FS::chmod(work_dir &from, std::string accessrights, std::string filepath)
 {
-    int8_t file_index = find_file(filepath, current_direct);
-    if (file_index < 0) {
-        std::cout << filepath << " not found\n";
+    op_scope scope(this, false);
+    int dir;
+    dir_slot slot;
+    dir_entry entry;
+    if (find_entry(current_dir(from), filepath, &dir, &slot, &entry) < 0) {
+        output() << filepath << " not found\n";
         return 0;
     }
-
-    if (current_direct[file_index].type != TYPE_FILE){
-        std::cout << filepath << " is not a file" << std::endl;
-        return 0;
-    }
-
-    int8_t right = static_cast<int>(current_direct[file_index].access_rights);
-    if (right == 1 || right == 2 || right == 3) {
-        std::cout << "Permission denied\n";
+    // the digit is READ | WRITE | EXECUTE
+    char *end;
+    long rights = std::strtol(accessrights.c_str(), &end, 10);
+    if (accessrights.empty() || *end != '\0' || rights < 0 || rights > 7) {
+        output() << accessrights << " is not a valid access right\n";
         return 0;
     }
+    // the entry is changed in place, other entries of the block may change
+    // at the same time
+    std::lock_guard<std::mutex> guard(dir_lock(dir));
+    dir_entry buf[N_DIRECTORIES];
+    entry = peek_dir(slot.block, buf)[slot.index];
+    entry.access_rights = rights;
+    dir_set(slot, entry);
+    return 0;
+}
 
 
-    int block = current_direct[file_index].first_blk;
-    while (block != FAT_EOF) {
-        uint8_t buffer[BLOCK_SIZE+1];
-        disk.read(block, buffer);
-        buffer[BLOCK_SIZE] = '\0';  // Ensure null-termination
-        std::cout << (char*)buffer;
+// copies the blocks of the chain starting at block to newly allocated
+// blocks, *first is set to the first block of the copy
+int
+FS::copy_chain(int block, int *first)
+{
+    std::vector<unsigned> src;
+    while (block != FAT_EOF && block < (int)disk.get_no_blocks()) {
+        src.push_back(block);
         block = fat[block];
     }
+    *first = FAT_EOF;
+    if (src.empty())
+        return 0;
+    std::vector<unsigned> dst(src.size());
+    if (alloc_blocks(src.size(), &dst[0]) < 0)
+        return -1;
+    uint8_t data[BLOCK_SIZE];
+    for (unsigned i = 0; i < src.size(); i++) {
+        set_fat(dst[i], i + 1 < dst.size() ? dst[i + 1] : FAT_EOF);
+        cache.read(src[i], data);
+        cache.write(dst[i], data);
+    }
+    mark_fat_dirty();
+    *first = dst[0];
     return 0;
 }
 
-// ls lists the content in the currect directory (files and sub-directories)
+// gives a file its own copy of the blocks it points at
 int
-FS::ls()
+FS::copy_file_blocks(dir_entry *entry)
 {
-    std::cout << "name        type       accessrights     size\n";
-    std::cout << "______________________________________________\n";
-    for (unsigned i = 0; i < N_DIRECTORIES; ++i) {
-        if (current_direct[i].file_name[0] != '\0') { // Check if entry is valid
-            int name_len = std::strlen(current_direct[i].file_name);
-            std::cout << current_direct[i].file_name << std::setw(16-name_len);
-            std::cout << (current_direct[i].type == TYPE_DIR ? "dir" : "file") << "\t";
-            std::cout << "  "
-                      << ((current_direct[i].access_rights & READ) ? "r" : "-")
-                      << ((current_direct[i].access_rights & WRITE) ? "w" : "-")
-                      << ((current_direct[i].access_rights & EXECUTE) ? "x" : "-") << "\t";
-            
-            if (current_direct[i].type == TYPE_DIR)
-                std::cout << "         " << "-\n";
-            else
-                std::cout << "         " << current_direct[i].size << "\n";
-        }
-    }
+    if (entry->type != TYPE_FILE)
+        return 0;
+    int first;
+    if (copy_chain(first_block(*entry), &first) < 0)
+        return -1;
+    entry->first_blk = first;
     return 0;
 }
 
-// cp <sourcepath> <destpath> makes an exact copy of the file
-// <sourcepath> to a new file <destpath>
+// appends the content of src to the end of entry. The bytes go into the
+// free part of the last block of entry first, so the file stays packed.
 int
-FS::cp(std::string sourcepath, std::string destpath)
-{
-    dir_entry temp_dir[N_DIRECTORIES];
-    std::memcpy(temp_dir, current_direct, sizeof(current_direct));
-    int8_t temp_index = current_index;
-
-    int i = sourcepath.size() - 1; 
-    while (sourcepath[i] != '/' && i > 0) {
-        i--;
-    }
-    std::string source_file;
-    dir_entry source_file_copy;
-    int8_t source_file_index;
-    source_file_index = -1;
-    if (i == 0) {
-        if (sourcepath[0] == '/') {
-            source_file = sourcepath.substr(1, sourcepath.size() - 1);
-            sourcepath = "/";
-        }else{
-            source_file = sourcepath;
-            source_file_index = find_file(sourcepath, current_direct);
-            source_file_copy = current_direct[source_file_index];
-        }
-    }else{
-        source_file = sourcepath.substr(i + 1, sourcepath.size() - i);
-        sourcepath = sourcepath.substr(0, i);
-    }
-
-    int8_t dest_file_index;
-    dest_file_index = -2;
-    int8_t j = destpath.size() - 1; 
-    while (destpath[j] != '/' && j > 0) {
-        j--;
-    }
-    std::string dest_file;
-    dest_file = "";
-    dir_entry dest_direct[N_DIRECTORIES];
-    int8_t dest_dir_index = parent_index[current_index];
-    if (j == 0) {
-        if (destpath[0] == '/') {
-            // dest_file = destpath.substr(1, destpath.size() - 1);
-            // destpath = "/";
-        }else{
-            dest_file = source_file;
-            dest_file_index = find_file(destpath, current_direct);
-            if (dest_file_index >= 0) {
-                if (current_direct[dest_file_index].type == TYPE_DIR){
-                    dest_file_index = -2;
-                }else{
-                    std::cout << destpath << " already exists\n";
-                    return 0;
-                }
-            }
-            std::memcpy(dest_direct, current_direct, sizeof(current_direct));
-        }
-    }else{
-        dest_file = destpath.substr(j + 1, destpath.size() - j);
-        destpath = destpath.substr(0, j);
-    }
-
-    // check if the source file and destination file is in the same directory
-    if (source_file_index >= 0 && dest_file_index >= 0){
-        for (int i = 0; i < N_DIRECTORIES; i++) {
-            if (current_direct[i].file_name[0] == '\0') {
-                current_direct[i] = source_file_copy;
-                std::strncpy(current_direct[i].file_name, dest_file.c_str(), sizeof(current_direct[i].file_name) - 1);
-                current_direct[i].file_name[sizeof(current_direct[i].file_name) - 1] = '\0'; // Ensure null-termination
-                disk.write(parent_index[current_index], (uint8_t*)current_direct);
-                return 0;
-            }
-        }
+FS::append_data(dir_entry *entry, const dir_entry *src)
+{
+    if ((uint64_t)entry->size + src->size > UINT32_MAX) {
+        output() << "File too large\n";
+        return -1;
     }
-
-    std::string tempcwd = CWD;
-    int8_t temp_parent_index[64];
-    std::memcpy(temp_parent_index, parent_index, sizeof(parent_index));
-
-    int8_t res;
-    if (source_file_index < 0) {
-        res = set_current_to(sourcepath);
-        if (res < 0) {
-            return 0;
-        }
-        source_file_index = find_file(source_file, current_direct);
-        if (source_file_index < 0) {
-            std::cout << source_file << " not found\n";
-            return 0;
-        }
-        source_file_copy = current_direct[source_file_index];
-    }
-    // if we found source file
-    if (source_file_index >= 0 && dest_file_index >= 0){
-        for (int i = 0; i < N_DIRECTORIES; i++) {
-            if (dest_direct[i].file_name[0] == '\0') {
-                dest_direct[i] = source_file_copy;
-                std::strncpy(dest_direct[i].file_name, dest_file.c_str(), sizeof(dest_direct[i].file_name) - 1);
-                dest_direct[i].file_name[sizeof(dest_direct[i].file_name) - 1] = '\0'; // Ensure null-termination
-                disk.write(dest_dir_index, (uint8_t*)dest_direct);
-                
-                CWD = tempcwd;
-                current_index = temp_index;
-                disk.read(parent_index[current_index], (uint8_t*)current_direct);
-                return 0;
-            }
-        }
+    int first = first_block(*entry);
+    int last = FAT_EOF;
+    if (first != FAT_EOF && first < (int)disk.get_no_blocks()) {
+        last = tail_block(first);
+    } else {
+        first = FAT_EOF;
     }
-
-    current_index = temp_index;   // restore current index for destination
-    std::memcpy(current_direct, temp_dir, sizeof(current_direct));
-    res = set_current_to(destpath);
-    if (res < 0) {
-        for (int i = 0; i < N_DIRECTORIES; i++) {
-            if (current_direct[i].file_name[0] == '\0') {
-                current_direct[i] = source_file_copy;
-                std::strncpy(current_direct[source_file_index].file_name, destpath.c_str(), sizeof(current_direct[source_file_index].file_name) - 1);
-                current_direct[source_file_index].file_name[sizeof(current_direct[source_file_index].file_name) - 1] = '\0'; // Ensure null-termination
-                disk.write(parent_index[current_index], (uint8_t*)current_direct);
-                CWD = tempcwd;
-                current_index = temp_index;
-                disk.read(parent_index[current_index], (uint8_t*)current_direct);
-                return 0;
+    // a full disk leaves the chain as it was
+    int old_last = last;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t src_block[BLOCK_SIZE];
+    unsigned used = entry->size % BLOCK_SIZE;
+    // the last block has room left, it is filled up and rewritten in place
+    bool tail_open = used > 0 && last != FAT_EOF;
+    if (tail_open)
+        cache.read(last, block);
+    else
+        used = 0;
+
+    int src_blk = first_block(*src);
+    uint32_t remaining = src->size;
+    while (remaining > 0 && src_blk != FAT_EOF && src_blk < (int)disk.get_no_blocks()) {
+        cache.read(src_blk, src_block);
+        unsigned avail = std::min<uint32_t>(remaining, BLOCK_SIZE);
+        for (unsigned pos = 0; pos < avail; ) {
+            unsigned n = std::min(avail - pos, BLOCK_SIZE - used);
+            std::memcpy(block + used, src_block + pos, n);
+            used += n;
+            pos += n;
+            if (used < BLOCK_SIZE)
+                continue;
+            if (tail_open) {
+                cache.write(last, block);
+                tail_open = false;
+            } else if (write_next_block(block, used, &first, &last) < 0) {
+                cut_chain(first, old_last);
+                return -1;
             }
+            used = 0;
         }
+        remaining -= avail;
+        src_blk = fat[src_blk];
     }
-    j = destpath.find_last_of('/');
-    dest_file = destpath.substr(j + 1, destpath.size() - j);
-    dest_file_index = find_file(dest_file, current_direct);
-    if (dest_file_index >= 0 && current_direct[dest_file_index].type == TYPE_FILE) {
-        std::cout << dest_file_index << " already exists\n";
-        return 0;
-    }
-
-    for (int i = 0; i < N_DIRECTORIES; i++) {
-        if (current_direct[i].file_name[0] == '\0') {
-            current_direct[i] = source_file_copy;
-            disk.write(parent_index[current_index], (uint8_t*)current_direct);
-            break;
+    if (used > 0) {
+        if (tail_open) {
+            std::memset(block + used, 0, BLOCK_SIZE - used);
+            cache.write(last, block);
+        } else if (write_next_block(block, used, &first, &last) < 0) {
+            cut_chain(first, old_last);
+            return -1;
         }
     }
-
-    CWD = tempcwd;
-    current_index = temp_index;
-    std::memcpy(parent_index, temp_parent_index, sizeof(parent_index));
-    disk.read(parent_index[current_index], (uint8_t*)current_direct);
+    entry->first_blk = first;
+    entry->size += src->size - remaining;
     return 0;
 }
 
-// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
-// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+// returns the last block of the chain starting at first. A first block
+// out of range has no chain in the index and is returned as it is, like
+// the walk does.
 int
-FS::mv(std::string sourcepath, std::string destpath)
-{   
-    dir_entry temp_dir[N_DIRECTORIES];
-    std::memcpy(temp_dir, current_direct, sizeof(current_direct));
-    int8_t temp_index = current_index;
-
-    int i = sourcepath.size() - 1; 
-    while (sourcepath[i] != '/' && i > 0) {
-        i--;
-    }
-    std::string source_file;
-    dir_entry source_file_copy;
-    int8_t source_file_index;
-    source_file_index = -1;
-    if (i == 0) {
-        if (sourcepath[0] == '/') {
-            source_file = sourcepath.substr(1, sourcepath.size() - 1);
-            sourcepath = "/";
-        }else{
-            source_file = sourcepath;
-            source_file_index = find_file(sourcepath, current_direct);
-            if (source_file_index <0) {
-                std::cout << source_file << " not found\n";
-                return 0;
-            }
-        
-            source_file_copy = current_direct[source_file_index];
-        }
-    }else{
-        source_file = sourcepath.substr(i + 1, sourcepath.size() - i);
-        sourcepath = sourcepath.substr(0, i);
+FS::tail_block(int first)
+{
+    if (use_chain_index) {
+        std::lock_guard<std::mutex> guard(chains_lock);
+        const std::vector<int> &blocks = chains.get(first, &fat[0], disk.get_no_blocks());
+        return blocks.empty() ? first : blocks.back();
     }
+    int last = first;
+    while (fat[last] != FAT_EOF)
+        last = fat[last];
+    return last;
+}
 
-    std::string tempcwd = CWD;
-    int8_t temp_parent_index[64];
-    std::memcpy(temp_parent_index, parent_index, sizeof(parent_index));
-
-    int8_t res;
-    if (source_file_index < 0) {
-        res = set_current_to(sourcepath);
-        if (res < 0) {
-            return 0;
-        }
-        source_file_index = find_file(source_file, current_direct);
-        if (source_file_index < 0) {
-            std::cout << source_file << " not found\n";
-            return 0;
-        }
-        source_file_copy = current_direct[source_file_index];
+// ends the chain starting at first at block last and frees the blocks
+// after it, all of them if last is FAT_EOF
+void
+FS::cut_chain(int first, int last)
+{
+    if (last == FAT_EOF) {
+        if (first != FAT_EOF)
+            free_chain(first);
+        return;
     }
+    if (fat[last] == FAT_EOF)
+        return;
+    free_chain(fat[last]);
+    set_fat(last, FAT_EOF);
+    std::lock_guard<std::mutex> guard(chains_lock);
+    chains.drop(first);
+}
 
-    dir_entry source_direct[N_DIRECTORIES];
-    std::memcpy(source_direct, current_direct, sizeof(current_direct));
-    int source_parent_index = parent_index[current_index];
+// use an index of recently used chains for seeks and appends
+void
+FS::set_chain_index(bool enabled)
+{
+    RWGuard guard(fat_lock, true);
+    use_chain_index = enabled;
+    std::lock_guard<std::mutex> chains_guard(chains_lock);
+    chains.clear();
+}
 
-    current_index = temp_index;   // restore current index for destination
-    std::memcpy(current_direct, temp_dir, sizeof(current_direct));
-    std::memcpy(parent_index, temp_parent_index, sizeof(parent_index));
+// prefetch the blocks ahead of sequential reads
+void
+FS::set_read_ahead(bool enabled)
+{
+    RWGuard guard(fat_lock, true);
+    use_read_ahead = enabled;
+    std::lock_guard<std::mutex> ra_guard(readahead_lock);
+    readahead.clear();
+}
 
-    // destpath
-    
-    i = destpath.find_last_of('/');
-    std::string dest_file;
-    if (i >= 0){
-        if (destpath[0] != '/') {
-            dest_file = destpath.substr(i + 1, destpath.size() - i);
-            destpath = destpath.substr(0, i);
-        }
-    }else{
-        dest_file = destpath;
+// returns all blocks of the chain starting at block to the free map
+void
+FS::free_chain(int block)
+{
+    {
+        std::lock_guard<std::mutex> guard(chains_lock);
+        chains.drop(block);
     }
-
-    if (dest_file != "") {
-        int8_t dest_file_index = find_file(dest_file, current_direct);
-        if (dest_file_index >= 0) {
-            if (current_direct[dest_file_index].type == TYPE_FILE) {
-                std::cout << dest_file << " already exists\n";
-                return 0;
-            }
+    while (block != FAT_EOF && block < (int)disk.get_no_blocks()) {
+        int next = fat[block];
+        // the block may have held a directory
+        {
+            std::lock_guard<std::mutex> guard(dirs_lock);
+            dirs.drop(block);
         }
+        {
+            std::lock_guard<std::mutex> guard(paths_lock);
+            paths.drop(block);
+        }
+        set_fat(block, FAT_FREE);
+        // reused once the transaction is committed. A replay must not
+        // write over what the block holds by then, so it leaves the open
+        // transaction and an earlier one forces a checkpoint.
+        txn_freed.push_back(block);
+        {
+            std::lock_guard<std::mutex> guard(txn_lock);
+            txn_blocks.erase(block);
+        }
+        if (journal.holds(block))
+            checkpoint_needed = true;
+        block = next;
     }
+    mark_fat_dirty();
+}
 
-    if (destpath != "") {
-        res = set_current_to(destpath);
-        if (res < 0) {
-            std::strncpy(current_direct[source_file_index].file_name, dest_file.c_str(), sizeof(current_direct[source_file_index].file_name) - 1);
-            current_direct[source_file_index].file_name[sizeof(current_direct[source_file_index].file_name) - 1] = '\0'; // Ensure null-termination
-            disk.write(parent_index[current_index], (uint8_t*)current_direct);
-            CWD = tempcwd;
-            current_index = temp_index;
-            disk.read(parent_index[current_index], (uint8_t*)current_direct);
+// takes count free blocks for a new chain. They are one contiguous run
+// when the allocation mode asks for it and such a run exists, otherwise
+// they are picked one at a time.
+int
+FS::alloc_blocks(unsigned count, unsigned *blocks)
+{
+    if (count == 0)
+        return 0;
+    if (alloc_mode != ALLOC_SCATTERED && count > 1) {
+        int start = freemap.alloc_run(count, alloc_mode == ALLOC_BEST_FIT);
+        if (start >= 0) {
+            for (unsigned i = 0; i < count; i++)
+                blocks[i] = start + i;
             return 0;
-        }else{
-            for (int i = 0; i < N_DIRECTORIES; i++) {
-                if (current_direct[i].file_name[0] == '\0') {
-                    current_direct[i] = source_file_copy;
-                    disk.write(parent_index[current_index], (uint8_t*)current_direct);
-                    break;
-                }else if (std::strcmp(current_direct[i].file_name, dest_file.c_str()) == 0 && current_direct[i].type == TYPE_FILE) {
-                    std::cout << dest_file << " already exists\n";
-                    return 0;
-                }
-            }
-
         }
     }
-
-
-    std::memset(&source_direct[source_file_index], 0, sizeof(dir_entry));
-    disk.write(source_parent_index, (uint8_t*)source_direct);
-
-    CWD = tempcwd;
-    current_index = temp_index;
-    std::memcpy(parent_index, temp_parent_index, sizeof(parent_index));
-    disk.read(parent_index[current_index], (uint8_t*)current_direct);
+    for (unsigned i = 0; i < count; i++) {
+        int block = find_free_block();
+        if (block < 0) {
+            // give back what was taken so far
+            for (unsigned k = 0; k < i; k++)
+                freemap.release(blocks[k]);
+            return -1;
+        }
+        blocks[i] = block;
+    }
     return 0;
 }
 
+// how blocks for new chains are picked, see ALLOC_*
+void
+FS::set_alloc_mode(int mode)
+{
+    RWGuard guard(fat_lock, true);
+    alloc_mode = mode;
+}
+
+// find a free block in the FAT and take it from the free map
 int
-FS::rm(std::string filepath)
+FS::find_free_block()
 {
-    int8_t file_index = find_file(filepath, current_direct);
-    if (file_index < 0) {
-        std::cout << filepath << " not found\n";
-        return 0;
+    int block = freemap.alloc();
+    if (block < 0) {
+        output() << "No free blocks available\n";
+        return -1;
     }
+    return block;
+}
 
-    // int8_t count = 0;
-    // if (current_direct[file_index].type != TYPE_FILE){
-    //     for (int i = 0; i < N_DIRECTORIES; i++) {
-    //         if (current_direct[i].file_name[0] == '\0') {
-    //             break;
-    //         }
-    //         count += 1;
-    //     }
-    // }
+// writes a directory block and keeps its hash index up to date. Cached
+// paths that looked at a slot which changes are dropped, the names in it
+// before and after both count.
+int
+FS::write_dir(unsigned block, const dir_entry *dir)
+{
+    bool watched;
+    {
+        std::lock_guard<std::mutex> guard(paths_lock);
+        watched = paths.watches(block);
+    }
+    if (watched) {
+        dir_entry old[N_DIRECTORIES];
+        peek_dir(block, old);
+        std::lock_guard<std::mutex> guard(paths_lock);
+        for (unsigned i = 0; i < N_DIRECTORIES; i++) {
+            if (std::strcmp(old[i].file_name, dir[i].file_name) == 0 &&
+                old[i].first_blk == dir[i].first_blk && old[i].type == dir[i].type)
+                continue;
+            paths.invalidate(block, old[i].file_name);
+            paths.invalidate(block, dir[i].file_name);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(dirs_lock);
+        dirs.update(block, dir);
+    }
+    return write_meta(block, (uint8_t*)dir);
+}
 
-    // if (count > 0){
-    //     std::cout << filepath << " is not empty\n";
-    //     return 0;
-    // }
+// find a file in dir, the contents of directory block block, with a
+// single probe of the directory's hash index
+int
+FS::find_file(std::string filepath, const dir_entry *entry, int block)
+{
+    // an empty name finds the first free slot, only the scan does that
+    if (filepath.empty() || block < 0)
+        return find_file(filepath, entry);
+    std::lock_guard<std::mutex> guard(dirs_lock);
+    return dirs.find(block, entry, filepath.c_str());
+}
 
-    int block = current_direct[file_index].first_blk;
-    while (block != FAT_EOF) {
-        block = fat[block];
-        fat[block] = FAT_FREE;
+// finds a file among the entries of one directory block by scanning
+// them, returns its slot or -1
+int
+FS::find_file(std::string filepath, const dir_entry *entry)
+{
+    for (unsigned base = 0; base < N_DIRECTORIES; base += DIR_SCAN_SLOTS) {
+        uint64_t match, empty;
+        dir_scan(entry + base, N_DIRECTORIES - base, filepath.c_str(), &match, &empty);
+        // candidates share the leading bytes, the rest of the name decides
+        while (match != 0) {
+            int i = __builtin_ctzll(match);
+            if (std::strcmp(entry[base + i].file_name, filepath.c_str()) == 0)
+                return base + i;
+            match &= match - 1;
+        }
     }
-
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    std::memset(&current_direct[file_index], 0, sizeof(dir_entry));
-    disk.write(parent_index[current_index], (uint8_t*)current_direct);
-    return 0;
+    return -1;
 }
 
-// append <filepath1> <filepath2> appends the contents of file <filepath1> to
-// the end of file <filepath2>. The file <filepath1> is unchanged.
+// returns the first unused slot of dir, -1 if it is full
 int
-FS::append(std::string filepath1, std::string filepath2)
+FS::free_slot(const dir_entry *dir)
 {
-    if (filepath1 == filepath2) {
-        return 0;
+    for (unsigned base = 0; base < N_DIRECTORIES; base += DIR_SCAN_SLOTS) {
+        uint64_t match, empty;
+        dir_scan(dir + base, N_DIRECTORIES - base, "", &match, &empty);
+        if (empty != 0)
+            return base + __builtin_ctzll(empty);
     }
+    return -1;
+}
 
-    dir_entry temp_dir[N_DIRECTORIES];
-    std::memcpy(temp_dir, current_direct, sizeof(current_direct));
-    int8_t temp_index = current_index;
+// returns the directory stored in block, read into buf. A pointer into
+// the cache could be evicted by another thread before it is used.
+const dir_entry *
+FS::peek_dir(unsigned block, dir_entry *buf)
+{
+    cache.read(block, (uint8_t*)buf);
+    return buf;
+}
 
-    int i = filepath1.size() - 1; 
-    while (filepath1[i] != '/' && i > 0) {
-        i--;
+// resolves parts one at a time from the directory starting at block start,
+// see path_entry
+void
+FS::walk(int start, const std::vector<std::string> &parts, path_entry *e)
+{
+    dir_entry buf[N_DIRECTORIES];
+    e->dirs.assign(1, start);
+    e->blocks.clear();
+    e->names.clear();
+    e->index = -1;
+    e->first_blk = FAT_EOF;
+    e->type = TYPE_FILE;
+    for (unsigned k = 0; k < parts.size(); k++) {
+        int block = dir_bucket(e->dirs.back(), parts[k].c_str());
+        const dir_entry *dir = peek_dir(block, buf);
+        e->blocks.push_back(block);
+        e->names.push_back(parts[k]);
+        e->index = find_file(parts[k], dir, block);
+        if (e->index < 0)
+            return;
+        e->first_blk = dir[e->index].first_blk;
+        e->type = dir[e->index].type;
+        if (k + 1 == parts.size() || e->type != TYPE_DIR)
+            return;
+        e->dirs.push_back(e->first_blk);
     }
-    std::string source_file;
-    dir_entry source_file_copy;
-    source_file_copy.file_name[0] = '\0';
-    int8_t source_file_index;
-    if (i == 0) {
-        if (filepath1[0] == '/') {
-            source_file = filepath1.substr(1, filepath1.size() - 1);
-            filepath1 = "/";
-        }else{
-            source_file = filepath1;
-            source_file_index = find_file(filepath1, current_direct);
-            source_file_copy = current_direct[source_file_index];
+}
+
+// resolves parts from the directory starting at block start into e, with
+// one hash lookup when the path was resolved before
+void
+FS::resolve(int start, const std::vector<std::string> &parts, path_entry *e)
+{
+    std::string key = std::to_string(start);
+    for (unsigned k = 0; k < parts.size(); k++)
+        key += '/' + parts[k];
+    {
+        std::lock_guard<std::mutex> guard(paths_lock);
+        const path_entry *cached = paths.get(key);
+        if (cached != nullptr) {
+            *e = *cached;
+            return;
         }
-    }else{
-        source_file = filepath1.substr(i + 1, filepath1.size() - i);
-        filepath1 = filepath1.substr(0, i);
     }
+    walk(start, parts, e);
+    std::lock_guard<std::mutex> guard(paths_lock);
+    paths.put(key, *e);
+}
 
-    int8_t dest_file_index = -1;
-    int8_t j = filepath2.size() - 1; 
-    while (filepath2[j] != '/' && j > 0) {
-        j--;
-    }
-    std::string dest_file;
-    if (j == 0) {
-        if (filepath2[0] == '/') {
-            dest_file = filepath2.substr(1, filepath2.size() - 1);
-            filepath2 = "/";
-        }else{
-            dest_file_index = find_file(filepath2, current_direct);
+// follows parts from the directory dirs->back(), appending the directories
+// it enters to dirs and their names to names. ".." goes back up but not
+// past the first directory. Returns -1 if a component is missing, -2 if one
+// is not a directory.
+int
+FS::resolve_dirs(const std::vector<std::string> &parts, std::vector<int> *dirs,
+                 std::vector<std::string> *names)
+{
+    unsigned k = 0;
+    while (k < parts.size()) {
+        if (parts[k] == "..") {
+            if (dirs->size() > 1) {
+                dirs->pop_back();
+                names->pop_back();
+            }
+            k++;
+            continue;
         }
-    }else{
-        dest_file = filepath2.substr(j + 1, filepath2.size() - j);
-        filepath2 = filepath2.substr(0, j);
+        // the names up to the next ".." go through the path cache together
+        std::vector<std::string> run;
+        while (k < parts.size() && parts[k] != "..")
+            run.push_back(parts[k++]);
+        path_entry e;
+        resolve(dirs->back(), run, &e);
+        if (e.index < 0)
+            return -1;
+        if (e.names.size() < run.size() || e.type != TYPE_DIR)
+            return -2;
+        dirs->insert(dirs->end(), e.dirs.begin() + 1, e.dirs.end());
+        dirs->push_back(e.first_blk);
+        names->insert(names->end(), run.begin(), run.end());
     }
+    return 0;
+}
 
-    // check if the source file and destination file is in the same directory
-    if (source_file_copy.file_name[0] != '\0' && dest_file_index >= 0){
-        int8_t right = static_cast<int>(current_direct[dest_file_index].access_rights);
-        if (right == 1 || right == 4 || right == 5) {
-            std::cout << "Permission denied\n";
-            return 0;
-        }
-        int block = current_direct[dest_file_index].first_blk;
-        while (fat[block] != FAT_EOF) {
-            block = fat[block];
-        }
-        fat[block] = source_file_copy.first_blk;
-        current_direct[dest_file_index].size += source_file_copy.size;
-        disk.write(FAT_BLOCK, (uint8_t*)fat);
-        disk.write(parent_index[current_index], (uint8_t*)current_direct);
-        return 0;
+// finds the directory dirpath names, relative to wd unless it starts with
+// '/'. dirs is set to the first blocks of the directories from the root
+// down to it and names to their names.
+int
+FS::find_dir(const work_dir &wd, const std::string &dirpath, std::vector<int> *dirs,
+             std::vector<std::string> *names)
+{
+    dirs->assign(1, ROOT_BLOCK);
+    names->clear();
+    if (dirpath.empty() || dirpath[0] != '/') {
+        *dirs = wd.dirs;
+        split_path(wd.path, names);
     }
+    std::vector<std::string> parts;
+    split_path(dirpath, &parts);
+    return resolve_dirs(parts, dirs, names);
+}
 
-    std::string tempcwd = CWD;
-    int8_t temp_parent_index[64];
-    std::memcpy(temp_parent_index, parent_index, sizeof(parent_index));
+// finds the entry filepath names. *dir is set to the first block of the
+// directory holding it and *slot to where it is stored, any of the
+// pointers may be nullptr. Returns -1 if it does not exist, -2 if a
+// component on the way is not a directory.
+int
+FS::find_entry(const work_dir &wd, const std::string &filepath, int *dir, dir_slot *slot,
+               dir_entry *entry)
+{
+    std::vector<std::string> parts;
+    bool up = split_path(filepath, &parts);
+    if (parts.empty())
+        return -1;
+
+    int d;
+    dir_slot s;
+    if (!up) {
+        path_entry e;
+        resolve(filepath[0] == '/' ? ROOT_BLOCK : wd.dirs.back(), parts, &e);
+        if (e.index < 0)
+            return -1;
+        if (e.names.size() < parts.size())
+            return -2;
+        d = e.dirs.back();
+        s.block = e.blocks.back();
+        s.index = e.index;
+    } else {
+        std::string dirpath, name;
+        split_last(filepath, &dirpath, &name);
+        std::vector<int> dirs;
+        std::vector<std::string> names;
+        int res = find_dir(wd, dirpath, &dirs, &names);
+        if (res < 0)
+            return res;
+        d = dirs.back();
+        if (name == ".." || dir_find(d, name, &s, nullptr) < 0)
+            return -1;
+    }
+    if (dir != nullptr)
+        *dir = d;
+    if (slot != nullptr)
+        *slot = s;
+    if (entry != nullptr) {
+        dir_entry buf[N_DIRECTORIES];
+        *entry = peek_dir(s.block, buf)[s.index];
+    }
+    return 0;
+}
 
-    int8_t res;
-    if (source_file_copy.file_name[0] == '\0') {
-        res = cd(filepath1);
+// picks where cp and mv put an entry called name: into destpath when it is
+// a directory, otherwise destpath is the new path of the entry. Prints why
+// and returns -1 when it can't be added there.
+int
+FS::find_target(const work_dir &wd, const std::string &destpath, const std::string &name,
+                std::vector<int> *dirs, std::string *new_name)
+{
+    std::vector<std::string> names;
+    if (find_dir(wd, destpath, dirs, &names) == 0) {
+        *new_name = name;
+    } else {
+        std::string dirpath;
+        split_last(destpath, &dirpath, new_name);
+        int res = find_dir(wd, dirpath, dirs, &names);
         if (res < 0) {
-            return 0;
-        }
-        source_file_index = find_file(source_file, current_direct);
-        if (source_file_index < 0) {
-            std::cout << source_file << " not found\n";
-            return 0;
-        }
-        source_file_copy = current_direct[source_file_index];
-    }
-    // if we found source file
-    if (source_file_copy.file_name[0] != '\0' && dest_file_index >= 0){
-        int8_t right = static_cast<int>(current_direct[dest_file_index].access_rights);
-        if (right == 1 || right == 4 || right == 5) {
-            std::cout << "Permission denied\n";
-            CWD = tempcwd;
-            current_index = temp_index;
-            disk.read(parent_index[current_index], (uint8_t*)current_direct);
-            return 0;
+            output() << dirpath << (res == -2 ? " is not a directory\n" : " not found\n");
+            return -1;
         }
-        int block = temp_dir[dest_file_index].first_blk;
-        while (fat[block] != FAT_EOF) {
-            std::cout << "block: " << block << "\n";
-            block = fat[block];
+        if (new_name->empty() || *new_name == "..") {
+            output() << destpath << " not found\n";
+            return -1;
         }
-
-        fat[block] = source_file_copy.first_blk;
-        temp_dir[dest_file_index].size += source_file_copy.size;
-        disk.write(FAT_BLOCK, (uint8_t*)fat);
-        disk.write(parent_index[temp_index], (uint8_t*)temp_dir);
-
-        std::memset(&current_direct[source_file_index], 0, sizeof(dir_entry));
-        CWD = tempcwd;
-        current_index = temp_index;
-        disk.read(parent_index[current_index], (uint8_t*)current_direct);
-        return 0;
-    }
-
-    dir_entry copy_source_dir[N_DIRECTORIES];
-    std::memcpy(copy_source_dir, current_direct, sizeof(current_direct));
-    int source_parent_index = parent_index[current_index];
-
-    current_index = temp_index;   // restore current index for destination
-    std::memcpy(current_direct, temp_dir, sizeof(current_direct));
-
-    res = cd(filepath2);
-    if (res < 0) {
-        return 0;
     }
-    dest_file_index = find_file(dest_file, current_direct);
-    if (dest_file_index < 0) {
-        std::cout << dest_file << " not found\n";
-        return 0;
+    if (new_name->size() > 55) {
+        output() << "File name longer then 56\n";
+        return -1;
     }
-    
-    int8_t right = static_cast<int>(current_direct[dest_file_index].access_rights);
-    if (right == 1 || right == 4 || right == 5) {
-        std::cout << "Permission denied\n";
-        return 0;
+    if (!(dir_rights(*dirs, names) & WRITE)) {
+        output() << "Permission denied\n";
+        return -1;
     }
-    
-    int block = current_direct[dest_file_index].first_blk;
-    while (fat[block] != FAT_EOF) {
-        block = fat[block];
+    if (dir_find(dirs->back(), *new_name, nullptr, nullptr) == 0) {
+        output() << *new_name << " already exists\n";
+        return -1;
     }
-
-    fat[block] = source_file_copy.first_blk;
-    current_direct[dest_file_index].size += source_file_copy.size;
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    disk.write(parent_index[current_index], (uint8_t*)current_direct);
-    std::memset(&copy_source_dir[source_file_index], 0, sizeof(dir_entry));
-    disk.write(source_parent_index, (uint8_t*)copy_source_dir);
-
-    CWD = tempcwd;
-    current_index = temp_index;
-    disk.read(parent_index[current_index], (uint8_t*)current_direct);
     return 0;
 }
 
-// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-// in the current directory
-int
-FS::mkdir(std::string dirpath)
-{
-    std::string tempcwd = CWD;
-    int8_t temp_parent_index[64];
-    std::memcpy(temp_parent_index, parent_index, sizeof(parent_index));
-    int8_t temp_index = current_index;
-
-    int8_t size = dirpath.size() - 1;
-    int8_t j = 0;
-    std::string dirname;
-    for (int i = 0; i < size; i++) {
-        if (dirpath[i] == '/' || i == size - 1) {
-            dirname = dirpath.substr(j, i - j);
-            if (i == size - 1) {
-                dirname = dirpath.substr(j, size - j + 1);
-            }
-            j = i + 1;
-            if(dirname.size() > 55){
-                std::cout << "Directory name longer then 55 char\n";
-                return 0;
-            }
+// the blocks of the directory starting at block dir, in chain order
+std::vector<int>
+FS::dir_blocks(int dir)
+{
+    std::lock_guard<std::mutex> guard(chains_lock);
+    return chains.get(dir, &fat[0], disk.get_no_blocks());
+}
 
-            int8_t file_index = find_file(dirname, current_direct);
-            if (file_index >= 0 || dirname == "..") {
-                set_current_to(dirname);
-            }else{
-                int free_block = find_free_block();
-                if (free_block < 0) {
-                    return 0;
-                }
+// largest power of two not above n
+static unsigned
+hash_level(unsigned n)
+{
+    unsigned level = 1;
+    while (level * 2 <= n)
+        level *= 2;
+    return level;
+}
 
-                fat[free_block] = FAT_EOF;
-                disk.write(FAT_BLOCK, (uint8_t*)fat);
-
-                dir_entry folder;
-                std::strncpy(folder.file_name, dirname.c_str(), sizeof(folder.file_name) - 1);
-                folder.file_name[sizeof(folder.file_name) - 1] = '\0'; // Ensure null-termination
-                folder.size = 0;
-                folder.first_blk = free_block;
-                folder.type = TYPE_DIR;
-                folder.access_rights = READ | WRITE | EXECUTE;
-
-                for (int i = 0; i < N_DIRECTORIES; i++) {
-                    if (current_direct[i].file_name[0] == '\0') {
-                        current_direct[i] = folder;
-                        break;
-                    }else if (std::strcmp(current_direct[i].file_name, dirname.c_str()) == 0) {
-                        std::cout << dirname << " already exists\n";
-                        return 0;
-                    }
-                }
+// block of an n block directory a name with hash h is stored in. Linear
+// hashing: the first n - level blocks have been split already and use one
+// more bit of the hash than the rest.
+static unsigned
+hash_bucket(uint32_t h, unsigned n)
+{
+    unsigned level = hash_level(n);
+    unsigned b = h & (level - 1);
+    if (b < n - level)
+        b = h & (2 * level - 1);
+    return b;
+}
 
-                // write the new directory to parent directory
-                if (CWD == "/") {
-                    disk.write(ROOT_BLOCK, (uint8_t*)current_direct);
-                }else{
-                    disk.write(parent_index[current_index], (uint8_t*)current_direct);
-                }
+// DIR_HASHED or DIR_BTREE, told apart by the first block
+int
+FS::dir_format(int dir)
+{
+    dir_entry buf[N_DIRECTORIES];
+    return dir_tree_is_node(peek_dir(dir, buf)) ? DIR_BTREE : DIR_HASHED;
+}
 
-                // create a new directory with no files
-                dir_entry new_direct[N_DIRECTORIES];
-                std::memset(new_direct, 0, sizeof(new_direct));
-                disk.write(free_block, (uint8_t*)new_direct);
+// returns the block of the directory starting at dir that holds name, if
+// it is there. dir itself if it is out of range and has no chain.
+int
+FS::dir_bucket(int dir, const char *name)
+{
+    if (dir_format(dir) == DIR_BTREE)
+        return tree_leaf(dir, name);
+    std::lock_guard<std::mutex> guard(chains_lock);
+    const std::vector<int> &blocks = chains.get(dir, &fat[0], disk.get_no_blocks());
+    if (blocks.empty())
+        return dir;
+    return blocks[hash_bucket(DirIndex::hash(name), blocks.size())];
+}
 
-                set_current_to(dirname);
-            }    
-        }
+// links count new blocks to the end of the directory starting at dir,
+// either all of them or none
+int
+FS::dir_extend(int dir, unsigned count, unsigned *blocks)
+{
+    if (alloc_blocks(count, blocks) < 0)
+        return -1;
+    int last = tail_block(dir);
+    std::lock_guard<std::mutex> guard(chains_lock);
+    for (unsigned i = 0; i < count; i++) {
+        set_fat(last, blocks[i]);
+        set_fat(blocks[i], FAT_EOF);
+        chains.append(dir, blocks[i]);
+        last = blocks[i];
     }
-    CWD = tempcwd;
-    current_index = temp_index;
-    std::memcpy(parent_index, temp_parent_index, sizeof(parent_index));
-    disk.read(parent_index[current_index], (uint8_t*)current_direct);
+    mark_fat_dirty();
     return 0;
 }
 
-// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+// adds a block to the end of the directory starting at dir and moves the
+// names that now hash to it out of the block that is split
 int
-FS::cd(std::string dirpath)
-{   
-    dir_entry temp_dir[N_DIRECTORIES];
-    std::memcpy(temp_dir, current_direct, sizeof(current_direct));
-    std::string tempcwd = CWD;
-    int8_t tempParent_index[64];
-    int8_t temp_index = current_index;
-    std::memcpy(tempParent_index, parent_index, sizeof(parent_index));
-    int8_t res = set_current_to(dirpath);
-    if (res < 0) {
-        current_index = temp_index;
-        std::memcpy(current_direct, temp_dir, sizeof(current_direct));
-        parent_index[current_index] = tempParent_index[current_index];
-        CWD = tempcwd;
-
-        if (res == -2)
-        {
-            std::cout << dirpath << " is not a directory\n";
-        }else{
-            std::cout << dirpath << " not found\n";
-        }
-        return 0;
+FS::dir_grow(int dir)
+{
+    std::vector<int> blocks = dir_blocks(dir);
+    unsigned n = blocks.size();
+    unsigned block;
+    if (dir_extend(dir, 1, &block) < 0)
+        return -1;
+
+    int split = blocks[n - hash_level(n)];
+    dir_entry old[N_DIRECTORIES], moved[N_DIRECTORIES];
+    cache.read(split, (uint8_t*)old);
+    std::memset(moved, 0, sizeof(moved));
+    for (unsigned i = 0; i < N_DIRECTORIES; i++) {
+        if (old[i].file_name[0] == '\0' ||
+            hash_bucket(DirIndex::hash(old[i].file_name), n + 1) != n)
+            continue;
+        moved[i] = old[i];
+        std::memset(&old[i], 0, sizeof(dir_entry));
     }
+    write_dir(block, moved);
+    write_dir(split, old);
+    // names that were missing may now be looked for in the new block
+    std::lock_guard<std::mutex> guard(paths_lock);
+    paths.drop(dir);
     return 0;
 }
 
-// pwd prints the full path, i.e., from the root directory, to the current
-// directory, including the currect directory name
+// finds name in the directory starting at dir, *slot and *entry may be
+// nullptr. Returns -1 if it is not there.
 int
-FS::pwd()
+FS::dir_find(int dir, const std::string &name, dir_slot *slot, dir_entry *entry)
 {
-    if (CWD == "") {
-        std::cout << '/' << "\n";
-        return 0;
+    if (name.empty())
+        return -1;
+    dir_entry buf[N_DIRECTORIES];
+    int block = dir_bucket(dir, name.c_str());
+    const dir_entry *d = peek_dir(block, buf);
+    int i = find_file(name, d, block);
+    if (i < 0)
+        return -1;
+    if (slot != nullptr) {
+        slot->block = block;
+        slot->index = i;
     }
-    std::cout << CWD << "\n";
+    if (entry != nullptr)
+        *entry = d[i];
     return 0;
 }
 
-// chmod <accessrights> <filepath> changes the access rights for the
-// file <filepath> to <accessrights>.
+// stores entry in the directory starting at dir, growing it while the
+// block the name belongs in is full. *slot is set to where it went unless
+// it is nullptr. Returns -1 when the disk is full.
 int
-FS::chmod(std::string accessrights, std::string filepath)
+FS::dir_add(int dir, const dir_entry &entry, dir_slot *slot)
 {
-    int8_t index = filepath.find_last_of('/');
-    int8_t file_index;
-    dir_entry *file;
-    std::string tempcwd = CWD;
-    int8_t tempParent_index[64];
-    int8_t temp_index = current_index;
-    dir_entry temp_dir[N_DIRECTORIES];
-
-    if (index < 0) {
-        file_index = find_file(filepath, current_direct);
-        if (file_index < 0) {
-            std::cout << filepath << " not found\n";
-            return 0;
-        }
-        file = &current_direct[file_index];
-    }else{
-        std::string dirpath = filepath.substr(0, index+1);
-        std::string filename = filepath.substr(index + 1, filepath.size() - index);
-        std::memcpy(temp_dir, current_direct, sizeof(current_direct));
-        std::memcpy(tempParent_index, parent_index, sizeof(parent_index));
-        int8_t res = set_current_to(dirpath);
-        file_index = find_file(filename, current_direct);
-        file = &current_direct[file_index];
-        if (file_index < 0) {
-            std::cout << filename << " not found\n";
-            return 0;
-        }
-        if (res < 0) {
-            if (res == -2)
-            {
-                std::cout << dirpath << " is not a directory\n";
-            }else{
-                std::cout << dirpath << " not found\n";
+    if (dir_format(dir) == DIR_BTREE)
+        return tree_add(dir, entry, slot);
+    for (;;) {
+        dir_entry d[N_DIRECTORIES];
+        int block = dir_bucket(dir, entry.file_name);
+        cache.read(block, (uint8_t*)d);
+        int i = free_slot(d);
+        if (i >= 0) {
+            d[i] = entry;
+            if (slot != nullptr) {
+                slot->block = block;
+                slot->index = i;
             }
-            return 0;
+            return write_dir(block, d);
         }
+        if (dir_grow(dir) < 0)
+            return -1;
     }
+}
 
-    switch (std::stoi(accessrights)) {
-        case 0:
-            file->access_rights = 0x00;
-            break;
-        case 1:
-            file->access_rights = EXECUTE;
-            break;
-        case 2:
-            file->access_rights = WRITE;
-            break;
-        case 3:
-            file->access_rights = WRITE | EXECUTE;
-            break;
-        case 4:
-            file->access_rights = READ;
-            break;
-        case 5:
-            file->access_rights = READ | EXECUTE;
-            break;
-        case 6:
-            file->access_rights = READ | WRITE;
-            break;
-        case 7:
-            file->access_rights = READ | WRITE | EXECUTE;
-            break;
-        
-    }
-    disk.write(parent_index[current_index], (uint8_t*)current_direct);
+int
+FS::dir_set(const dir_slot &slot, const dir_entry &entry)
+{
+    dir_entry d[N_DIRECTORIES];
+    cache.read(slot.block, (uint8_t*)d);
+    d[slot.index] = entry;
+    return write_dir(slot.block, d);
+}
 
-    if (index >= 0) {
-        CWD = tempcwd;
-        current_index = temp_index;
-        std::memcpy(current_direct, temp_dir, sizeof(current_direct));
-        parent_index[current_index] = tempParent_index[current_index];
+// a directory never shrinks, emptied blocks stay in its chain and empty
+// leaves in its tree
+int
+FS::dir_remove(const dir_slot &slot)
+{
+    dir_entry d[N_DIRECTORIES];
+    cache.read(slot.block, (uint8_t*)d);
+    if (dir_tree_is_node(d))
+        dir_tree_remove(d, slot.index);
+    else
+        std::memset(&d[slot.index], 0, sizeof(dir_entry));
+    return write_dir(slot.block, d);
+}
+
+// the entries of the directory starting at dir, block by block or in name
+// order for a tree
+void
+FS::dir_list(int dir, std::vector<dir_entry> *entries)
+{
+    if (dir_format(dir) == DIR_BTREE) {
+        dir_range(dir, "", "", 0, entries);
+        return;
+    }
+    std::vector<int> blocks = dir_blocks(dir);
+    dir_entry buf[N_DIRECTORIES];
+    for (unsigned k = 0; k < blocks.size(); k++) {
+        const dir_entry *d = peek_dir(blocks[k], buf);
+        for (unsigned i = 0; i < N_DIRECTORIES; i++) {
+            if (d[i].file_name[0] != '\0')
+                entries->push_back(d[i]);
+        }
     }
-    disk.read(parent_index[current_index], (uint8_t*)current_direct);
-    return 0;
 }
 
+// access rights of the last directory of dirs, names holds the names of
+// all but the root which can always be read and changed
+int
+FS::dir_rights(const std::vector<int> &dirs, const std::vector<std::string> &names)
+{
+    dir_entry entry;
+    if (names.empty())
+        return READ | WRITE | EXECUTE;
+    if (dir_find(dirs[dirs.size() - 2], names.back(), nullptr, &entry) < 0)
+        return 0;
+    return entry.access_rights;
+}
 
-// find a free block in the FAT
+static bool
+name_less(const dir_entry &a, const dir_entry &b)
+{
+    return std::strcmp(a.file_name, b.file_name) < 0;
+}
+
+// appends the entries of the directory starting at dir whose names start
+// with prefix and come after the name after to entries, in name order and
+// at most limit of them (0 for all). Returns 1 if more would follow. A
+// tree is read from the leaf the range starts in, a hashed directory is
+// read whole and sorted.
 int
-FS::find_free_block()
+FS::dir_range(int dir, const std::string &prefix, const std::string &after, unsigned limit,
+              std::vector<dir_entry> *entries)
 {
-    for (int i = 2; i < disk.get_no_blocks(); i++) {
-        if (fat[i] == FAT_FREE) {
-            return i;
+    const std::string &from = after < prefix ? prefix : after;
+    if (dir_format(dir) == DIR_HASHED) {
+        std::vector<dir_entry> all;
+        dir_list(dir, &all);
+        std::sort(all.begin(), all.end(), name_less);
+        for (unsigned i = 0; i < all.size(); i++) {
+            if (std::strcmp(all[i].file_name, from.c_str()) < 0 || all[i].file_name == after)
+                continue;
+            if (std::strncmp(all[i].file_name, prefix.c_str(), prefix.size()) != 0)
+                break;
+            if (limit > 0 && entries->size() == limit)
+                return 1;
+            entries->push_back(all[i]);
         }
+        return 0;
+    }
+
+    dir_entry node[N_DIRECTORIES];
+    cache.read(tree_leaf(dir, from.c_str()), (uint8_t*)node);
+    bool found;
+    unsigned pos = dir_tree_lower_bound(node, from.c_str(), &found);
+    for (;;) {
+        dir_tree_header h = dir_tree_get(node);
+        for (; pos <= h.count; pos++) {
+            if (node[pos].file_name == after)
+                continue;
+            if (std::strncmp(node[pos].file_name, prefix.c_str(), prefix.size()) != 0)
+                return 0;
+            if (limit > 0 && entries->size() == limit)
+                return 1;
+            entries->push_back(node[pos]);
+        }
+        if (h.next == DIR_TREE_NONE)
+            return 0;
+        cache.read(h.next, (uint8_t*)node);
+        pos = 1;
     }
-    std::cout << "No free blocks available\n";
-    return -1;
 }
 
-// find a file in the root directory
+// the leaf of the tree directory starting at dir that name belongs in
 int
-FS::find_file(std::string filepath, dir_entry *entry)
+FS::tree_leaf(int dir, const char *name)
 {
-    for (int i = 0; i < N_DIRECTORIES; i++) {
-        if (std::strcmp(entry[i].file_name, filepath.c_str()) == 0) {
-            return i;
-        }
+    dir_entry buf[N_DIRECTORIES];
+    int block = dir;
+    const dir_entry *node = peek_dir(block, buf);
+    while (!dir_tree_get(node).leaf) {
+        block = node[dir_tree_child(node, name)].first_blk;
+        node = peek_dir(block, buf);
     }
-    return -1;
+    return block;
 }
 
+// inserts entry into the tree directory starting at dir. Full nodes are
+// split on the way down so there is always room for a separator in the
+// parent. Returns -1 when the disk is full.
 int
-FS::set_current_to(std::string dirpath)
+FS::tree_add(int dir, const dir_entry &entry, dir_slot *slot)
 {
-    int8_t j = 1;
-    int8_t i = 1;
+    dir_entry node[N_DIRECTORIES], child[N_DIRECTORIES], right[N_DIRECTORIES];
+    dir_entry key;
+    std::memset(&key, 0, sizeof(key));
+    cache.read(dir, (uint8_t*)node);
+    if (dir_tree_get(node).count == DIR_TREE_SLOTS) {
+        // the root stays in the first block, its content moves down into
+        // two new nodes
+        unsigned blocks[2];
+        if (dir_extend(dir, 2, blocks) < 0)
+            return -1;
+        std::memcpy(child, node, sizeof(child));
+        dir_tree_split(child, right, blocks[1]);
+        dir_tree_init(node, false);
+        key.first_blk = blocks[0];
+        dir_tree_insert(node, 1, key);
+        set_name(&key, right[1].file_name);
+        key.first_blk = blocks[1];
+        dir_tree_insert(node, 2, key);
+        write_dir(blocks[0], child);
+        write_dir(blocks[1], right);
+        write_dir(dir, node);
+        std::lock_guard<std::mutex> guard(paths_lock);
+        paths.drop(dir);
+    }
 
-    if (dirpath[0] == '/') {
-        CWD = "/";
-        current_index = 0;
-        disk.read(ROOT_BLOCK, (uint8_t*)current_direct);
-        if (dirpath == "/") {
-            return 0;
-        }
-        for (j = 1; j <= dirpath.size(); j++) {
-            std::string sub = "";
-            if (dirpath[j] == '/')
-                sub = dirpath.substr(i, j-i);
-
-            else if (dirpath[j] == '\0')
-                sub = dirpath.substr(i, j-i);
-
-            if (sub != "") {
-                i = j + 1;
-                int8_t dir_index = find_file(sub, current_direct);
-                if (dir_index < 0)
-                    return -1;
-                
-                if (current_direct[dir_index].type != TYPE_DIR)
-                    return -2;
-
-                current_index++;
-                parent_index[current_index] = current_direct[dir_index].first_blk;
-                disk.read(parent_index[current_index], (uint8_t*)current_direct);
-                if (CWD == "/")
-                    CWD += sub;
-                else
-                    CWD += '/' + sub;
+    int block = dir;
+    while (!dir_tree_get(node).leaf) {
+        unsigned pos = dir_tree_child(node, entry.file_name);
+        int next = node[pos].first_blk;
+        cache.read(next, (uint8_t*)child);
+        if (dir_tree_get(child).count == DIR_TREE_SLOTS) {
+            unsigned split;
+            if (dir_extend(dir, 1, &split) < 0)
+                return -1;
+            dir_tree_split(child, right, split);
+            set_name(&key, right[1].file_name);
+            key.first_blk = split;
+            dir_tree_insert(node, pos + 1, key);
+            write_dir(split, right);
+            write_dir(next, child);
+            write_dir(block, node);
+            {
+                std::lock_guard<std::mutex> guard(paths_lock);
+                paths.drop(dir);
             }
-        }
-    }else{
-        i = 0;
-        for (j = 0; j <= dirpath.size(); j++) {
-            std::string sub = "";
-            if (dirpath[j] == '/')
-                sub = dirpath.substr(i, j-i);
-            else if (dirpath[j] == '\0')
-                sub = dirpath.substr(i, j-i);
-            
-            if (sub != "") {
-                i = j + 1;
-                if (sub == "..") {
-                    if (CWD == "/")
-                        return 0;
-                    
-
-                    // int k = CWD.size() - 2;
-                    // while (CWD[k] != '/')
-                    //     k--;
-
-                    CWD = CWD.substr(0, CWD.find_last_of('/'));
-                    current_index--;
-                    disk.read(parent_index[current_index], (uint8_t*)current_direct);
-                }else{
-                    int8_t dir_index = find_file(sub, current_direct);
-                    if (current_direct[dir_index].type != TYPE_DIR)
-                        return -2;
-                    
-                    if (dir_index < 0)
-                        return -1;
-                    
-                    if (current_direct[dir_index].type != TYPE_DIR)
-                        return -2;
-                    
-                    current_index++;
-                    parent_index[current_index] = current_direct[dir_index].first_blk;
-                    disk.read(parent_index[current_index], (uint8_t*)current_direct);
-                    if (CWD == "/")
-                        CWD += sub;
-                    else
-                        CWD += '/' + sub;
-                    }
+            if (std::strcmp(entry.file_name, right[1].file_name) >= 0) {
+                next = split;
+                std::memcpy(child, right, sizeof(child));
             }
         }
+        block = next;
+        std::memcpy(node, child, sizeof(node));
     }
-    return 0;
 
+    bool found;
+    unsigned pos = dir_tree_lower_bound(node, entry.file_name, &found);
+    dir_tree_insert(node, pos, entry);
+    if (slot != nullptr) {
+        slot->block = block;
+        slot->index = pos;
+    }
+    return write_dir(block, node);
 }
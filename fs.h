@@ -1,93 +1,459 @@
 #include <iostream>
 #include <cstdint>
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <functional>
+#include <sys/uio.h>
+#include "geometry.h"
 #include "disk.h"
+#include "cache.h"
+#include "freemap.h"
+#include "chainindex.h"
+#include "dirindex.h"
+#include "direntry.h"
+#include "dirscan.h"
+#include "dirtree.h"
+#include "pathcache.h"
+#include "journal.h"
+#include "readahead.h"
+#include "rwlock.h"
+#include "aio.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
+// the FAT takes fat_blocks blocks from FAT_BLOCK on, as many as the
+// number of blocks chosen by format needs. The metadata journal follows
+// it, see journal.h.
 #define ROOT_BLOCK 0
-#define FAT_BLOCK 1   
+#define SUPER_BLOCK 1
+#define FAT_BLOCK 2
 #define FAT_FREE 0
 #define FAT_EOF -1
+#define FAT_PER_BLOCK geometry::fat_per_block
+// at least the reserved blocks and one for data, at most what a directory
+// entry can point at
+#define MIN_BLOCKS 128
+#define MAX_BLOCKS DIR_NO_BLOCK
+
+// number of blocks of a FAT chain read or written with one batched call
+#define CHAIN_BATCH 32
+// threads running the calls that return futures
+#define FS_ASYNC_THREADS 4
+
+// how blocks for a new chain are allocated
+#define ALLOC_SCATTERED 0  // one free block at a time
+#define ALLOC_FIRST_FIT 1  // lowest contiguous run, else scattered
+#define ALLOC_BEST_FIT 2   // shortest contiguous run, else scattered
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
+
+// A directory is a FAT chain of blocks with N_DIRECTORIES slots each. The
+// block a name is stored in is picked by linear hashing of the name over
+// the blocks of the chain, so a lookup reads one block however large the
+// directory is. A full block makes the directory grow by one block, which
+// takes half of the names of the block split next. A directory of one
+// block is the original layout.
+//
+// A directory can also be made a B+-tree keyed by name, see dirtree.h. It
+// costs a block read per level for a lookup but lists in name order and
+// can start a listing anywhere.
+#define DIR_HASHED 0
+#define DIR_BTREE 1
+
+// where a directory entry is stored
+struct dir_slot {
+    int block;
+    int index;
+};
+
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
 
-struct dir_entry {
-    char file_name[56]; // name of the file / sub-directory
-    uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
-    uint8_t type; // directory (1) or file (0)
-    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+#define FS_MAGIC 0x31544146 // "FAT1"
+#define FS_VERSION 3
+
+// stored at the start of SUPER_BLOCK, written by format
+struct super_block {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t no_blocks;
+    uint32_t fat_start;
+    uint32_t fat_blocks;
+    uint32_t fat_entry_size;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
 };
 
+#define MAX_OPEN_FILES 64
+
+// directories share a lock when their first blocks are equal modulo this
+#define DIR_LOCK_STRIPES 64
+
+// a current directory, its path and the first blocks of the directories
+// from the root down to it. Paths that don't start with '/' are resolved
+// from one. The blocks of the directory itself are read through the cache
+// when needed, a cd copies no directory.
+struct work_dir {
+    std::string path;
+    std::vector<int> dirs;
+};
+
+// an open file, see FS::open(). It remembers where its directory entry is
+// and where in the FAT chain the last access ended, so it is used by one
+// thread at a time.
+struct open_file {
+    bool in_use;
+    int dir;            // first block of the directory holding the entry
+    int dir_block;      // block of the directory holding the entry
+    int entry_index;    // slot of the entry in that directory
+    char file_name[56];
+    int first_blk;      // first block when the position was cached
+    int pos_block;      // block holding the byte at pos_offset
+    uint32_t pos_offset; // file offset of the first byte of pos_block
+};
+
+// blocks of a FAT chain being read, see FS::stream()
+struct chain_batch {
+    unsigned block_nos[CHAIN_BATCH];
+    const uint8_t *data[CHAIN_BATCH];
+    unsigned count;
+    std::vector<uint8_t> buffer;
+    std::unique_ptr<cache_readv> reads;
+    bool in_flight;
+    chain_batch() : count(0), in_flight(false) {}
+};
 
 class FS {
 private:
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
-    // current directory
-    std::string CWD = "/";
-    dir_entry current_direct[64];
-    int8_t parent_index[64];
-    int8_t current_index;
-    uint16_t N_DIRECTORIES = (BLOCK_SIZE/sizeof(dir_entry));  // 64
-
-    
-    
+    // all block accesses go through the cache, never straight to the disk
+    BlockCache cache;
+    // one entry per block of the disk, fat_blocks blocks on the disk
+    std::vector<geometry::fat_entry> fat;
+    unsigned fat_blocks;
+    // free blocks of the FAT, used to allocate without scanning it
+    FreeMap freemap;
+    // changes to the FAT are kept in memory and committed together, only
+    // the FAT blocks in fat_dirty are written
+    std::set<unsigned> fat_dirty;
+    // The FAT and directory blocks written by the operations since the
+    // last commit form one transaction. They are held in the cache until
+    // the transaction is in the journal, blocks the operations freed are
+    // only reused after that. commit_interval operations share a commit.
+    Journal journal;
+    std::set<unsigned> txn_blocks;
+    std::vector<unsigned> txn_freed;
+    // a block the journal would write on replay was freed
+    bool checkpoint_needed;
+    unsigned commit_interval;
+    unsigned ops_since_commit;
+    uint64_t fat_updates;
+    uint64_t fat_commits;
+    uint64_t fat_block_writes;
+    // true when the disk holds a file system that has been loaded
+    bool mounted;
+    int alloc_mode;
+    // blocks of recently used chains, for seeks and appends
+    ChainIndex chains;
+    bool use_chain_index;
+    // sequential reads of chains, the blocks ahead of them are prefetched
+    // into the cache
+    ReadAhead readahead;
+    bool use_read_ahead;
+    // hash index of the names in each directory block
+    DirIndex dirs;
+    // resolved paths, including ones that do not exist
+    PathCache paths;
+    // the current directory of the calls without a session
+    work_dir cwd;
+    // the current directories of all sessions and cwd. A directory one of
+    // them is in is neither removed nor moved.
+    std::set<work_dir*> sessions;
+    static constexpr unsigned N_DIRECTORIES = geometry::dir_slots;
+    open_file handles[MAX_OPEN_FILES];
+    // runs the calls that return futures
+    ThreadPool executor;
+
+    // Every operation holds fat_lock, shared if it leaves the FAT alone and
+    // exclusive if it allocates or frees blocks, adds, removes or moves
+    // entries, or commits. Under the shared lock the directories keep
+    // their shape, so lookups need nothing more: blocks are copied whole
+    // from the cache. An entry changed in place is read and written back
+    // under the lock of its directory, taken after fat_lock. The other
+    // locks guard a single structure and are not held across calls.
+    RWLock fat_lock;
+    std::mutex dir_locks[DIR_LOCK_STRIPES];
+    std::mutex txn_lock;     // txn_blocks and ops_since_commit
+    std::mutex chains_lock;
+    std::mutex readahead_lock;
+    std::mutex dirs_lock;
+    std::mutex paths_lock;
+    std::mutex handles_lock; // in_use of the handles
+    std::mutex sessions_lock; // sessions and the directories they are in
+
+    // an operation from construction until it goes out of scope, it holds
+    // fat_lock and ends with end_op()
+    struct op_scope {
+        FS *fs;
+        bool exclusive;
+        op_scope(FS *fs, bool exclusive) : fs(fs), exclusive(exclusive)
+        {
+            if (exclusive)
+                fs->fat_lock.lock();
+            else
+                fs->fat_lock.lock_shared();
+        }
+        ~op_scope() { fs->end_op(exclusive); }
+    };
+    std::mutex &dir_lock(int dir) { return dir_locks[(unsigned)dir % DIR_LOCK_STRIPES]; }
+    work_dir current_dir(const work_dir &from);
+    void reset_sessions();
+    bool dir_in_use(int dir);
+    void clear_indexes();
+    void reset_fat(unsigned no_blocks);
+    unsigned reserved_blocks();
+    int load_fat();
+    void set_fat(unsigned block, geometry::fat_entry value) { fat[block] = value; fat_dirty.insert(block / FAT_PER_BLOCK); }
+    void rebuild_freemap();
+    bool fat_is_valid();
+    void mark_fat_dirty();
+    int write_next_block(uint8_t *data, unsigned used, int *first, int *last);
+    void skip_input();
+    static std::istream &input();
+    static std::ostream &output();
+    int write_all(int fd, struct iovec *iov, int count);
+    int start_batch(chain_batch *b, int *block, uint32_t *unread);
+    std::future<int> run_async(std::function<int()> call);
+    open_file *get_handle(int fh);
+    int load_entry(open_file *h, dir_entry *entry);
+    int store_entry(open_file *h, const dir_entry *entry);
+    int seek_block(open_file *h, int first_blk, uint32_t offset);
+    void read_ahead(open_file *h, uint32_t offset, uint32_t len, uint32_t size);
+    int extend_chain(open_file *h, dir_entry *entry, uint32_t new_size);
+    int write_blocks(open_file *h, uint32_t size, uint32_t offset, uint32_t len, const uint8_t *buf);
+    int chain_block(int first, unsigned k);
+    int commit_fat();
+    int write_meta(unsigned block, const uint8_t *data);
+    int commit();
+    int checkpoint();
+    void discard_txn();
+    void end_op(bool exclusive);
+    // directories, see dir_slot
+    std::vector<int> dir_blocks(int dir);
+    int dir_bucket(int dir, const char *name);
+    int dir_format(int dir);
+    int dir_extend(int dir, unsigned count, unsigned *blocks);
+    int dir_grow(int dir);
+    int dir_find(int dir, const std::string &name, dir_slot *slot, dir_entry *entry);
+    int dir_add(int dir, const dir_entry &entry, dir_slot *slot);
+    int dir_set(const dir_slot &slot, const dir_entry &entry);
+    int dir_remove(const dir_slot &slot);
+    void dir_list(int dir, std::vector<dir_entry> *entries);
+    int dir_rights(const std::vector<int> &dirs, const std::vector<std::string> &names);
+    int dir_range(int dir, const std::string &prefix, const std::string &after, unsigned limit,
+                  std::vector<dir_entry> *entries);
+    int tree_leaf(int dir, const char *name);
+    int tree_add(int dir, const dir_entry &entry, dir_slot *slot);
+    // paths
+    int resolve_dirs(const std::vector<std::string> &parts, std::vector<int> *dirs,
+                     std::vector<std::string> *names);
+    int find_dir(const work_dir &wd, const std::string &dirpath, std::vector<int> *dirs,
+                 std::vector<std::string> *names);
+    int find_entry(const work_dir &wd, const std::string &filepath, int *dir, dir_slot *slot,
+                   dir_entry *entry);
+    int find_target(const work_dir &wd, const std::string &destpath, const std::string &name,
+                    std::vector<int> *dirs, std::string *new_name);
+    int find_new(const work_dir &wd, const std::string &filepath, int *dir, std::string *name);
+    int add_file(int dir, const std::string &name, uint32_t size, int first);
+
+    // The calls below are parts of the operations. They take no locks but
+    // the ones of the indexes, the caller holds fat_lock.
+
+    // takes count free blocks for a new chain, contiguous if possible
+    int alloc_blocks(unsigned count, unsigned *blocks);
+    // find a free block in the FAT and take it from the free map
+    int find_free_block();
+    // copies a FAT chain to new blocks
+    int copy_chain(int block, int *first);
+    // gives a file its own copy of the blocks it points at
+    int copy_file_blocks(dir_entry *entry);
+    // appends the content of one file to another
+    int append_data(dir_entry *entry, const dir_entry *src);
+    // returns the last block of a chain
+    int tail_block(int first);
+    // frees all blocks of a FAT chain
+    void free_chain(int block);
+    // ends a FAT chain at one of its blocks and frees the rest
+    void cut_chain(int first, int last);
+
+    // find a file in one directory block by scanning its entries
+    int find_file(std::string filepath, const dir_entry *entry);
+    // returns the first unused slot of dir, -1 if it is full
+    int free_slot(const dir_entry *dir);
+    // find a file in a directory block through its hash index
+    int find_file(std::string filepath, const dir_entry *entry, int block);
+    // writes a directory block and keeps its hash index and the path
+    // cache up to date
+    int write_dir(unsigned block, const dir_entry *dir);
+
+    // resolves parts from the directory starting at block start through the
+    // path cache
+    void resolve(int start, const std::vector<std::string> &parts, path_entry *e);
+    void walk(int start, const std::vector<std::string> &parts, path_entry *e);
+
+    const dir_entry *peek_dir(unsigned block, dir_entry *buf);
 
 public:
-    FS();
+    FS(unsigned cache_blocks = CACHE_DEFAULT_CAPACITY, int disk_backend = DISK_BACKEND);
     ~FS();
-    // formats the disk, i.e., creates an empty file system
-    int format();
+    // mount loads the FAT and the root directory of an existing file system
+    int mount();
+    // formats the disk, i.e., creates an empty file system of no_blocks
+    // blocks, 0 keeps the size of the disk
+    int format(unsigned no_blocks = 0);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the fo llowing rows (ended with an empty row)
-    int create(std::string filepath);
+    int create(std::string filepath) { return create(cwd, filepath); }
     // cat <filepath> reads the content of a file and prints it on the screen
-    int cat(std::string filepath);
+    int cat(std::string filepath) { return cat(cwd, filepath); }
     // ls lists the content in the current directory (files and sub-directories)
-    int ls();
+    int ls() { return ls(cwd); }
+    // list <dirpath> lists the entries of a directory whose names start
+    // with <prefix> in name order, at most <count> (0 for all) of those that
+    // come after the name <after>. The last name listed continues it.
+    int list(std::string dirpath, std::string prefix, std::string after, unsigned count)
+    {
+        return list(cwd, dirpath, prefix, after, count);
+    }
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
-    int cp(std::string sourcepath, std::string destpath);
+    int cp(std::string sourcepath, std::string destpath) { return cp(cwd, sourcepath, destpath); }
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
-    int mv(std::string sourcepath, std::string destpath);
+    int mv(std::string sourcepath, std::string destpath) { return mv(cwd, sourcepath, destpath); }
     // rm <filepath> removes / deletes the file <filepath>
-    int rm(std::string filepath);
+    int rm(std::string filepath) { return rm(cwd, filepath); }
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
-    int append(std::string filepath1, std::string filepath2);
+    int append(std::string filepath1, std::string filepath2) { return append(cwd, filepath1, filepath2); }
 
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-    // in the current directory
-    int mkdir(std::string dirpath);
+    // in the current directory, format is DIR_HASHED or DIR_BTREE
+    int mkdir(std::string dirpath, int format = DIR_HASHED) { return mkdir(cwd, dirpath, format); }
     // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
-    int cd(std::string dirpath);
+    int cd(std::string dirpath) { return cd(cwd, dirpath); }
     // pwd prints the full path, i.e., from the root directory, to the current
     // directory, including the current directory name
-    int pwd();
+    int pwd() { return pwd(cwd); }
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
-    int chmod(std::string accessrights, std::string filepath);
+    int chmod(std::string accessrights, std::string filepath) { return chmod(cwd, accessrights, filepath); }
 
-    // find a free block in the FAT
-    int find_free_block();
+    // open <filepath> returns a handle for pread/pwrite, or -1
+    int open(std::string filepath) { return open(cwd, filepath); }
+    int close(int fh);
+    // reads up to len bytes from offset into buf, returns the number of
+    // bytes read or -1
+    int pread(int fh, uint32_t offset, uint32_t len, uint8_t *buf);
+    int pread(std::string filepath, uint32_t offset, uint32_t len, uint8_t *buf)
+    {
+        return pread(cwd, filepath, offset, len, buf);
+    }
+    // writes len bytes from buf at offset, growing the file if needed.
+    // Returns the number of bytes written or -1.
+    int pwrite(int fh, uint32_t offset, uint32_t len, const uint8_t *buf);
+    int pwrite(std::string filepath, uint32_t offset, uint32_t len, const uint8_t *buf)
+    {
+        return pwrite(cwd, filepath, offset, len, buf);
+    }
 
-    // find a file in the root directory
-    int find_file(std::string filepath, dir_entry *entry);
+    // The calls above resolve paths from the current directory of the FS,
+    // shared by all their callers. These resolve them from the current
+    // directory of a session instead, see Session.
+    int create(work_dir &from, std::string filepath);
+    // creates a file holding len bytes of data in one operation, returns
+    // -1 if it can't
+    int create(work_dir &from, std::string filepath, const uint8_t *data, uint32_t len);
+    int cat(work_dir &from, std::string filepath);
+    int ls(work_dir &from);
+    int list(work_dir &from, std::string dirpath, std::string prefix, std::string after, unsigned count);
+    int cp(work_dir &from, std::string sourcepath, std::string destpath);
+    int mv(work_dir &from, std::string sourcepath, std::string destpath);
+    int rm(work_dir &from, std::string filepath);
+    int append(work_dir &from, std::string filepath1, std::string filepath2);
+    int mkdir(work_dir &from, std::string dirpath, int format = DIR_HASHED);
+    int cd(work_dir &from, std::string dirpath);
+    int pwd(work_dir &from);
+    int chmod(work_dir &from, std::string accessrights, std::string filepath);
+    int open(work_dir &from, std::string filepath);
+    int pread(work_dir &from, std::string filepath, uint32_t offset, uint32_t len, uint8_t *buf);
+    int pwrite(work_dir &from, std::string filepath, uint32_t offset, uint32_t len, const uint8_t *buf);
+    // passes the content of a file to out in order, an iovec array at a
+    // time, like cat. Stops with -1 when out returns less than 0 or the
+    // file is removed meanwhile, out holds no lock of the FS.
+    int stream(work_dir &from, std::string filepath, const std::function<int(struct iovec*, int)> &out);
+    // copies the entry of a file or directory, returns -1 if there is none
+    int stat(work_dir &from, std::string path, dir_entry *entry);
+    // the entries of a directory in the order ls lists them, or -1
+    int readdir(work_dir &from, std::string dirpath, std::vector<dir_entry> *entries);
+    // a session starts in the root directory, format and mount send every
+    // session back there
+    void attach(work_dir *wd);
+    void detach(work_dir *wd);
 
-    int create_folder(std::string dirpath);
+    // The calls below return at once, the call of the same name runs on a
+    // pool of threads and the future gets what it returns. Buffers, handles
+    // and sessions must be kept until then, a handle may have one call
+    // running at a time. Their messages go to std::cout.
+    std::future<int> pread_async(int fh, uint32_t offset, uint32_t len, uint8_t *buf);
+    std::future<int> pwrite_async(int fh, uint32_t offset, uint32_t len, const uint8_t *buf);
+    std::future<int> stream_async(work_dir &from, std::string filepath,
+                                  std::function<int(struct iovec*, int)> out);
 
-    int set_current_to(std::string dirpath);
+    // create reads the content of a file from in and the operations print
+    // their messages to out, for the calling thread. nullptr means
+    // std::cin or std::cout, cat writes those files to the standard output
+    // itself.
+    static void redirect(std::istream *in, std::ostream *out);
 
+    // sync writes all cached blocks back to the disk and makes them durable
+    int sync();
+    // stats prints counters for the block cache, the FAT and the indexes
+    int stats();
+    // commit the metadata of every <ops> operations together, 1 commits
+    // after each one
+    void set_commit_interval(unsigned ops);
+    journal_stats get_journal_stats() { return journal.get_stats(); }
+
+    // how blocks for new chains are picked, see ALLOC_*
+    void set_alloc_mode(int mode);
+    // use an index of recently used chains for seeks and appends
+    void set_chain_index(bool enabled);
+    // prefetch the blocks ahead of sequential reads
+    void set_read_ahead(bool enabled);
+};
+
+// a client of a mounted file system with a current directory of its own,
+// pass it to the calls of the FS that take a work_dir. Many sessions can
+// use one FS at the same time, a server has one per connection.
+class Session : public work_dir {
+private:
+    FS &fs;
+public:
+    Session(FS &fs) : fs(fs) { fs.attach(this); }
+    ~Session() { fs.detach(this); }
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
 };
 
 #endif // __FS_H__
@@ -0,0 +1,730 @@
+// Checks the file system on diskfile.bin. The directory tree is walked
+// from ROOT_BLOCK by a pool of threads, one directory at a time, and every
+// block of every chain is claimed for the entry that reaches it. A block
+// claimed twice by the same chain closes a cycle, one claimed by two
+// chains is cross-linked. Blocks that are in use but never claimed leaked.
+//
+// usage: fsck [-r] [-j <threads>]
+//   -r  repairs what was found and checks again
+//   -j  number of threads, the number of cores by default
+//
+// Exits with 0 if the file system is clean, 1 if every problem was
+// repaired and 4 if problems are left.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include "fs.h"
+
+// owner of a block nothing has claimed, of the reserved blocks and of the
+// root directory. Other chains are numbered from FIRST_CHAIN.
+#define NO_CHAIN -1
+#define RESERVED_CHAIN 0
+#define ROOT_CHAIN 1
+#define FIRST_CHAIN 2
+
+enum problem_kind {
+    BAD_FAT_ENTRY,   // a FAT entry points outside the disk
+    BAD_RESERVED,    // a reserved block is not marked in use
+    CYCLE,           // the chain comes back to one of its blocks
+    CROSS_LINK,      // the chain runs into a block of another chain
+    FREE_IN_CHAIN,   // the chain runs into a block marked free
+    BAD_LINK,        // the chain runs into a reserved block
+    BAD_SIZE,        // the size does not match the length of the chain
+    BAD_FIRST,       // the entry points outside the data blocks
+    BAD_ENTRY,       // the entry has no name terminator or a bad type
+    DIR_LINKED_TWICE,
+    BAD_NODE,        // a block of a B+-tree directory is not a node
+    LEAK,
+};
+
+// where a directory entry is stored
+struct entry_ref {
+    int block;      // -1 for the root directory
+    int slot;
+    bool tree;      // in a B+-tree leaf
+};
+
+struct problem {
+    problem_kind kind;
+    std::string path;
+    int block;      // where it was found
+    int prev;       // the block before it in the chain, -1 if it is the first
+    int other;      // chain it is cross-linked with
+    entry_ref ref;
+    uint32_t size;  // of the entry, BAD_SIZE
+    unsigned blocks; // of the chain, BAD_SIZE
+};
+
+struct dir_work {
+    int first;
+    int chain;
+    std::string path;
+    entry_ref ref;
+};
+
+class Checker {
+private:
+    Disk &disk;
+    unsigned threads;
+    unsigned no_blocks;
+    unsigned reserved;
+    std::vector<int32_t> fat;
+    std::set<unsigned> fat_dirty;
+    unsigned next_free; // where alloc_block looks next
+    std::vector<std::atomic<int32_t> > *owner;
+    std::atomic<int> next_chain;
+    std::atomic<unsigned> dirs, files, used;
+
+    std::mutex lock; // problems, chain paths and the work queue
+    std::vector<problem> problems;
+    std::vector<std::string> chain_paths;
+    std::deque<dir_work> queue;
+    unsigned busy;   // directories queued or being checked
+    std::condition_variable work_ready;
+
+    void report(const problem &p);
+    problem make(problem_kind kind, const std::string &path, int block, int prev, const entry_ref &ref);
+    int new_chain(const std::string &path);
+    std::string chain_path(int chain);
+    bool walk(int first, int chain, const std::string &path, const entry_ref &ref, bool dir,
+              std::vector<int> *blocks);
+    void check_entry(const std::string &dirpath, int block, int slot, bool tree, const dir_entry &e);
+    void check_dir(const dir_work &w);
+    void worker();
+    void parallel(void (Checker::*range)(unsigned, unsigned));
+    void check_fat(unsigned begin, unsigned end);
+    void find_leaks(unsigned begin, unsigned end);
+    void set_fat(unsigned block, int32_t value);
+    int alloc_block();
+    int clone_tail(int block);
+    int set_entry(const problem &p, int first, uint32_t size);
+    int remove_entry(const problem &p);
+public:
+    Checker(Disk &disk, unsigned threads);
+    int load();
+    // one pass over the file system, returns the number of problems
+    unsigned check();
+    // repairs the problems of the last pass, returns how many
+    unsigned repair();
+    void print_problems();
+    void print_summary();
+};
+
+Checker::Checker(Disk &disk, unsigned threads) : disk(disk), threads(threads), no_blocks(0),
+    reserved(0), next_free(0), owner(nullptr), busy(0)
+{
+}
+
+// reads the superblock and the FAT, returns -1 if there is no file system
+// to check
+int
+Checker::load()
+{
+    uint8_t block[BLOCK_SIZE];
+    super_block sb;
+    if (disk.read(SUPER_BLOCK, block) < 0)
+        return -1;
+    std::memcpy(&sb, block, sizeof(sb));
+    if (sb.magic != FS_MAGIC || sb.version != FS_VERSION) {
+        std::cout << "fsck: no file system found\n";
+        return -1;
+    }
+    if (sb.block_size != BLOCK_SIZE || sb.no_blocks != disk.get_no_blocks() ||
+        sb.fat_start != FAT_BLOCK || sb.fat_entry_size != geometry::fat_entry_size ||
+        sb.fat_blocks != (sb.no_blocks + FAT_PER_BLOCK - 1) / FAT_PER_BLOCK ||
+        sb.journal_start != FAT_BLOCK + sb.fat_blocks || sb.journal_blocks != Journal::size(sb.fat_blocks)) {
+        std::cout << "fsck: superblock does not match the disk, format it\n";
+        return -1;
+    }
+    no_blocks = sb.no_blocks;
+    reserved = sb.journal_start + sb.journal_blocks;
+
+    // committed transactions go home before anything is checked
+    {
+        Journal journal(disk);
+        BlockCache cache(disk);
+        journal.setup(sb.journal_start, sb.journal_blocks);
+        int replayed = journal.replay(cache);
+        if (replayed < 0) {
+            std::cout << "fsck: journal header is corrupt, emptied\n";
+            if (journal.reset() < 0)
+                return -1;
+        } else if (replayed > 0) {
+            std::cout << "fsck: replayed " << replayed << " transactions from the journal\n";
+        }
+    }
+
+    fat.assign((size_t)sb.fat_blocks * FAT_PER_BLOCK, FAT_FREE);
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> blks;
+    for (unsigned i = 0; i < sb.fat_blocks; i++) {
+        block_nos.push_back(FAT_BLOCK + i);
+        blks.push_back((uint8_t*)&fat[(size_t)i * FAT_PER_BLOCK]);
+    }
+    if (disk.readv_blocks(&block_nos[0], &blks[0], block_nos.size()) < 0)
+        return -1;
+    return 0;
+}
+
+void
+Checker::report(const problem &p)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    problems.push_back(p);
+}
+
+problem
+Checker::make(problem_kind kind, const std::string &path, int block, int prev, const entry_ref &ref)
+{
+    problem p;
+    p.kind = kind;
+    p.path = path;
+    p.block = block;
+    p.prev = prev;
+    p.other = NO_CHAIN;
+    p.ref = ref;
+    p.size = 0;
+    p.blocks = 0;
+    return p;
+}
+
+int
+Checker::new_chain(const std::string &path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int chain = next_chain++;
+    if (chain_paths.size() <= (size_t)chain)
+        chain_paths.resize(chain + 1);
+    chain_paths[chain] = path;
+    return chain;
+}
+
+std::string
+Checker::chain_path(int chain)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (chain == RESERVED_CHAIN)
+        return "a reserved block";
+    return chain < (int)chain_paths.size() ? chain_paths[chain] : "?";
+}
+
+// claims the blocks of the chain starting at first. Stops at the first
+// block it cannot claim and reports why, returns true if the chain ended
+// cleanly.
+bool
+Checker::walk(int first, int chain, const std::string &path, const entry_ref &ref, bool dir,
+              std::vector<int> *blocks)
+{
+    int prev = -1;
+    int b = first;
+    while (b != FAT_EOF) {
+        // out of range entries are reported by check_fat
+        if (b < 0 || b >= (int)no_blocks)
+            return false;
+        if (b < (int)reserved && !(chain == ROOT_CHAIN && b == ROOT_BLOCK)) {
+            report(make(BAD_LINK, path, b, prev, ref));
+            return false;
+        }
+        int32_t expected = NO_CHAIN;
+        if (!(*owner)[b].compare_exchange_strong(expected, chain)) {
+            problem_kind kind = expected == chain ? CYCLE : CROSS_LINK;
+            // a second entry for a directory that was reached already
+            if (dir && prev == -1)
+                kind = DIR_LINKED_TWICE;
+            problem p = make(kind, path, b, prev, ref);
+            p.other = expected;
+            report(p);
+            return false;
+        }
+        blocks->push_back(b);
+        used++;
+        if (fat[b] == FAT_FREE) {
+            report(make(FREE_IN_CHAIN, path, b, prev, ref));
+            return false;
+        }
+        prev = b;
+        b = fat[b];
+    }
+    return true;
+}
+
+void
+Checker::check_entry(const std::string &dirpath, int block, int slot, bool tree, const dir_entry &e)
+{
+    entry_ref ref = { block, slot, tree };
+    std::string name(e.file_name, strnlen(e.file_name, sizeof(e.file_name)));
+    std::string path = dirpath + name;
+    if (name.size() == sizeof(e.file_name) || e.type > TYPE_DIR ||
+        (e.type == TYPE_DIR && e.first_blk == DIR_NO_BLOCK)) {
+        report(make(BAD_ENTRY, dirpath, block, slot, ref));
+        return;
+    }
+    if (e.first_blk == DIR_NO_BLOCK) {
+        files++;
+        if (e.size > 0) {
+            problem p = make(BAD_SIZE, path, FAT_EOF, -1, ref);
+            p.size = e.size;
+            report(p);
+        }
+        return;
+    }
+    if (e.first_blk >= no_blocks || e.first_blk < reserved) {
+        report(make(BAD_FIRST, path, e.first_blk, -1, ref));
+        return;
+    }
+    if (e.type == TYPE_DIR) {
+        dir_work w;
+        w.first = e.first_blk;
+        w.chain = new_chain(path + "/");
+        w.path = path + "/";
+        w.ref = ref;
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(w);
+        busy++;
+        work_ready.notify_one();
+        return;
+    }
+    files++;
+    std::vector<int> blocks;
+    if (!walk(e.first_blk, new_chain(path), path, ref, false, &blocks))
+        return;
+    unsigned need = (e.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks.size() != need) {
+        // prev is where a chain longer than the size is cut
+        problem p = make(BAD_SIZE, path, blocks.back(), need > 0 && need < blocks.size() ? blocks[need - 1] : -1, ref);
+        p.size = e.size;
+        p.blocks = blocks.size();
+        report(p);
+    }
+}
+
+void
+Checker::check_dir(const dir_work &w)
+{
+    std::vector<int> blocks;
+    walk(w.first, w.chain, w.path, w.ref, true, &blocks);
+    if (blocks.empty())
+        return;
+    dirs++;
+    dir_entry d[geometry::dir_slots];
+    bool tree = false;
+    for (unsigned k = 0; k < blocks.size(); k++) {
+        if (disk.read(blocks[k], (uint8_t*)d) < 0)
+            return;
+        if (k == 0)
+            tree = dir_tree_is_node(d);
+        if (!tree) {
+            for (unsigned i = 0; i < geometry::dir_slots; i++) {
+                if (d[i].file_name[0] != '\0')
+                    check_entry(w.path, blocks[k], i, false, d[i]);
+            }
+            continue;
+        }
+        if (!dir_tree_is_node(d)) {
+            report(make(BAD_NODE, w.path, blocks[k], -1, w.ref));
+            continue;
+        }
+        dir_tree_header h = dir_tree_get(d);
+        if (!h.leaf)
+            continue;
+        for (unsigned i = 1; i <= h.count && i <= DIR_TREE_SLOTS; i++)
+            check_entry(w.path, blocks[k], i, true, d[i]);
+    }
+}
+
+// checks directories until every one reachable has been checked
+void
+Checker::worker()
+{
+    for (;;) {
+        dir_work w;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (queue.empty() && busy > 0)
+                work_ready.wait(guard);
+            if (queue.empty())
+                return;
+            w = queue.front();
+            queue.pop_front();
+        }
+        check_dir(w);
+        std::lock_guard<std::mutex> guard(lock);
+        if (--busy == 0)
+            work_ready.notify_all();
+    }
+}
+
+// runs range over the data blocks, split between the threads
+void
+Checker::parallel(void (Checker::*range)(unsigned, unsigned))
+{
+    std::vector<std::thread> pool;
+    unsigned step = (no_blocks + threads - 1) / threads;
+    for (unsigned t = 0; t < threads; t++) {
+        unsigned begin = std::min(no_blocks, t * step);
+        unsigned end = std::min(no_blocks, begin + step);
+        pool.push_back(std::thread(range, this, begin, end));
+    }
+    for (unsigned t = 0; t < pool.size(); t++)
+        pool[t].join();
+}
+
+void
+Checker::check_fat(unsigned begin, unsigned end)
+{
+    entry_ref none = { -1, -1, false };
+    for (unsigned b = begin; b < end; b++) {
+        if (b == ROOT_BLOCK) {
+            if (fat[b] == FAT_FREE)
+                report(make(BAD_RESERVED, "", b, -1, none));
+        } else if (b < reserved) {
+            (*owner)[b] = RESERVED_CHAIN;
+            if (fat[b] != FAT_EOF)
+                report(make(BAD_RESERVED, "", b, -1, none));
+            continue;
+        }
+        if (fat[b] < FAT_EOF || fat[b] >= (int32_t)no_blocks)
+            report(make(BAD_FAT_ENTRY, "", b, -1, none));
+    }
+}
+
+void
+Checker::find_leaks(unsigned begin, unsigned end)
+{
+    entry_ref none = { -1, -1, false };
+    for (unsigned b = std::max(begin, reserved); b < end; b++) {
+        if (fat[b] != FAT_FREE && (*owner)[b] == NO_CHAIN)
+            report(make(LEAK, "", b, -1, none));
+    }
+}
+
+unsigned
+Checker::check()
+{
+    std::vector<std::atomic<int32_t> > owners(no_blocks);
+    for (unsigned b = 0; b < no_blocks; b++)
+        owners[b] = NO_CHAIN;
+    owner = &owners;
+    problems.clear();
+    chain_paths.clear();
+    next_chain = FIRST_CHAIN;
+    dirs = 0;
+    files = 0;
+    used = reserved - 1;
+
+    parallel(&Checker::check_fat);
+
+    dir_work root;
+    root.first = ROOT_BLOCK;
+    root.chain = ROOT_CHAIN;
+    root.path = "/";
+    root.ref.block = -1;
+    root.ref.slot = -1;
+    root.ref.tree = false;
+    chain_paths.resize(FIRST_CHAIN);
+    chain_paths[ROOT_CHAIN] = "/";
+    queue.push_back(root);
+    busy = 1;
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++)
+        pool.push_back(std::thread(&Checker::worker, this));
+    for (unsigned t = 0; t < pool.size(); t++)
+        pool[t].join();
+
+    parallel(&Checker::find_leaks);
+    owner = nullptr;
+
+    // the threads found them in no particular order
+    std::sort(problems.begin(), problems.end(), [](const problem &a, const problem &b) {
+        if (a.kind != b.kind)
+            return a.kind < b.kind;
+        if (a.path != b.path)
+            return a.path < b.path;
+        return a.block < b.block;
+    });
+    return problems.size();
+}
+
+void
+Checker::print_problems()
+{
+    for (unsigned i = 0; i < problems.size(); i++) {
+        const problem &p = problems[i];
+        switch (p.kind) {
+        case BAD_FAT_ENTRY:
+            std::cout << "FAT entry of block " << p.block << " is out of range (" << fat[p.block] << ")\n";
+            break;
+        case BAD_RESERVED:
+            std::cout << "reserved block " << p.block << " is not marked in use\n";
+            break;
+        case CYCLE:
+            std::cout << p.path << ": chain loops back to block " << p.block << " after block " << p.prev << "\n";
+            break;
+        case CROSS_LINK:
+            std::cout << p.path << ": block " << p.block << " is also used by " << chain_path(p.other) << "\n";
+            break;
+        case FREE_IN_CHAIN:
+            std::cout << p.path << ": block " << p.block << " is marked free\n";
+            break;
+        case BAD_LINK:
+            std::cout << p.path << ": chain runs into reserved block " << p.block << "\n";
+            break;
+        case BAD_SIZE:
+            std::cout << p.path << ": size " << p.size << " does not fit a chain of " << p.blocks << " blocks\n";
+            break;
+        case BAD_FIRST:
+            std::cout << p.path << ": first block " << p.block << " is not a data block\n";
+            break;
+        case BAD_ENTRY:
+            std::cout << p.path << ": bad entry in slot " << p.ref.slot << " of block " << p.block << "\n";
+            break;
+        case DIR_LINKED_TWICE:
+            std::cout << p.path << ": directory is linked more than once\n";
+            break;
+        case BAD_NODE:
+            std::cout << p.path << ": block " << p.block << " is not a B+-tree node\n";
+            break;
+        case LEAK: {
+            // runs of leaked blocks are printed together
+            unsigned k = i;
+            while (k + 1 < problems.size() && problems[k + 1].kind == LEAK &&
+                   problems[k + 1].block == problems[k].block + 1)
+                k++;
+            if (k == i)
+                std::cout << "block " << p.block << " is in use but not referenced\n";
+            else
+                std::cout << "blocks " << p.block << "-" << problems[k].block << " are in use but not referenced\n";
+            i = k;
+            break;
+        }
+        }
+    }
+}
+
+void
+Checker::print_summary()
+{
+    std::cout << dirs << " directories, " << files << " files, " << used << " of " << no_blocks
+              << " blocks in use\n";
+}
+
+void
+Checker::set_fat(unsigned block, int32_t value)
+{
+    fat[block] = value;
+    fat_dirty.insert(block / FAT_PER_BLOCK);
+}
+
+// a free block for a copy, -1 if the disk is full
+int
+Checker::alloc_block()
+{
+    for (; next_free < no_blocks; next_free++) {
+        if (fat[next_free] == FAT_FREE) {
+            set_fat(next_free, FAT_EOF);
+            return next_free++;
+        }
+    }
+    return -1;
+}
+
+// copies the chain from block on to free blocks, returns the first copy or
+// FAT_EOF if the disk is full
+int
+Checker::clone_tail(int block)
+{
+    int first = FAT_EOF, last = FAT_EOF;
+    uint8_t data[BLOCK_SIZE];
+    // the FAT is repaired already, a loop or a bad link in the shared
+    // chain ends at the length of the disk
+    for (unsigned n = 0; block >= 0 && block < (int)no_blocks && n < no_blocks; n++) {
+        int copy = alloc_block();
+        if (copy < 0)
+            break;
+        if (disk.read(block, data) < 0 || disk.write(copy, data) < 0) {
+            set_fat(copy, FAT_FREE);
+            break;
+        }
+        if (last == FAT_EOF)
+            first = copy;
+        else
+            set_fat(last, copy);
+        last = copy;
+        block = fat[block];
+    }
+    return first;
+}
+
+// points the entry of a problem at first, FAT_EOF for no blocks, and sets
+// its size
+int
+Checker::set_entry(const problem &p, int first, uint32_t size)
+{
+    dir_entry d[geometry::dir_slots];
+    if (disk.read(p.ref.block, (uint8_t*)d) < 0)
+        return -1;
+    d[p.ref.slot].first_blk = first == FAT_EOF ? DIR_NO_BLOCK : first;
+    d[p.ref.slot].size = size;
+    return disk.write(p.ref.block, (uint8_t*)d);
+}
+
+int
+Checker::remove_entry(const problem &p)
+{
+    dir_entry d[geometry::dir_slots];
+    if (disk.read(p.ref.block, (uint8_t*)d) < 0)
+        return -1;
+    if (p.ref.tree)
+        dir_tree_remove(d, p.ref.slot);
+    else
+        std::memset(&d[p.ref.slot], 0, sizeof(dir_entry));
+    return disk.write(p.ref.block, (uint8_t*)d);
+}
+
+// Blocks cut off a chain or an entry are left to the next pass, which finds
+// them leaked and frees them.
+unsigned
+Checker::repair()
+{
+    unsigned fixed = 0;
+    next_free = reserved;
+    // the FAT first, so cross-linked blocks are copied from clean chains
+    for (unsigned i = 0; i < problems.size(); i++) {
+        const problem &p = problems[i];
+        switch (p.kind) {
+        case BAD_FAT_ENTRY:
+        case BAD_RESERVED:
+        case FREE_IN_CHAIN:
+            set_fat(p.block, FAT_EOF);
+            break;
+        case CYCLE:
+        case BAD_LINK:
+            set_fat(p.prev, FAT_EOF);
+            break;
+        case LEAK:
+            set_fat(p.block, FAT_FREE);
+            break;
+        default:
+            continue;
+        }
+        fixed++;
+    }
+
+    std::vector<const problem*> removals;
+    for (unsigned i = 0; i < problems.size(); i++) {
+        const problem &p = problems[i];
+        bool dir = p.path.back() == '/';
+        if (p.kind == CROSS_LINK && p.prev >= 0) {
+            // a file gets its own copy of the shared blocks, a directory
+            // would list the same files twice and is cut instead
+            set_fat(p.prev, dir ? FAT_EOF : clone_tail(p.block));
+        } else if (p.kind == CROSS_LINK && !dir) {
+            dir_entry d[geometry::dir_slots];
+            int copy = clone_tail(p.block);
+            if (copy == FAT_EOF || disk.read(p.ref.block, (uint8_t*)d) < 0) {
+                removals.push_back(&p);
+                continue;
+            }
+            set_entry(p, copy, d[p.ref.slot].size);
+        } else if (p.kind == BAD_SIZE) {
+            unsigned need = (p.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (need > p.blocks) {
+                // the size is cut to what the chain holds
+                dir_entry d[geometry::dir_slots];
+                if (disk.read(p.ref.block, (uint8_t*)d) < 0)
+                    continue;
+                set_entry(p, p.blocks == 0 ? FAT_EOF : (int)d[p.ref.slot].first_blk, p.blocks * BLOCK_SIZE);
+            } else if (need == 0) {
+                set_entry(p, FAT_EOF, 0);
+            } else {
+                set_fat(p.prev, FAT_EOF);
+            }
+        } else if (p.kind == CROSS_LINK || p.kind == BAD_FIRST || p.kind == BAD_ENTRY ||
+                   p.kind == DIR_LINKED_TWICE) {
+            removals.push_back(&p);
+            continue;
+        } else {
+            continue;
+        }
+        fixed++;
+    }
+    // entries of a tree leaf move down when one is removed, the highest
+    // slot of a block goes first
+    std::sort(removals.begin(), removals.end(), [](const problem *a, const problem *b) {
+        return a->ref.block != b->ref.block ? a->ref.block < b->ref.block : a->ref.slot > b->ref.slot;
+    });
+    for (unsigned i = 0; i < removals.size(); i++) {
+        if (removals[i]->ref.block >= 0 && remove_entry(*removals[i]) == 0)
+            fixed++;
+    }
+
+    for (std::set<unsigned>::iterator it = fat_dirty.begin(); it != fat_dirty.end(); ++it)
+        disk.write(FAT_BLOCK + *it, (uint8_t*)&fat[(size_t)*it * FAT_PER_BLOCK]);
+    fat_dirty.clear();
+    disk.sync();
+    return fixed;
+}
+
+int
+main(int argc, char **argv)
+{
+    bool fix = false;
+    unsigned threads = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-r") {
+            fix = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            threads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            std::cout << "Usage: fsck [-r] [-j <threads>]\n";
+            return 4;
+        }
+    }
+    if (threads == 0)
+        threads = 1;
+    if (access(DISKNAME, R_OK | W_OK) != 0) {
+        std::cout << "fsck: can't open " << DISKNAME << "\n";
+        return 4;
+    }
+
+    Disk disk(DISK_PREAD);
+    Checker checker(disk, threads);
+    if (checker.load() < 0)
+        return 4;
+    std::cout << "fsck: checking " << disk.get_no_blocks() << " blocks with " << threads << " threads\n";
+    unsigned found = checker.check();
+    checker.print_problems();
+    if (found > 0)
+        std::cout << found << " problems found\n";
+    unsigned fixed = 0;
+    // a repair can uncover more, e.g. the blocks of a removed entry leak
+    for (int pass = 0; fix && found > 0 && pass < 3; pass++) {
+        fixed += checker.repair();
+        found = checker.check();
+        checker.print_problems();
+    }
+    checker.print_summary();
+    if (found == 0 && fixed == 0) {
+        std::cout << "clean\n";
+        return 0;
+    }
+    if (fix) {
+        std::cout << fixed << " problems repaired\n";
+        if (found > 0)
+            std::cout << found << " problems left\n";
+    }
+    return found > 0 ? 4 : 1;
+}
@@ -0,0 +1,61 @@
+// Mounts the file system on diskfile.bin once and serves it to local
+// clients over a Unix domain socket, see protocol.h. The caches stay warm
+// from one client to the next. SIGINT and SIGTERM stop the server, the
+// file system is synced before it exits.
+//
+// usage: fsserver [-w <workers>] [<socket>]
+//   -w  number of worker threads, the number of cores by default
+//   the socket is SERVER_SOCKET by default
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <csignal>
+#include <cstdlib>
+#include <unistd.h>
+#include "fs.h"
+#include "server.h"
+
+static Server *server = nullptr;
+
+static void
+on_signal(int)
+{
+    if (server != nullptr)
+        server->stop();
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned workers = std::thread::hardware_concurrency();
+    std::string path = SERVER_SOCKET;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-w" && i + 1 < argc) {
+            workers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg[0] != '-' && i == argc - 1) {
+            path = arg;
+        } else {
+            std::cout << "Usage: fsserver [-w <workers>] [<socket>]\n";
+            return 1;
+        }
+    }
+    if (workers == 0)
+        workers = SERVER_DEFAULT_WORKERS;
+
+    FS fs;
+    Server srv(fs, workers);
+    if (srv.listen(path) < 0)
+        return 1;
+    server = &srv;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "fsserver: serving on " << path << " with " << workers << " workers\n";
+    srv.run();
+    server = nullptr;
+    unlink(path.c_str());
+    std::cout << "fsserver: stopping\n";
+    return fs.sync() < 0 ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#include <cstdint>
+#include "direntry.h"
+
+#ifndef __GEOMETRY_H__
+#define __GEOMETRY_H__
+
+// block size of the build, e.g. make GEOMETRY=-DBLOCK_SIZE=1024 for small
+// metadata blocks or 16384 for bulk data. format records it on the disk.
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096
+#endif
+
+// sizes that follow from the block size. They are compile-time constants
+// so loops over a block or a directory have a known trip count. The
+// geometry is one per build, not a parameter of FS or Disk: every layer
+// from the disk up uses it, and format records it so a disk is only
+// mounted by a build with the same one. The FAT entry is always 32 bits,
+// the on-disk format has no other width.
+template <unsigned BlockSize>
+struct fs_geometry {
+    typedef int32_t fat_entry;
+    static constexpr unsigned block_size = BlockSize;
+    static constexpr unsigned fat_entry_size = sizeof(fat_entry);
+    static constexpr unsigned fat_per_block = BlockSize / sizeof(fat_entry);
+    // slots of a directory block
+    static constexpr unsigned dir_slots = BlockSize / sizeof(dir_entry);
+
+    static_assert(BlockSize != 0 && (BlockSize & (BlockSize - 1)) == 0,
+                  "the block size is a power of two");
+    static_assert(BlockSize % sizeof(dir_entry) == 0, "directory blocks hold whole entries");
+    // a B+-tree node is split in two halves of at least two entries
+    static_assert(dir_slots >= 8, "a directory block holds at least 8 entries");
+    // slots are int16_t in the directory index and uint16_t in tree nodes
+    static_assert(dir_slots <= 1024, "a directory block holds at most 1024 entries");
+};
+
+typedef fs_geometry<BLOCK_SIZE> geometry;
+
+#endif // __GEOMETRY_H__
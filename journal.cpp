@@ -0,0 +1,194 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include "journal.h"
+
+Journal::Journal(Disk &disk) : disk(disk), start(0), blocks(0), seq(1), next(0)
+{
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+void
+Journal::setup(unsigned start, unsigned blocks)
+{
+    this->start = start;
+    this->blocks = blocks;
+    next = 0;
+    logged.clear();
+}
+
+// room for a transaction that changes every FAT block besides the
+// directory blocks of a few operations
+unsigned
+Journal::size(unsigned fat_blocks)
+{
+    return JOURNAL_MIN_BLOCKS + 2 * fat_blocks;
+}
+
+// FNV-1a over the home block numbers and the copies, a transaction torn
+// by a crash does not match its commit block
+static uint32_t
+checksum(const unsigned *block_nos, uint8_t *const *blks, unsigned count)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned i = 0; i < count; i++) {
+        uint32_t no = block_nos[i];
+        const uint8_t *p = (const uint8_t*)&no;
+        for (unsigned k = 0; k < sizeof(no); k++)
+            h = (h ^ p[k]) * 16777619u;
+        for (unsigned k = 0; k < BLOCK_SIZE; k++)
+            h = (h ^ blks[i][k]) * 16777619u;
+    }
+    return h;
+}
+
+// number of descriptor blocks of a transaction of count blocks
+static unsigned
+descriptors(unsigned count)
+{
+    return (count + JOURNAL_TAGS - 1) / JOURNAL_TAGS;
+}
+
+int
+Journal::reset()
+{
+    uint8_t block[BLOCK_SIZE] = {0};
+    journal_header h;
+    h.magic = JOURNAL_MAGIC;
+    h.seq = seq;
+    std::memcpy(block, &h, sizeof(h));
+    // old transactions must be gone before new ones take their place
+    if (disk.write(start, block) < 0 || disk.sync() < 0)
+        return -1;
+    next = 0;
+    logged.clear();
+    stats.checkpoints++;
+    return 0;
+}
+
+int
+Journal::write(const unsigned *block_nos, uint8_t **blks, unsigned count)
+{
+    unsigned descs = descriptors(count);
+    unsigned need = descs + count + 1;
+    if (count == 0 || need > blocks - 1)
+        return -1;
+    if (next + need > blocks - 1 && (disk.sync() < 0 || reset() < 0))
+        return -1;
+
+    // descriptors and the commit block, the copies are written from blks
+    std::vector<uint8_t> meta((size_t)(descs + 1) * BLOCK_SIZE, 0);
+    for (unsigned d = 0; d < descs; d++) {
+        uint8_t *blk = &meta[(size_t)d * BLOCK_SIZE];
+        journal_descriptor jd;
+        jd.magic = JOURNAL_DESC_MAGIC;
+        jd.seq = seq;
+        jd.count = count;
+        std::memcpy(blk, &jd, sizeof(jd));
+        for (unsigned i = d * JOURNAL_TAGS; i < count && i < (d + 1) * JOURNAL_TAGS; i++) {
+            uint32_t no = block_nos[i];
+            std::memcpy(blk + sizeof(jd) + (i - d * JOURNAL_TAGS) * sizeof(no), &no, sizeof(no));
+        }
+    }
+    journal_commit jc;
+    jc.magic = JOURNAL_COMMIT_MAGIC;
+    jc.seq = seq;
+    jc.count = count;
+    jc.checksum = checksum(block_nos, blks, count);
+    std::memcpy(&meta[(size_t)descs * BLOCK_SIZE], &jc, sizeof(jc));
+
+    std::vector<unsigned> nos(need);
+    std::vector<uint8_t*> data(need);
+    for (unsigned i = 0; i < need; i++)
+        nos[i] = start + 1 + next + i;
+    for (unsigned d = 0; d < descs; d++)
+        data[d] = &meta[(size_t)d * BLOCK_SIZE];
+    for (unsigned i = 0; i < count; i++)
+        data[descs + i] = blks[i];
+    data[need - 1] = &meta[(size_t)descs * BLOCK_SIZE];
+    if (disk.writev_blocks(&nos[0], &data[0], need) < 0 || disk.sync() < 0)
+        return -1;
+
+    for (unsigned i = 0; i < count; i++)
+        logged.insert(block_nos[i]);
+    seq++;
+    next += need;
+    stats.commits++;
+    stats.blocks += need;
+    return 0;
+}
+
+int
+Journal::replay(BlockCache &cache)
+{
+    uint8_t block[BLOCK_SIZE];
+    journal_header h;
+    if (blocks < 2 || disk.read(start, block) < 0)
+        return -1;
+    std::memcpy(&h, block, sizeof(h));
+    if (h.magic != JOURNAL_MAGIC)
+        return -1;
+    seq = h.seq;
+    next = 0;
+    logged.clear();
+
+    int applied = 0;
+    std::vector<uint8_t> buf;
+    while (next + 3 <= blocks - 1) {
+        journal_descriptor jd;
+        if (disk.read(start + 1 + next, block) < 0)
+            return -1;
+        std::memcpy(&jd, block, sizeof(jd));
+        if (jd.magic != JOURNAL_DESC_MAGIC || jd.seq != seq || jd.count == 0)
+            break;
+        unsigned descs = descriptors(jd.count);
+        unsigned need = descs + jd.count + 1;
+        if (next + need > blocks - 1)
+            break;
+
+        buf.resize((size_t)need * BLOCK_SIZE);
+        std::vector<unsigned> nos(need);
+        std::vector<uint8_t*> data(need);
+        for (unsigned i = 0; i < need; i++) {
+            nos[i] = start + 1 + next + i;
+            data[i] = &buf[(size_t)i * BLOCK_SIZE];
+        }
+        if (disk.readv_blocks(&nos[0], &data[0], need) < 0)
+            return -1;
+
+        std::vector<unsigned> homes(jd.count);
+        bool valid = true;
+        for (unsigned d = 0; d < descs && valid; d++) {
+            journal_descriptor dd;
+            std::memcpy(&dd, data[d], sizeof(dd));
+            valid = dd.magic == JOURNAL_DESC_MAGIC && dd.seq == seq && dd.count == jd.count;
+            for (unsigned i = d * JOURNAL_TAGS; valid && i < jd.count && i < (d + 1) * JOURNAL_TAGS; i++) {
+                uint32_t no;
+                std::memcpy(&no, data[d] + sizeof(dd) + (i - d * JOURNAL_TAGS) * sizeof(no), sizeof(no));
+                homes[i] = no;
+                valid = no < disk.get_no_blocks();
+            }
+        }
+        journal_commit jc;
+        std::memcpy(&jc, data[need - 1], sizeof(jc));
+        if (!valid || jc.magic != JOURNAL_COMMIT_MAGIC || jc.seq != seq || jc.count != jd.count ||
+            jc.checksum != checksum(&homes[0], &data[descs], jd.count))
+            break;
+
+        for (unsigned i = 0; i < jd.count; i++) {
+            if (cache.write(homes[i], data[descs + i]) < 0)
+                return -1;
+        }
+        applied++;
+        seq++;
+        next += need;
+    }
+    if (applied == 0) {
+        next = 0;
+        return 0;
+    }
+    if (cache.flush() < 0 || disk.sync() < 0 || reset() < 0)
+        return -1;
+    stats.replayed += applied;
+    return applied;
+}
@@ -0,0 +1,88 @@
+#include <iostream>
+#include <cstdint>
+#include <set>
+#include "disk.h"
+#include "cache.h"
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+// The metadata journal takes a run of reserved blocks after the FAT. Its
+// first block is a header holding the sequence number of the first
+// transaction to replay, the transactions follow it. A transaction is
+// written as one or more descriptor blocks listing the home blocks, copies
+// of those blocks and a commit block with a checksum over the copies. It
+// counts once the commit block is on the disk.
+#define JOURNAL_MAGIC 0x4c4e524a       // "JRNL"
+#define JOURNAL_DESC_MAGIC 0x4353444a  // "JDSC"
+#define JOURNAL_COMMIT_MAGIC 0x544d434a // "JCMT"
+
+// blocks of the journal besides room for two copies of the FAT
+#define JOURNAL_MIN_BLOCKS 64
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t seq;   // first transaction to replay
+};
+
+// starts every descriptor block, the home block numbers follow it
+struct journal_descriptor {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count; // blocks of the whole transaction
+};
+
+struct journal_commit {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t checksum;
+};
+
+// home block numbers per descriptor block
+#define JOURNAL_TAGS ((BLOCK_SIZE - sizeof(journal_descriptor)) / sizeof(uint32_t))
+
+struct journal_stats {
+    uint64_t commits;      // transactions written
+    uint64_t blocks;       // journal blocks written for them
+    uint64_t checkpoints;  // times the journal was emptied
+    uint64_t replayed;     // transactions applied on mount
+};
+
+// writes transactions to the journal and replays them. The blocks of a
+// transaction are only written home by the caller once it is committed.
+class Journal {
+private:
+    Disk &disk;
+    unsigned start;   // header block
+    unsigned blocks;  // including the header
+    uint32_t seq;     // of the next transaction
+    unsigned next;    // journal block the next transaction starts at, after the header
+    // home blocks of the transactions written since the last reset
+    std::set<unsigned> logged;
+    journal_stats stats;
+public:
+    Journal(Disk &disk);
+    // where the journal lives, the blocks are reserved in the FAT
+    void setup(unsigned start, unsigned blocks);
+    // number of journal blocks a journal of the file system takes
+    static unsigned size(unsigned fat_blocks);
+    // empties the journal, nothing written before is replayed. Every block
+    // of the transactions written so far must be home and durable.
+    int reset();
+    // writes a transaction of count blocks, blks[i] to go to block_nos[i],
+    // and makes it durable. A full journal is reset first, so the blocks
+    // of earlier transactions must have been written home. Returns -1 if
+    // the transaction can never fit.
+    int write(const unsigned *block_nos, uint8_t **blks, unsigned count);
+    // applies the committed transactions through cache, makes them
+    // durable and empties the journal. Returns the number applied or -1 if
+    // there is no journal.
+    int replay(BlockCache &cache);
+    // true if block is in a transaction written since the last reset, a
+    // replay would write it again
+    bool holds(unsigned block) { return logged.count(block) != 0; }
+    journal_stats get_stats() { return stats; }
+};
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <cstring>
+#include "pathcache.h"
+
+PathCache::PathCache(unsigned capacity) : capacity(capacity)
+{
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+void
+PathCache::watch(const std::vector<int> &blocks)
+{
+    for (unsigned k = 0; k < blocks.size(); k++)
+        watched[blocks[k]]++;
+}
+
+void
+PathCache::unwatch(const std::vector<int> &blocks)
+{
+    for (unsigned k = 0; k < blocks.size(); k++) {
+        std::unordered_map<int, unsigned>::iterator w = watched.find(blocks[k]);
+        if (w != watched.end() && --w->second == 0)
+            watched.erase(w);
+    }
+}
+
+void
+PathCache::erase(std::unordered_map<std::string, cached>::iterator it)
+{
+    unwatch(it->second.entry.dirs);
+    unwatch(it->second.entry.blocks);
+    lru.erase(it->second.lru_pos);
+    paths.erase(it);
+}
+
+// returns the entry for key, nullptr if it is not cached
+const path_entry *
+PathCache::get(const std::string &key)
+{
+    std::unordered_map<std::string, cached>::iterator it = paths.find(key);
+    if (it == paths.end()) {
+        stats.misses++;
+        return nullptr;
+    }
+    stats.hits++;
+    if (it->second.entry.index < 0)
+        stats.negative_hits++;
+    lru.splice(lru.begin(), lru, it->second.lru_pos);
+    return &it->second.entry;
+}
+
+const path_entry *
+PathCache::put(const std::string &key, const path_entry &entry)
+{
+    std::unordered_map<std::string, cached>::iterator it = paths.find(key);
+    if (it != paths.end())
+        erase(it);
+    if (paths.size() >= capacity && !lru.empty())
+        erase(paths.find(lru.back()));
+    cached &c = paths[key];
+    c.entry = entry;
+    watch(entry.dirs);
+    watch(entry.blocks);
+    lru.push_front(key);
+    c.lru_pos = lru.begin();
+    return &c.entry;
+}
+
+// the entry named name in directory block block was added, removed or
+// changed, every path that looked for name in block is dropped
+void
+PathCache::invalidate(int block, const char *name)
+{
+    if (!watches(block))
+        return;
+    std::unordered_map<std::string, cached>::iterator it = paths.begin();
+    while (it != paths.end()) {
+        const path_entry &e = it->second.entry;
+        bool stale = false;
+        for (unsigned k = 0; k < e.blocks.size() && !stale; k++)
+            stale = e.blocks[k] == block && e.names[k] == name;
+        if (stale) {
+            stats.invalidations++;
+            erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// block is no longer a directory, or the directory starting at it grew
+void
+PathCache::drop(int block)
+{
+    if (!watches(block))
+        return;
+    std::unordered_map<std::string, cached>::iterator it = paths.begin();
+    while (it != paths.end()) {
+        const path_entry &e = it->second.entry;
+        bool stale = false;
+        for (unsigned k = 0; k < e.blocks.size() && !stale; k++)
+            stale = e.blocks[k] == block;
+        for (unsigned k = 0; k < e.dirs.size() && !stale; k++)
+            stale = e.dirs[k] == block;
+        if (stale) {
+            stats.invalidations++;
+            erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void
+PathCache::clear()
+{
+    paths.clear();
+    lru.clear();
+    watched.clear();
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#ifndef __PATHCACHE_H__
+#define __PATHCACHE_H__
+
+#define PATH_CACHE_CAPACITY 256
+
+// outcome of resolving a path one component at a time. dirs[k] is the
+// first block of the directory names[k] was looked up in and blocks[k] the
+// block of it that was read. The walk stops at the last component, at a
+// missing one (index -1, a negative entry) or at one that is not a
+// directory.
+struct path_entry {
+    std::vector<int> dirs;
+    std::vector<int> blocks;
+    std::vector<std::string> names;
+    int index;          // slot of the last name looked up, -1 if missing
+    uint32_t first_blk; // of that entry
+    uint8_t type;
+};
+
+struct path_cache_stats {
+    uint64_t hits;
+    uint64_t negative_hits; // hits on a path known not to exist
+    uint64_t misses;
+    uint64_t invalidations; // entries dropped because a directory changed
+};
+
+// remembers resolved paths, keyed by the block the walk starts from and
+// the normalized path. An entry stays valid until one of the directory
+// slots it looked at changes, see invalidate().
+class PathCache {
+private:
+    struct cached {
+        path_entry entry;
+        std::list<std::string>::iterator lru_pos;
+    };
+    unsigned capacity;
+    std::unordered_map<std::string, cached> paths;
+    // keys, most recently used first
+    std::list<std::string> lru;
+    // number of entries that looked at each directory block
+    std::unordered_map<int, unsigned> watched;
+    void watch(const std::vector<int> &blocks);
+    void unwatch(const std::vector<int> &blocks);
+    path_cache_stats stats;
+    void erase(std::unordered_map<std::string, cached>::iterator it);
+public:
+    PathCache(unsigned capacity = PATH_CACHE_CAPACITY);
+    // returns the entry for key, nullptr if it is not cached. The pointer
+    // is valid until the cache is changed.
+    const path_entry *get(const std::string &key);
+    const path_entry *put(const std::string &key, const path_entry &entry);
+    // true if some entry looked at directory block block
+    bool watches(int block) { return watched.count(block) != 0; }
+    // the entry named name in directory block block was added, removed or
+    // changed
+    void invalidate(int block, const char *name);
+    // block is no longer a directory, or the directory starting at it grew
+    // and its names may have moved to other blocks
+    void drop(int block);
+    void clear();
+    path_cache_stats get_stats() { return stats; }
+};
+
+#endif // __PATHCACHE_H__
@@ -0,0 +1,47 @@
+#include <cstdint>
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+// The messages between fsserver and its clients over a Unix domain
+// socket. A client sends a request and waits for its reply; it may send
+// several before reading the replies, they come back in order. Integers
+// are in the byte order of the machine, both ends run on it.
+
+#define SERVER_SOCKET "fs.sock"
+// longest message after its header, a read or write moves at most this
+// many bytes
+#define SERVER_MAX_MESSAGE (1 << 20)
+
+#define OP_CREATE 1 // path, data: a new file holding data, in one operation
+#define OP_READ 2   // path: up to count bytes from offset
+#define OP_WRITE 3  // path, data: writes data at offset
+#define OP_LS 4     // path: the entries of a directory, "" for the current one
+#define OP_MV 5     // path, destination path
+#define OP_RM 6     // path
+#define OP_STAT 7   // path: the entry of a file or directory
+#define OP_MKDIR 8  // path
+#define OP_CD 9     // path: the current directory of the connection
+
+// followed by length bytes: path_len bytes of path, then the data or the
+// destination path
+struct request_header {
+    uint32_t length;
+    uint16_t op;
+    uint16_t path_len;
+    // 32 bits like the size of a dir_entry and the offsets of FS::pread
+    // and FS::pwrite: no file grows past 4 GiB, however large the disk
+    uint32_t offset;
+    uint32_t count;     // bytes to read
+};
+
+// followed by length bytes. On success status is 0, or the number of
+// bytes for read and write, and the data are the bytes read, the entries
+// listed (dir_entry each) or the entry of stat. On failure status is -1
+// and the data the message the shell would print.
+struct reply_header {
+    uint32_t length;
+    int32_t status;
+};
+
+#endif // __PROTOCOL_H__
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <cstring>
+#include "readahead.h"
+
+ReadAhead::ReadAhead() : streams(READAHEAD_STREAMS), clock(0)
+{
+    clear();
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+// a read of len bytes at offset of the chain starting at first. Returns how
+// many blocks to read ahead, from index *from in the chain, or 0.
+unsigned
+ReadAhead::access(int first, uint32_t offset, uint32_t len, unsigned no_blocks, unsigned *from)
+{
+    clock++;
+    stream *s = nullptr;
+    stream *oldest = &streams[0];
+    for (unsigned i = 0; i < streams.size(); i++) {
+        if (streams[i].used != 0 && streams[i].first == first) {
+            s = &streams[i];
+            break;
+        }
+        if (streams[i].used < oldest->used)
+            oldest = &streams[i];
+    }
+    uint32_t end_offset = offset + len;
+    if (s == nullptr || offset != s->next) {
+        // a new chain takes the slot of the one read longest ago
+        if (s == nullptr)
+            s = oldest;
+        s->first = first;
+        s->next = end_offset;
+        s->window = 0;
+        s->end = 0;
+        s->used = clock;
+        stats.random++;
+        return 0;
+    }
+    s->next = end_offset;
+    s->used = clock;
+    stats.sequential++;
+
+    // the window moves on once the reader is half way through it
+    unsigned next_block = (end_offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (s->window == 0)
+        s->window = READAHEAD_MIN;
+    else if (s->end > next_block + s->window / 2)
+        return 0;
+    else
+        s->window = std::min(s->window * 2, (unsigned)READAHEAD_MAX);
+    *from = std::max(s->end, next_block);
+    s->end = std::min(next_block + s->window, no_blocks);
+    if (*from >= s->end)
+        return 0;
+    stats.windows++;
+    stats.blocks += s->end - *from;
+    return s->end - *from;
+}
+
+void
+ReadAhead::clear()
+{
+    for (unsigned i = 0; i < streams.size(); i++) {
+        streams[i].first = 0;
+        streams[i].used = 0;
+    }
+}
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+// chains whose reads are followed at the same time
+#define READAHEAD_STREAMS 16
+// blocks read ahead of a chain once its reads are sequential. The window
+// doubles each time the reader is half way through it, up to the max.
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+
+struct readahead_stats {
+    uint64_t sequential; // reads that started where the last one of the chain ended
+    uint64_t random;     // reads that did not
+    uint64_t windows;    // read-aheads started
+    uint64_t blocks;     // blocks they asked for
+};
+
+// Decides what to read ahead of the readers of FAT chains. A chain is
+// known by its first block. A read that starts where the last read of the
+// chain ended is sequential, the first one starts a window of
+// READAHEAD_MIN blocks past it. The window moves on and grows while the
+// reads stay sequential, any other read closes it.
+class ReadAhead {
+private:
+    struct stream {
+        int first;       // first block of the chain
+        uint32_t next;   // offset the next sequential read starts at
+        unsigned window; // 0 until the reads are sequential
+        unsigned end;    // index in the chain of the first block not read ahead
+        uint64_t used;   // 0 for a free slot, else when it was last read
+    };
+    std::vector<stream> streams;
+    uint64_t clock;
+    readahead_stats stats;
+public:
+    ReadAhead();
+    // a read of len bytes at offset of the chain starting at first, which
+    // has no_blocks blocks. Returns how many blocks to read ahead, from
+    // index *from in the chain, or 0.
+    unsigned access(int first, uint32_t offset, uint32_t len, unsigned no_blocks, unsigned *from);
+    void clear();
+    readahead_stats get_stats() { return stats; }
+};
+
+#endif // __READAHEAD_H__
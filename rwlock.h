@@ -0,0 +1,48 @@
+#include <pthread.h>
+
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+// a lock held either shared by any number of threads or exclusive by one,
+// C++11 has none. A waiting writer keeps new readers out so a stream of
+// readers can't starve it, a thread must not take it shared twice.
+class RWLock {
+private:
+    pthread_rwlock_t rw;
+public:
+    RWLock()
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&rw, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+    ~RWLock() { pthread_rwlock_destroy(&rw); }
+    RWLock(const RWLock &) = delete;
+    RWLock &operator=(const RWLock &) = delete;
+    void lock_shared() { pthread_rwlock_rdlock(&rw); }
+    void lock() { pthread_rwlock_wrlock(&rw); }
+    void unlock() { pthread_rwlock_unlock(&rw); }
+};
+
+// holds an RWLock for its scope, shared or exclusive
+class RWGuard {
+private:
+    RWLock &rw;
+public:
+    RWGuard(RWLock &rw, bool exclusive) : rw(rw)
+    {
+        if (exclusive)
+            rw.lock();
+        else
+            rw.lock_shared();
+    }
+    ~RWGuard() { rw.unlock(); }
+    RWGuard(const RWGuard &) = delete;
+    RWGuard &operator=(const RWGuard &) = delete;
+};
+
+#endif // __RWLOCK_H__
@@ -0,0 +1,399 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+
+Server::Server(FS &fs, unsigned workers) : fs(fs), no_workers(workers > 0 ? workers : 1),
+    listen_fd(-1), epoll_fd(-1), wake_fd(-1), stopping(false)
+{
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+Server::~Server()
+{
+    if (listen_fd >= 0)
+        close(listen_fd);
+    if (wake_fd >= 0)
+        close(wake_fd);
+}
+
+// binds the socket at path, a file left there by an earlier server is
+// removed first
+int
+Server::listen(const std::string &path)
+{
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        std::cout << "Bad socket path " << path << "\n";
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        std::cout << "Can't create a socket: " << std::strerror(errno) << "\n";
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        ::listen(listen_fd, SERVER_BACKLOG) < 0) {
+        std::cout << "Can't listen on " << path << ": " << std::strerror(errno) << "\n";
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// serves clients until stop() is called. The loop only moves bytes, the
+// requests run on the workers.
+int
+Server::run()
+{
+    if (listen_fd < 0 || wake_fd < 0)
+        return -1;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return -1;
+    // the listening socket and the eventfd are told apart from the
+    // connections by their data
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    stopping = false;
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < no_workers; i++)
+        workers.push_back(std::thread(&Server::worker, this));
+
+    struct epoll_event events[64];
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == nullptr) {
+                accept_all();
+            } else if (ptr == &wake_fd) {
+                running = false;
+            } else {
+                connection *c = (connection*)ptr;
+                std::unique_lock<std::mutex> guard(c->lock);
+                bool open = !c->broken &&
+                    (c->out_pos < c->out.size() ? handle_output(c) : handle_input(c));
+                guard.unlock();
+                if (!open)
+                    close_conn(c);
+            }
+        }
+    }
+
+    // the workers finish what is queued, the connections are closed after
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        stopping = true;
+    }
+    queue_cond.notify_all();
+    for (unsigned i = 0; i < workers.size(); i++)
+        workers[i].join();
+    while (!conns.empty())
+        close_conn(*conns.begin());
+    close(epoll_fd);
+    epoll_fd = -1;
+    uint64_t count;
+    while (read(wake_fd, &count, sizeof(count)) > 0)
+        ;
+    return 0;
+}
+
+// makes run() return, an eventfd write is safe in a signal handler
+void
+Server::stop()
+{
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+void
+Server::accept_all()
+{
+    for (;;) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        connection *c = new connection(fd, fs);
+        conns.insert(c);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// hands the connection back to the loop, waiting for events
+void
+Server::arm(connection *c, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void
+Server::close_conn(connection *c)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    conns.erase(c);
+    delete c;
+}
+
+// false for a header no request can have, the connection is closed then
+bool
+Server::valid_header(const request_header &req)
+{
+    return req.length <= SERVER_MAX_MESSAGE && req.path_len <= req.length;
+}
+
+// true if the whole of the first request has been received
+bool
+Server::has_request(const connection *c)
+{
+    if (c->in.size() < sizeof(request_header))
+        return false;
+    request_header req;
+    std::memcpy(&req, &c->in[0], sizeof(req));
+    return c->in.size() - sizeof(req) >= req.length;
+}
+
+// reads what has arrived, the requests go to the workers once one is
+// complete. The rest stays in the socket until they have run. Returns
+// false if the connection is to be closed.
+bool
+Server::handle_input(connection *c)
+{
+    uint8_t buf[64 * 1024];
+    while (!has_request(c) && c->in.size() < SERVER_MAX_BUFFER) {
+        size_t room = std::min(sizeof(buf), SERVER_MAX_BUFFER - c->in.size());
+        ssize_t n = read(c->fd, buf, room);
+        if (n > 0) {
+            c->in.insert(c->in.end(), buf, buf + n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        // the client is gone
+        return false;
+    }
+    if (c->in.size() >= sizeof(request_header)) {
+        request_header req;
+        std::memcpy(&req, &c->in[0], sizeof(req));
+        if (!valid_header(req))
+            return false;
+    }
+    if (has_request(c))
+        dispatch(c);
+    else
+        arm(c, EPOLLIN);
+    return true;
+}
+
+// sends the rest of a reply the worker could not. Returns false if the
+// connection is to be closed.
+bool
+Server::handle_output(connection *c)
+{
+    int res = send_out(c);
+    if (res < 0)
+        return false;
+    if (res > 0)
+        arm(c, EPOLLOUT);
+    else if (has_request(c))
+        dispatch(c);
+    else
+        arm(c, EPOLLIN);
+    return true;
+}
+
+// sends as much of out as the socket takes. Returns 0 when all of it has
+// been sent, 1 if the rest has to wait and -1 on errors.
+int
+Server::send_out(connection *c)
+{
+    while (c->out_pos < c->out.size()) {
+        ssize_t n = send(c->fd, &c->out[c->out_pos], c->out.size() - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        c->out_pos += n;
+    }
+    c->out.clear();
+    c->out_pos = 0;
+    return 0;
+}
+
+void
+Server::dispatch(connection *c)
+{
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        queue.push_back(c);
+    }
+    queue_cond.notify_one();
+}
+
+void
+Server::worker()
+{
+    // create gets no content from the input, the messages of the
+    // operations are collected for the replies
+    std::istringstream no_input;
+    std::ostringstream messages;
+    FS::redirect(&no_input, &messages);
+    for (;;) {
+        connection *c;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            while (queue.empty() && !stopping)
+                queue_cond.wait(guard);
+            if (queue.empty())
+                break;
+            c = queue.front();
+            queue.pop_front();
+        }
+        serve(c, messages);
+    }
+    FS::redirect(nullptr, nullptr);
+}
+
+// runs the requests received on the connection and sends the replies.
+// Requests sent together are answered together, until SERVER_MAX_BUFFER
+// bytes of replies wait. A bad header after the first one marks the
+// connection broken, the loop closes it after the replies before it have
+// been tried.
+void
+Server::serve(connection *c, std::ostringstream &messages)
+{
+    std::lock_guard<std::mutex> guard(c->lock);
+    size_t pos = 0;
+    while (c->in.size() - pos >= sizeof(request_header) && c->out.size() < SERVER_MAX_BUFFER) {
+        request_header req;
+        std::memcpy(&req, &c->in[pos], sizeof(req));
+        if (!valid_header(req)) {
+            c->broken = true;
+            pos = c->in.size();
+            break;
+        }
+        if (c->in.size() - pos - sizeof(req) < req.length)
+            break;
+        messages.str("");
+        reply_header reply;
+        size_t start = c->out.size();
+        c->out.resize(start + sizeof(reply));
+        reply.status = execute(c->session, req, &c->in[pos + sizeof(req)], messages, &c->out);
+        if (reply.status < 0) {
+            std::string text = messages.str();
+            c->out.resize(start + sizeof(reply));
+            c->out.insert(c->out.end(), text.begin(), text.end());
+        }
+        reply.length = c->out.size() - start - sizeof(reply);
+        std::memcpy(&c->out[start], &reply, sizeof(reply));
+        pos += sizeof(req) + req.length;
+    }
+    c->in.erase(c->in.begin(), c->in.begin() + pos);
+
+    // the loop waits for the rest if the socket is full, and sees the
+    // error if it failed. Shutting a broken connection down wakes the loop
+    // to close it. Requests held back by the replies go to the end of the
+    // queue.
+    int res = send_out(c);
+    if (c->broken)
+        shutdown(c->fd, SHUT_RDWR);
+    if (res != 0)
+        arm(c, EPOLLOUT);
+    else if (has_request(c))
+        dispatch(c);
+    else
+        arm(c, EPOLLIN);
+}
+
+// runs one request, its data are appended to out. Returns the status of
+// the reply, on failure the messages are sent instead.
+int
+Server::execute(Session &session, const request_header &req, const uint8_t *arg,
+                std::ostringstream &messages, std::vector<uint8_t> *out)
+{
+    std::string path((const char*)arg, req.path_len);
+    const uint8_t *data = arg + req.path_len;
+    uint32_t len = req.length - req.path_len;
+    int res;
+    switch (req.op) {
+    case OP_CREATE:
+        return fs.create(session, path, data, len);
+    case OP_READ: {
+        uint32_t count = std::min<uint32_t>(req.count, SERVER_MAX_MESSAGE);
+        size_t start = out->size();
+        out->resize(start + count);
+        res = fs.pread(session, path, req.offset, count, count > 0 ? &(*out)[start] : nullptr);
+        out->resize(start + (res > 0 ? res : 0));
+        return res;
+    }
+    case OP_WRITE:
+        return fs.pwrite(session, path, req.offset, len, data);
+    case OP_LS: {
+        std::vector<dir_entry> entries;
+        if (fs.readdir(session, path, &entries) < 0)
+            return -1;
+        const uint8_t *p = (const uint8_t*)entries.data();
+        out->insert(out->end(), p, p + entries.size() * sizeof(dir_entry));
+        return 0;
+    }
+    case OP_STAT: {
+        dir_entry entry;
+        if (fs.stat(session, path, &entry) < 0)
+            return -1;
+        const uint8_t *p = (const uint8_t*)&entry;
+        out->insert(out->end(), p, p + sizeof(entry));
+        return 0;
+    }
+    case OP_MV:
+        fs.mv(session, path, std::string((const char*)data, len));
+        break;
+    case OP_RM:
+        fs.rm(session, path);
+        break;
+    case OP_MKDIR:
+        fs.mkdir(session, path);
+        break;
+    case OP_CD:
+        fs.cd(session, path);
+        break;
+    default:
+        messages << "Unknown operation " << req.op << "\n";
+        break;
+    }
+    // these print nothing unless they fail
+    return messages.str().empty() ? 0 : -1;
+}
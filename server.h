@@ -0,0 +1,86 @@
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "fs.h"
+#include "protocol.h"
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#define SERVER_DEFAULT_WORKERS 4
+#define SERVER_BACKLOG 128
+// bytes of requests and of replies a connection holds at most, beyond the
+// last one. Room for one request of the longest length.
+#define SERVER_MAX_BUFFER (2 * (SERVER_MAX_MESSAGE + sizeof(request_header)))
+
+// serves the requests of protocol.h for one mounted FS on a Unix domain
+// socket. An epoll loop accepts connections and reads requests, a pool of
+// workers runs them and sends the replies. A connection belongs either to
+// the loop or to one worker: its socket is armed with EPOLLONESHOT and
+// armed again when it is handed back, so its requests run in order. Each
+// connection is a Session with a current directory of its own.
+//
+// A connection is not read from while it has a complete request to run or
+// replies to send, and runs no more requests once SERVER_MAX_BUFFER bytes
+// of replies wait. A client that sends faster than it reads fills its
+// socket instead of the memory of the server.
+class Server {
+private:
+    struct connection {
+        int fd;
+        Session session;
+        std::vector<uint8_t> in;  // received bytes not handled yet
+        std::vector<uint8_t> out; // reply bytes not sent yet
+        size_t out_pos;
+        // held by the thread handling the connection. Passing it on through
+        // epoll orders the accesses as well, but only the kernel knows.
+        std::mutex lock;
+        // a request header was bad, the loop closes the connection
+        bool broken;
+        connection(int fd, FS &fs) : fd(fd), session(fs), out_pos(0), broken(false) {}
+    };
+    FS &fs;
+    unsigned no_workers;
+    int listen_fd;
+    int epoll_fd;
+    // an eventfd, stop() writes to it to end the loop
+    int wake_fd;
+    // connections with requests to run
+    std::deque<connection*> queue;
+    std::mutex queue_lock;
+    std::condition_variable queue_cond;
+    bool stopping;
+    // open connections, only the loop changes it
+    std::set<connection*> conns;
+
+    void accept_all();
+    bool handle_input(connection *c);
+    bool handle_output(connection *c);
+    static bool valid_header(const request_header &req);
+    bool has_request(const connection *c);
+    void dispatch(connection *c);
+    void arm(connection *c, uint32_t events);
+    void close_conn(connection *c);
+    int send_out(connection *c);
+    void worker();
+    void serve(connection *c, std::ostringstream &messages);
+    int execute(Session &session, const request_header &req, const uint8_t *arg,
+                std::ostringstream &messages, std::vector<uint8_t> *out);
+public:
+    Server(FS &fs, unsigned workers = SERVER_DEFAULT_WORKERS);
+    ~Server();
+    // binds the socket at path, a file left there by an earlier server is
+    // removed first
+    int listen(const std::string &path);
+    // serves clients until stop() is called
+    int run();
+    // makes run() return, safe to call from a signal handler
+    void stop();
+};
+
+#endif // __SERVER_H__
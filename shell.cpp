@@ -2,6 +2,7 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <cstdlib>
 #include "shell.h"
 #include "fs.h"
 
@@ -10,6 +11,7 @@ std::string commands_str[] = {
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
     "chmod",
+    "sync", "stats",
     "help", "quit"
 };
 
@@ -66,12 +68,12 @@ Shell::run()
         }
 
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: format [<blocks>]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(cmd_line.size() == 2 ? std::strtoul(cmd_line[1].c_str(), nullptr, 10) : 0);
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
@@ -107,12 +109,35 @@ Shell::run()
         }
 
         else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
+            // ls [<dirpath>] [-p <prefix>] [-a <after>] [-n <count>] lists
+            // in name order, a page at a time with -a and -n
+            std::string dirpath, prefix, after;
+            unsigned count = 0;
+            bool usage = false;
+            for (unsigned i = 1; i < cmd_line.size() && !usage; i++) {
+                bool opt = cmd_line[i] == "-p" || cmd_line[i] == "-a" || cmd_line[i] == "-n";
+                if (opt && i + 1 == cmd_line.size())
+                    usage = true;
+                else if (cmd_line[i] == "-p")
+                    prefix = cmd_line[++i];
+                else if (cmd_line[i] == "-a")
+                    after = cmd_line[++i];
+                else if (cmd_line[i] == "-n")
+                    count = std::strtoul(cmd_line[++i].c_str(), nullptr, 10);
+                else if (dirpath.empty())
+                    dirpath = cmd_line[i];
+                else
+                    usage = true;
+            }
+            if (usage) {
+                std::cout << "Usage: ls [<dirpath>] [-p <prefix>] [-a <after>] [-n <count>]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.ls();
+            if (cmd_line.size() == 1)
+                ret_val = filesystem.ls();
+            else
+                ret_val = filesystem.list(dirpath, prefix, after, count);
             if (ret_val) {
                 std::cout << "Error: ls failed, error code " << ret_val << std::endl;
             }
@@ -178,13 +203,15 @@ Shell::run()
         }
 
         else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
+            // -b makes a B-tree directory
+            bool btree = cmd_line.size() == 3 && cmd_line[1] == "-b";
+            if (cmd_line.size() != 2 && !btree) {
+                std::cout << "Usage: mkdir [-b] <dirpath>\n";
                 continue;
             }
-            arg1 = cmd_line[1];
+            arg1 = cmd_line.back();
             // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
+            ret_val = filesystem.mkdir(arg1, btree ? DIR_BTREE : DIR_HASHED);
             if (ret_val) {
                 std::cout << "Error: mkdir " << arg1;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -232,12 +259,38 @@ Shell::run()
             }
         }
 
-        else if (cmd == "quit")
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "stats") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: stats\n";
+                continue;
+            }
+            ret_val = filesystem.stats();
+            if (ret_val) {
+                std::cout << "Error: stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "quit") {
+            // make sure nothing is left in the cache before exiting
+            filesystem.sync();
             running = false;
+        }
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, stats, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -246,7 +299,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, stats, help, quit\n";
         }
     }
 }
@@ -0,0 +1,144 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// runs fsck on the disk file, its report goes to the standard output
+static void
+run_fsck(const std::string &args)
+{
+    std::cout.flush();
+    std::string cmd = "./fsck" + args;
+    int status = system(cmd.c_str());
+    std::cout << "fsck exit code " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << std::endl;
+}
+
+void
+Shell::run()
+{
+    std::string arg1;
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Journal replay ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+
+    // the child stops dead after its last commit, before the checkpoint
+    // writes the metadata home, like a crash. Only the journal has it.
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::cout << "child: create f1, mkdir d1, cp f1 d1/f2, append f1 d1/f2..." << std::endl;
+        fw = open("input1.txt", O_RDONLY);
+        dup2(fw, 0);
+        filesystem.create("f1");
+        close(fw);
+        filesystem.mkdir("d1");
+        filesystem.cp("f1", "d1/f2");
+        filesystem.append("f1", "d1/f2");
+        std::cout << "child: mkdir d2, rm f1, not committed..." << std::endl;
+        filesystem.set_commit_interval(100);
+        filesystem.mkdir("d2");
+        filesystem.rm("f1");
+        std::cout << "child: crash" << std::endl;
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+
+    std::cout << "mount()..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Replayed 4 transactions from the journal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mount();
+    std::cout << "-----" << std::endl;
+
+    std::cout << "ls()..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "f1\t file\t rw-\t 16" << std::endl;
+    std::cout << "d1\t dir\t rwx\t -" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.ls();
+    std::cout << "-----" << std::endl;
+
+    std::cout << "cat(d1/f2)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare" << std::endl;
+    std::cout << "hej heja hejare" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    arg1 = "d1/f2";
+    filesystem.cat(arg1);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "fsck..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "fsck: checking 2048 blocks with 2 threads" << std::endl;
+    std::cout << "2 directories, 2 files, 75 of 2048 blocks in use" << std::endl;
+    std::cout << "clean" << std::endl;
+    std::cout << "fsck exit code 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    run_fsck(" -j 2");
+    std::cout << "-----" << std::endl;
+
+    // the block of d3 is written and freed in one transaction, then f3
+    // takes it for data. A replay must not write the directory back.
+    std::cout.flush();
+    pid = fork();
+    if (pid == 0) {
+        std::cout << "child: mkdir d3, rm d3, committed together..." << std::endl;
+        filesystem.set_commit_interval(100);
+        filesystem.mkdir("d3");
+        filesystem.rm("d3");
+        filesystem.set_commit_interval(1);
+        std::cout << "child: create f3, committed..." << std::endl;
+        fw = open("input2.txt", O_RDONLY);
+        dup2(fw, 0);
+        filesystem.create("f3");
+        close(fw);
+        std::cout << "child: crash" << std::endl;
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+
+    std::cout << "mount(), cat(f3)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Replayed 2 transactions from the journal" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mount();
+    arg1 = "f3";
+    filesystem.cat(arg1);
+    PRINTDIV2;
+
+    std::cout << "... Journal replay done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,157 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// files put into the tree directory, more than fit in one leaf
+#define NO_FILES 200
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+file_name(int i)
+{
+    char name[8];
+    std::snprintf(name, sizeof(name), "f%03d", i);
+    return name;
+}
+
+// the names of a listing, after its two header rows
+static std::vector<std::string>
+listed_names(const std::string &text)
+{
+    std::istringstream in(text);
+    std::string line;
+    std::vector<std::string> names;
+    std::getline(in, line);
+    std::getline(in, line);
+    while (std::getline(in, line))
+        names.push_back(line.substr(0, line.find(' ')));
+    return names;
+}
+
+void
+Shell::run()
+{
+    std::string arg1;
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "B+-tree directories ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+    filesystem.mkdir("bt", DIR_BTREE);
+
+    // the files are empty, out of name order so leaves split in the middle
+    std::cout << "create " << NO_FILES << " files in bt, rm every third, mv three..." << std::endl;
+    fw = open("/dev/null", O_RDONLY);
+    dup2(fw, 0);
+    std::set<std::string> expected;
+    for (int k = 0; k < NO_FILES; k++) {
+        int i = k * 71 % NO_FILES;
+        filesystem.create("bt/" + file_name(i));
+        expected.insert(file_name(i));
+    }
+    close(fw);
+    for (int i = 0; i < NO_FILES; i += 3) {
+        filesystem.rm("bt/" + file_name(i));
+        expected.erase(file_name(i));
+    }
+    const char *renames[][2] = { { "f001", "g001" }, { "f002", "a002" }, { "f199", "h199" } };
+    for (unsigned i = 0; i < 3; i++) {
+        filesystem.mv(std::string("bt/") + renames[i][0], std::string("bt/") + renames[i][1]);
+        expected.erase(renames[i][0]);
+        expected.insert(renames[i][1]);
+    }
+
+    std::cout << "ls(bt)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << expected.size() << " entries in name order" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::ostringstream listing;
+    FS::redirect(nullptr, &listing);
+    filesystem.cd("bt");
+    filesystem.ls();
+    filesystem.cd("..");
+    FS::redirect(nullptr, nullptr);
+    std::vector<std::string> names = listed_names(listing.str());
+    if (names != std::vector<std::string>(expected.begin(), expected.end()))
+        std::cout << names.size() << " entries, not the ones expected" << std::endl;
+    else if (!std::is_sorted(names.begin(), names.end()))
+        std::cout << names.size() << " entries not in name order" << std::endl;
+    else
+        std::cout << names.size() << " entries in name order" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "list(bt, f1, \"\", 5)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "f100\t file\t rw-\t 0" << std::endl;
+    std::cout << "f101\t file\t rw-\t 0" << std::endl;
+    std::cout << "f103\t file\t rw-\t 0" << std::endl;
+    std::cout << "f104\t file\t rw-\t 0" << std::endl;
+    std::cout << "f106\t file\t rw-\t 0" << std::endl;
+    std::cout << "more after f106" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.list("bt", "f1", "", 5);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "list(bt, f1, f106, 5)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "f107\t file\t rw-\t 0" << std::endl;
+    std::cout << "f109\t file\t rw-\t 0" << std::endl;
+    std::cout << "f110\t file\t rw-\t 0" << std::endl;
+    std::cout << "f112\t file\t rw-\t 0" << std::endl;
+    std::cout << "f113\t file\t rw-\t 0" << std::endl;
+    std::cout << "more after f113" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.list("bt", "f1", "f106", 5);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "list(bt, f19, f194, 5)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "f196\t file\t rw-\t 0" << std::endl;
+    std::cout << "f197\t file\t rw-\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.list("bt", "f19", "f194", 5);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "cat(bt/f000)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... some kind of error message" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    arg1 = "bt/f000";
+    filesystem.cat(arg1);
+    PRINTDIV2;
+
+    std::cout << "... B+-tree directories done" << std::endl;
+    PRINTDIV;
+}
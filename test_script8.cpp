@@ -0,0 +1,153 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// files put into the hashed directory, more than one block holds
+#define NO_FILES 150
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+file_name(const char *prefix, int i)
+{
+    char name[16];
+    std::snprintf(name, sizeof(name), "%s%03d", prefix, i);
+    return name;
+}
+
+// the names of a listing, after its two header rows
+static std::set<std::string>
+listed_names(const std::string &text)
+{
+    std::istringstream in(text);
+    std::string line;
+    std::set<std::string> names;
+    std::getline(in, line);
+    std::getline(in, line);
+    while (std::getline(in, line))
+        names.insert(line.substr(0, line.find(' ')));
+    return names;
+}
+
+// prints how many of names ls lists in dir and how many stat finds
+static void
+check_dir(FS &fs, const std::string &dir, const std::set<std::string> &names)
+{
+    std::ostringstream listing;
+    FS::redirect(nullptr, &listing);
+    fs.cd(dir);
+    fs.ls();
+    fs.cd("..");
+    FS::redirect(nullptr, nullptr);
+    std::set<std::string> listed = listed_names(listing.str());
+    std::cout << listed.size() << " entries listed, "
+              << (listed == names ? "the ones created" : "not the ones created") << std::endl;
+
+    Session session(fs);
+    unsigned found = 0;
+    for (std::set<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        dir_entry entry;
+        if (fs.stat(session, dir + "/" + *it, &entry) == 0)
+            found++;
+    }
+    std::cout << found << " of " << names.size() << " found" << std::endl;
+}
+
+void
+Shell::run()
+{
+    std::string arg1;
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Growing directories ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+    filesystem.mkdir("hd");
+
+    // a directory block has 64 slots, the directory splits its buckets
+    // into more blocks as it grows
+    std::cout << "create " << NO_FILES << " files in hd..." << std::endl;
+    fw = open("/dev/null", O_RDONLY);
+    dup2(fw, 0);
+    std::set<std::string> names;
+    for (int i = 0; i < NO_FILES; i++) {
+        filesystem.create("hd/" + file_name("f", i));
+        names.insert(file_name("f", i));
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << NO_FILES << " entries listed, the ones created" << std::endl;
+    std::cout << NO_FILES << " of " << NO_FILES << " found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    check_dir(filesystem, "hd", names);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "rm the even files, create " << NO_FILES / 2 << " others..." << std::endl;
+    for (int i = 0; i < NO_FILES; i += 2) {
+        filesystem.rm("hd/" + file_name("f", i));
+        names.erase(file_name("f", i));
+    }
+    for (int i = 0; i < NO_FILES / 2; i++) {
+        filesystem.create("hd/" + file_name("g", i));
+        names.insert(file_name("g", i));
+    }
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << NO_FILES << " entries listed, the ones created" << std::endl;
+    std::cout << NO_FILES << " of " << NO_FILES << " found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    check_dir(filesystem, "hd", names);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "cat(hd/f000)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... some kind of error message" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    arg1 = "hd/f000";
+    filesystem.cat(arg1);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "create(hd/content), cat(hd/content)..." << std::endl;
+    // std::cin and stdin saw the end of /dev/null
+    std::cin.clear();
+    clearerr(stdin);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("hd/content");
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    arg1 = "hd/content";
+    filesystem.cat(arg1);
+    PRINTDIV2;
+
+    std::cout << "... Growing directories done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,185 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// runs fsck on the disk file, its report goes to the standard output
+static void
+run_fsck(const std::string &args)
+{
+    std::cout.flush();
+    std::string cmd = "./fsck" + args;
+    int status = system(cmd.c_str());
+    std::cout << "fsck exit code " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << std::endl;
+}
+
+// the disk file is changed behind the back of the file system, which must
+// not write anything until it is mounted again
+static void
+set_fat(int fd, unsigned block, int32_t value)
+{
+    off_t pos = (off_t)FAT_BLOCK * BLOCK_SIZE + (off_t)block * sizeof(value);
+    if (pwrite(fd, &value, sizeof(value), pos) != sizeof(value))
+        std::cout << "Error: can't write the FAT entry of block " << block << std::endl;
+}
+
+static int32_t
+get_fat(int fd, unsigned block)
+{
+    int32_t value = FAT_FREE;
+    off_t pos = (off_t)FAT_BLOCK * BLOCK_SIZE + (off_t)block * sizeof(value);
+    if (pread(fd, &value, sizeof(value), pos) != sizeof(value))
+        std::cout << "Error: can't read the FAT entry of block " << block << std::endl;
+    return value;
+}
+
+// changes the size in the entry of name in the root directory
+static void
+set_size(int fd, const std::string &name, uint32_t size)
+{
+    dir_entry dir[BLOCK_SIZE / sizeof(dir_entry)];
+    off_t pos = (off_t)ROOT_BLOCK * BLOCK_SIZE;
+    if (pread(fd, dir, sizeof(dir), pos) != sizeof(dir))
+        return;
+    for (unsigned i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) {
+        if (name == dir[i].file_name) {
+            dir[i].size = size;
+            if (pwrite(fd, dir, sizeof(dir), pos) != sizeof(dir))
+                std::cout << "Error: can't write the root directory" << std::endl;
+            return;
+        }
+    }
+    std::cout << "Error: " << name << " not found in the root directory" << std::endl;
+}
+
+void
+Shell::run()
+{
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "fsck repairs ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f1");
+    close(fw);
+    // a and b take two blocks each
+    std::vector<uint8_t> data(2 * BLOCK_SIZE);
+    for (unsigned i = 0; i < data.size(); i++)
+        data[i] = 'a' + i % 26;
+    fw = open("/dev/null", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("a");
+    filesystem.create("b");
+    close(fw);
+    filesystem.pwrite("a", 0, data.size(), &data[0]);
+    filesystem.pwrite("b", 0, data.size(), &data[0]);
+    // mounting again applies the journal and empties it, fsck would
+    // otherwise replay it over the damage
+    filesystem.sync();
+    filesystem.mount();
+
+    Session session(filesystem);
+    dir_entry a, b;
+    filesystem.stat(session, "a", &a);
+    filesystem.stat(session, "b", &b);
+    int fd = open(DISKNAME, O_RDWR);
+    int b2 = get_fat(fd, b.first_blk);
+    // the last block of the disk is free
+    unsigned leaked = lseek(fd, 0, SEEK_END) / BLOCK_SIZE - 1;
+    std::cout << "damage: block " << leaked << " in use, a runs into the second block of b, "
+              << "f1 says 10000 bytes..." << std::endl;
+    set_fat(fd, leaked, FAT_EOF);
+    set_fat(fd, a.first_blk, b2);
+    set_size(fd, "f1", 10000);
+    fsync(fd);
+    close(fd);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "fsck..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "fsck: checking 2048 blocks with 1 threads" << std::endl;
+    std::cout << "/b: block 76 is also used by /a" << std::endl;
+    std::cout << "/f1: size 10000 does not fit a chain of 1 blocks" << std::endl;
+    std::cout << "block 74 is in use but not referenced" << std::endl;
+    std::cout << "block 2047 is in use but not referenced" << std::endl;
+    std::cout << "4 problems found" << std::endl;
+    std::cout << "1 directories, 3 files, 76 of 2048 blocks in use" << std::endl;
+    std::cout << "fsck exit code 4" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    run_fsck(" -j 1");
+    std::cout << "-----" << std::endl;
+
+    // b gets a copy of the block it shares, the size of f1 is cut to its
+    // chain and the leaked blocks are freed
+    std::cout << "fsck -r..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... the same 4 problems" << std::endl;
+    std::cout << "1 directories, 3 files, 77 of 2048 blocks in use" << std::endl;
+    std::cout << "4 problems repaired" << std::endl;
+    std::cout << "fsck exit code 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    run_fsck(" -r -j 1");
+    std::cout << "-----" << std::endl;
+
+    std::cout << "fsck..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "fsck: checking 2048 blocks with 1 threads" << std::endl;
+    std::cout << "1 directories, 3 files, 77 of 2048 blocks in use" << std::endl;
+    std::cout << "clean" << std::endl;
+    std::cout << "fsck exit code 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    run_fsck(" -j 1");
+    std::cout << "-----" << std::endl;
+
+    std::cout << "mount(), ls(), pread(a), pread(b)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "f1\t file\t rw-\t 4096" << std::endl;
+    std::cout << "a\t file\t rw-\t 8192" << std::endl;
+    std::cout << "b\t file\t rw-\t 8192" << std::endl;
+    std::cout << "a and b read back" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mount();
+    filesystem.ls();
+    std::vector<uint8_t> got_a(data.size()), got_b(data.size());
+    if (filesystem.pread("a", 0, got_a.size(), &got_a[0]) == (int)data.size() && got_a == data &&
+        filesystem.pread("b", 0, got_b.size(), &got_b[0]) == (int)data.size() && got_b == data)
+        std::cout << "a and b read back" << std::endl;
+    else
+        std::cout << "a or b changed" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "... fsck repairs done" << std::endl;
+    PRINTDIV;
+}